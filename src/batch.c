@@ -0,0 +1,322 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <strings.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "doltool.h"
+
+struct batch {
+  struct batch_job *jobs;
+  size_t count;
+  size_t next;
+  // The jobs are verified instead of converted without a converter:
+  const struct converter *converter;
+  int segment_threads;
+};
+
+static off_t file_size(const char *filename)
+{
+  struct stat st;
+  if (stat(filename, &st) != 0)
+    return 0;
+  return st.st_size;
+}
+
+static void* batch_worker(void *arg)
+{
+  struct batch *batch = arg;
+  while (1) {
+    size_t i = __sync_fetch_and_add(&batch->next, 1);
+    if (i >= batch->count)
+      return NULL;
+    struct batch_job *job = batch->jobs + i;
+    if (batch->converter)
+      job->status = convert_file(batch->converter,
+        job->dol_filename, job->elf_filename);
+    else
+      job->status = dol2elf_verify(job->dol_filename, job->elf_filename,
+        batch->segment_threads);
+    if (job->status == 0) {
+      job->dol_size = file_size(job->dol_filename);
+      job->elf_size = file_size(job->elf_filename);
+    }
+  }
+}
+
+static int convert(const struct converter *converter,
+  const char *dol_filename, const char *elf_filename)
+{
+  // The standard streams can only be converted here:
+  if (strcmp(dol_filename, "-") == 0 || strcmp(elf_filename, "-") == 0)
+    return dol2elf(dol_filename, elf_filename, converter->options,
+      converter->rel);
+
+  // Updates need the previous ELF file, not a cached one:
+  if (converter->options && (converter->options->flags & DOL2ELF_INCREMENTAL))
+    return dol2elf_update(dol_filename, elf_filename, converter->options,
+      converter->rel);
+
+  if (converter->server) {
+    int res = client_convert(converter->server, dol_filename, elf_filename,
+      converter->options, converter->rel);
+    // Convert locally when the server is not running:
+    if (res >= 0)
+      return res;
+  }
+  if (converter->cache)
+    return cache_convert(converter->cache, dol_filename, elf_filename,
+      converter->options, converter->rel);
+  return dol2elf(dol_filename, elf_filename, converter->options,
+    converter->rel);
+}
+
+int convert_file(const struct converter *converter,
+  const char *dol_filename, const char *elf_filename)
+{
+  if (!converter->stats)
+    return convert(converter, dol_filename, elf_filename);
+
+  struct stats_record record;
+  stats_begin_record(&record, dol_filename);
+  stats_record = &record;
+  STATS_BEGIN(STATS_CONVERT);
+  int res = convert(converter, dol_filename, elf_filename);
+  STATS_END(STATS_CONVERT);
+  stats_record = NULL;
+  stats_merge(converter->stats, &record, res);
+  return res;
+}
+
+static int run(struct batch *batch, int threads)
+{
+  struct batch_job *jobs = batch->jobs;
+  size_t count = batch->count;
+  if (threads < 1)
+    threads = 1;
+  if ((size_t) threads > count)
+    threads = count ? count : 1;
+
+  double start = now();
+
+  threads = run_pool(batch, batch_worker, threads);
+
+  double elapsed = now() - start;
+
+  // Summary:
+  size_t failed = 0;
+  uint64_t dol_bytes = 0, elf_bytes = 0;
+  for (size_t i = 0; i != count; ++i) {
+    if (jobs[i].status != 0) {
+      ++failed;
+    } else {
+      dol_bytes += jobs[i].dol_size;
+      elf_bytes += jobs[i].elf_size;
+    }
+  }
+  if (failed) {
+    fprintf(stderr, "%zu of %zu %s failed:\n", failed, count,
+      batch->converter ? "conversions" : "verifications");
+    for (size_t i = 0; i != count; ++i)
+      if (jobs[i].status != 0)
+        fprintf(stderr, "  %s -> %s\n", jobs[i].dol_filename, jobs[i].elf_filename);
+  }
+  if (elapsed <= 0)
+    elapsed = 1e-9;
+  if (batch->converter)
+    fprintf(stderr,
+      "%zu files (%zu failed) in %.3fs on %i threads: %.1f files/s, "
+      "%.1f MB/s read, %.1f MB/s written\n",
+      count, failed, elapsed, threads,
+      (count - failed) / elapsed,
+      dol_bytes / elapsed / 1e6, elf_bytes / elapsed / 1e6);
+  else
+    fprintf(stderr,
+      "%zu files (%zu failed) verified in %.3fs on %i threads: %.1f files/s, "
+      "%.1f MB/s read\n",
+      count, failed, elapsed, threads,
+      (count - failed) / elapsed,
+      (dol_bytes + elf_bytes) / elapsed / 1e6);
+
+  return failed ? 1 : 0;
+}
+
+int batch_run(struct batch_job *jobs, size_t count, int threads,
+  const struct converter *converter)
+{
+  struct batch batch = { jobs, count, 0, converter, 0 };
+  return run(&batch, threads);
+}
+
+int batch_verify(struct batch_job *jobs, size_t count, int threads,
+  int segment_threads)
+{
+  // The threads left by the files are given to their segments:
+  if (segment_threads <= 0)
+    segment_threads = count < 2 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  struct batch batch = { jobs, count, 0, NULL, segment_threads };
+  return run(&batch, threads);
+}
+
+// Manifest: one "foo.dol foo.elf" pair per line, '#' starts a comment line.
+int batch_load_manifest(const char *filename,
+  struct batch_job **jobs, size_t *count)
+{
+  FILE *file = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    return -1;
+  }
+
+  size_t allocated = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  size_t lineno = 0;
+  int res = 0;
+  while ((len = getline(&line, &line_size, file)) >= 0) {
+    ++lineno;
+    char *dol = line + strspn(line, " \t\r\n");
+    if (*dol == '\0' || *dol == '#')
+      continue;
+    char *elf = dol + strcspn(dol, " \t\r\n");
+    if (*elf != '\0')
+      *elf++ = '\0';
+    elf += strspn(elf, " \t\r\n");
+    char *end = elf + strcspn(elf, " \t\r\n");
+    *end = '\0';
+    if (*elf == '\0') {
+      fprintf(stderr, "%s:%zu: missing ELF filename\n", filename, lineno);
+      res = -1;
+      break;
+    }
+
+    if (*count == allocated) {
+      size_t grown_size = allocated ? allocated * 2 : 64;
+      struct batch_job *grown = realloc(*jobs, grown_size * sizeof(struct batch_job));
+      if (!grown) {
+        fputs("Could not allocate memory\n", stderr);
+        res = -1;
+        break;
+      }
+      *jobs = grown;
+      allocated = grown_size;
+    }
+    struct batch_job *job = *jobs + *count;
+    memset(job, 0, sizeof(struct batch_job));
+    job->dol_filename = strdup(dol);
+    job->elf_filename = strdup(elf);
+    if (!job->dol_filename || !job->elf_filename) {
+      fputs("Could not allocate memory\n", stderr);
+      free((char*) job->dol_filename);
+      free((char*) job->elf_filename);
+      res = -1;
+      break;
+    }
+    ++*count;
+  }
+
+  free(line);
+  if (file != stdin)
+    fclose(file);
+  return res;
+}
+
+// DOL files, GameCube disc images and REL modules:
+int batch_is_input(const char *name)
+{
+  static const char *const extensions[] = { ".dol", ".iso", ".gcm", ".rel" };
+  const char *extension = strrchr(name, '.');
+  if (!extension || name[0] == '.')
+    return 0;
+  for (size_t i = 0; i != sizeof(extensions) / sizeof(extensions[0]); ++i)
+    if (strcasecmp(extension, extensions[i]) == 0)
+      return 1;
+  return 0;
+}
+
+static int scan_filter(const struct dirent *dirent)
+{
+  return batch_is_input(dirent->d_name);
+}
+
+// DIR/foo.iso is converted to OUTPUT/foo.elf:
+int batch_job_init(struct batch_job *job, const char *dir, const char *name,
+  const char *output)
+{
+  int stem = strrchr(name, '.') - name;
+  char *dol_filename, *elf_filename;
+  if (asprintf(&dol_filename, "%s/%s", dir, name) < 0)
+    return -1;
+  if (asprintf(&elf_filename, "%s/%.*s.elf", output, stem, name) < 0) {
+    free(dol_filename);
+    return -1;
+  }
+  memset(job, 0, sizeof(struct batch_job));
+  job->dol_filename = dol_filename;
+  job->elf_filename = elf_filename;
+  return 0;
+}
+
+// Directory: the inputs of DIR are converted into OUTPUT, created unless
+// create is 0.
+int batch_scan_directory(const char *dir, const char *output, int create,
+  struct batch_job **jobs, size_t *count)
+{
+  struct dirent **entries;
+  int n = scandir(dir, &entries, scan_filter, alphasort);
+  if (n < 0) {
+    fprintf(stderr, "Could not read directory %s\n", dir);
+    return -1;
+  }
+  if (create && mkdir(output, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Could not create directory %s\n", output);
+    for (int i = 0; i != n; ++i)
+      free(entries[i]);
+    free(entries);
+    return -1;
+  }
+
+  struct batch_job *grown = realloc(*jobs, (*count + n) * sizeof(struct batch_job));
+  if (!grown && n) {
+    fputs("Could not allocate memory\n", stderr);
+    for (int i = 0; i != n; ++i)
+      free(entries[i]);
+    free(entries);
+    return -1;
+  }
+  *jobs = grown;
+  for (int i = 0; i != n; ++i) {
+    if (batch_job_init(*jobs + *count, dir, entries[i]->d_name, output) == 0)
+      ++*count;
+    free(entries[i]);
+  }
+  free(entries);
+  return 0;
+}
@@ -0,0 +1,461 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "doltool.h"
+
+// Conversion phases:
+enum {
+  PHASE_READ_HEADER,
+  PHASE_PREPARE,
+  PHASE_STRTAB_FILL,
+  PHASE_CREATE_HDRS,
+  PHASE_WRITE_HEADERS,
+  PHASE_COPY_PAYLOAD,
+  PHASE_COUNT
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+  "read_header",
+  "prepare",
+  "strtab_fill",
+  "create_hdrs",
+  "write_headers",
+  "copy_payload",
+};
+
+// Sub-microsecond phases are timed over many iterations:
+#define MICRO_ITERATIONS 1000
+
+enum layout {
+  LAYOUT_FULL,
+  LAYOUT_SPARSE,
+  LAYOUT_BIG_BSS,
+  LAYOUT_COUNT
+};
+
+static const char *layout_names[LAYOUT_COUNT] = {
+  "full",
+  "sparse",
+  "big_bss",
+};
+
+static const uint64_t sizes[] = {
+  64 * 1024,
+  1024 * 1024,
+  16 * 1024 * 1024,
+  256 * 1024 * 1024,
+};
+
+struct bench_result {
+  double phases[PHASE_COUNT];
+  uint64_t dol_size;
+  uint64_t elf_size;
+};
+
+// ***** Synthetic DOL files
+
+static void generate_header(enum layout layout, uint64_t payload, Dol_Hdr *dhdr)
+{
+  memset(dhdr, 0, sizeof(Dol_Hdr));
+  uint32_t file_offset = sizeof(Dol_Hdr);
+  uint32_t vaddr = 0x80003100;
+  uint32_t bss_size = 0x10000;
+
+  switch (layout) {
+  case LAYOUT_FULL: {
+    // All the 18 segments:
+    uint32_t segment_size = (payload / (DOL_TEXT_COUNT + DOL_DATA_COUNT)) & ~31u;
+    for (int i=0; i != DOL_TEXT_COUNT; ++i)
+      synthetic_add_text(dhdr, i, segment_size, &file_offset, &vaddr);
+    for (int i=0; i != DOL_DATA_COUNT; ++i)
+      synthetic_add_data(dhdr, i, segment_size, &file_offset, &vaddr);
+    break;
+  }
+  case LAYOUT_SPARSE: {
+    // A few segments in scattered slots with address gaps:
+    static const int text_slots[] = { 0, 3, 6 };
+    static const int data_slots[] = { 1, 7 };
+    uint32_t segment_size = (payload / 5) & ~31u;
+    for (int i=0; i != 3; ++i) {
+      synthetic_add_text(dhdr, text_slots[i], segment_size, &file_offset, &vaddr);
+      vaddr += 0x10000;
+    }
+    for (int i=0; i != 2; ++i) {
+      synthetic_add_data(dhdr, data_slots[i], segment_size, &file_offset, &vaddr);
+      vaddr += 0x10000;
+    }
+    break;
+  }
+  case LAYOUT_BIG_BSS: {
+    uint32_t segment_size = (payload / 2) & ~31u;
+    synthetic_add_text(dhdr, 0, segment_size, &file_offset, &vaddr);
+    synthetic_add_data(dhdr, 0, segment_size, &file_offset, &vaddr);
+    bss_size = 0x1000000;
+    break;
+  }
+  default:
+    break;
+  }
+
+  dhdr->bss_address = htonl(vaddr);
+  dhdr->bss_size = htonl(bss_size);
+  dhdr->entry_point = dhdr->text_address[0];
+}
+
+static int generate_dol(const char *filename, enum layout layout, uint64_t payload)
+{
+  Dol_Hdr dhdr;
+  generate_header(layout, payload, &dhdr);
+
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    return -1;
+  }
+
+  // Pseudo-random payload:
+  size_t buffer_size = 1024 * 1024;
+  uint32_t *buffer = malloc(buffer_size);
+  uint32_t state = 0x12345678;
+  for (size_t i = 0; i != buffer_size / sizeof(uint32_t); ++i)
+    buffer[i] = synthetic_random(&state);
+
+  int res = pwrite(fd, &dhdr, sizeof(Dol_Hdr), 0) == sizeof(Dol_Hdr) ? 0 : -1;
+  uint64_t offset = 0;
+  while (res == 0 && offset < payload) {
+    size_t count = payload - offset < buffer_size ? payload - offset : buffer_size;
+    if (pwrite(fd, buffer, count, sizeof(Dol_Hdr) + offset) != (ssize_t) count)
+      res = -1;
+    offset += count;
+  }
+  free(buffer);
+  if (close(fd) != 0 || res != 0) {
+    fprintf(stderr, "Could not write %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+// ***** Timed conversion
+
+static int bench_convert(const char *dol_filename, const char *elf_filename,
+  const struct dol2elf_options *options, struct bench_result *result)
+{
+  memset(result, 0, sizeof(struct bench_result));
+  struct Elf elf;
+  memset(&elf, 0, sizeof(struct Elf));
+  int res = -1;
+  int elf_fd = -1;
+
+  double start = now();
+  int dol_fd = open(dol_filename, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  Dol_Hdr dhdr;
+  if (dol_fd < 0 || fstat(dol_fd, &st) != 0
+    || pread(dol_fd, &dhdr, sizeof(Dol_Hdr), 0) != sizeof(Dol_Hdr)) {
+    fprintf(stderr, "Could not read %s\n", dol_filename);
+    goto out;
+  }
+  double t = now();
+  result->phases[PHASE_READ_HEADER] = t - start;
+
+  start = t;
+  if (elf_prepare(&dhdr, NULL, st.st_size, options, &elf) != 0) {
+    fprintf(stderr, "Invalid DOL file %s\n", dol_filename);
+    goto out;
+  }
+  t = now();
+  result->phases[PHASE_PREPARE] = t - start;
+
+  // Parts of elf_prepare():
+  start = t;
+  for (int i = 0; i != MICRO_ITERATIONS; ++i) {
+    struct strtab_info strtab;
+    strtab_create(&strtab);
+    strtab_fill(&strtab, &dhdr, options->symbols != NULL);
+    strtab_destroy(&strtab);
+  }
+  t = now();
+  result->phases[PHASE_STRTAB_FILL] = (t - start) / MICRO_ITERATIONS;
+
+  start = t;
+  for (int i = 0; i != MICRO_ITERATIONS; ++i) {
+    free(elf.shdrs);
+    free(elf.phdrs);
+    create_shdrs(&dhdr, &elf);
+    create_phdrs(&dhdr, &elf);
+  }
+  t = now();
+  result->phases[PHASE_CREATE_HDRS] = (t - start) / MICRO_ITERATIONS;
+
+  start = t;
+  elf_fd = open(elf_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  struct iovec iov[ELF_HEADERS_IOV_MAX];
+  if (elf_fd < 0 || writev_all(elf_fd, iov, elf_headers_iov(&elf, iov)) != 0) {
+    fprintf(stderr, "Could not write %s\n", elf_filename);
+    goto out;
+  }
+  t = now();
+  result->phases[PHASE_WRITE_HEADERS] = t - start;
+
+  start = t;
+  for (size_t i = 0; i != elf.extent_count; ++i) {
+    const struct elf_extent *extent = elf.extents + i;
+    if (fd_copy(dol_fd, extent->src_offset, elf_fd, extent->offset, extent->size) != 0) {
+      fprintf(stderr, "Could not copy %s\n", dol_filename);
+      goto out;
+    }
+  }
+  if (ftruncate(elf_fd, elf.size) != 0 || close(elf_fd) != 0) {
+    elf_fd = -1;
+    fprintf(stderr, "Could not write %s\n", elf_filename);
+    goto out;
+  }
+  elf_fd = -1;
+  result->phases[PHASE_COPY_PAYLOAD] = now() - start;
+
+  result->dol_size = st.st_size;
+  result->elf_size = elf.size;
+  res = 0;
+
+out:
+  if (dol_fd >= 0)
+    close(dol_fd);
+  if (elf_fd >= 0)
+    close(elf_fd);
+  elf_free(&elf);
+  return res;
+}
+
+// Phases actually run by a conversion (the others are parts of prepare):
+static double total_time(const struct bench_result *result)
+{
+  return result->phases[PHASE_READ_HEADER]
+    + result->phases[PHASE_PREPARE]
+    + result->phases[PHASE_WRITE_HEADERS]
+    + result->phases[PHASE_COPY_PAYLOAD];
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double*) a, y = *(const double*) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Median over the repetitions, as one JSON line:
+static void report(FILE *file, enum layout layout, uint64_t payload,
+  const struct dol2elf_options *options,
+  struct bench_result *results, int repetitions, double *mbps, double *files_per_s)
+{
+  double *values = malloc(repetitions * sizeof(double));
+  fprintf(file, "{\"layout\":\"%s\",\"compact\":%s,\"payload\":%" PRIu64
+    ",\"dol_size\":%" PRIu64 ",\"elf_size\":%" PRIu64 ",\"repetitions\":%i",
+    layout_names[layout], options->flags & DOL2ELF_COMPACT ? "true" : "false",
+    payload, results[0].dol_size, results[0].elf_size, repetitions);
+  for (int phase = 0; phase != PHASE_COUNT; ++phase) {
+    for (int i = 0; i != repetitions; ++i)
+      values[i] = results[i].phases[phase];
+    qsort(values, repetitions, sizeof(double), compare_double);
+    fprintf(file, ",\"%s_s\":%.9f", phase_names[phase], values[repetitions / 2]);
+  }
+  for (int i = 0; i != repetitions; ++i)
+    values[i] = total_time(results + i);
+  qsort(values, repetitions, sizeof(double), compare_double);
+  double total = values[repetitions / 2];
+  if (total <= 0)
+    total = 1e-9;
+  *mbps = results[0].dol_size / total / 1e6;
+  *files_per_s = 1 / total;
+  fprintf(file, ",\"total_s\":%.9f,\"mb_per_s\":%.3f,\"files_per_s\":%.3f}\n",
+    total, *mbps, *files_per_s);
+  fflush(file);
+  free(values);
+}
+
+static void remove_dir(const char *path)
+{
+  DIR *dir = opendir(path);
+  if (dir) {
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)))
+      if (dirent->d_name[0] != '.')
+        unlinkat(dirfd(dir), dirent->d_name, 0);
+    closedir(dir);
+  }
+  rmdir(path);
+}
+
+static void usage(FILE *file)
+{
+  fputs(
+    "Usage: dol2elf_bench [options]\n"
+    "\n"
+    "Convert synthetic DOL files and print one JSON line per configuration\n"
+    "with the median time of each conversion phase.\n"
+    "\n"
+    "  -d, --dir DIR          work directory (default: a new directory in $TMPDIR)\n"
+    "  -n, --repetitions N    conversions per configuration (default 5)\n"
+    "  -m, --max-size N       largest payload in MiB (default 256)\n"
+    "  -c, --compact          use the compact layout\n"
+    "      --min-mbps N       fail if a configuration of at least 1 MiB is slower\n"
+    "      --min-files N      fail if a configuration converts fewer files/s\n"
+    "  -k, --keep             keep the generated files\n",
+    file);
+}
+
+int main(int argc, char **argv)
+{
+  static const struct option long_options[] = {
+    { "dir",         required_argument, NULL, 'd' },
+    { "repetitions", required_argument, NULL, 'n' },
+    { "max-size",    required_argument, NULL, 'm' },
+    { "compact",     no_argument,       NULL, 'c' },
+    { "min-mbps",    required_argument, NULL, 'B' },
+    { "min-files",   required_argument, NULL, 'F' },
+    { "keep",        no_argument,       NULL, 'k' },
+    { "help",        no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  const char *dir = NULL;
+  int repetitions = 5;
+  uint64_t max_size = 256 * 1024 * 1024;
+  double min_mbps = 0, min_files = 0;
+  int keep = 0;
+  struct dol2elf_options options;
+  memset(&options, 0, sizeof(options));
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "d:n:m:ckh", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'd':
+      dir = optarg;
+      break;
+    case 'n':
+      repetitions = atoi(optarg);
+      if (repetitions < 1)
+        repetitions = 1;
+      break;
+    case 'm':
+      max_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+      break;
+    case 'c':
+      options.flags |= DOL2ELF_COMPACT;
+      break;
+    case 'B':
+      min_mbps = atof(optarg);
+      break;
+    case 'F':
+      min_files = atof(optarg);
+      break;
+    case 'k':
+      keep = 1;
+      break;
+    case 'h':
+      usage(stdout);
+      return 0;
+    default:
+      usage(stderr);
+      return 1;
+    }
+  }
+
+  char dir_buffer[PATH_MAX];
+  if (!dir) {
+    const char *tmpdir = getenv("TMPDIR");
+    if (snprintf(dir_buffer, sizeof(dir_buffer), "%s/dol2elf_bench.XXXXXX",
+        tmpdir ? tmpdir : "/tmp") >= (int) sizeof(dir_buffer)
+      || !mkdtemp(dir_buffer)) {
+      fprintf(stderr, "Could not create %s\n", dir_buffer);
+      return 1;
+    }
+    dir = dir_buffer;
+  } else if (mkdir(dir, 0777) != 0 && access(dir, W_OK) != 0) {
+    fprintf(stderr, "Could not create %s\n", dir);
+    return 1;
+  }
+
+  char dol_filename[PATH_MAX + sizeof("/bench.dol")];
+  char elf_filename[PATH_MAX + sizeof("/bench.elf")];
+  if (strlen(dir) >= PATH_MAX) {
+    fprintf(stderr, "Directory name too long: %s\n", dir);
+    return 1;
+  }
+  snprintf(dol_filename, sizeof(dol_filename), "%s/bench.dol", dir);
+  snprintf(elf_filename, sizeof(elf_filename), "%s/bench.elf", dir);
+
+  struct bench_result *results = calloc(repetitions, sizeof(struct bench_result));
+  int res = 0;
+  for (size_t s = 0; s != sizeof(sizes) / sizeof(sizes[0]) && res == 0; ++s) {
+    if (sizes[s] > max_size)
+      break;
+    for (int layout = 0; layout != LAYOUT_COUNT && res == 0; ++layout) {
+      if (generate_dol(dol_filename, layout, sizes[s]) != 0) {
+        res = 1;
+        break;
+      }
+      for (int i = 0; i != repetitions; ++i)
+        if (bench_convert(dol_filename, elf_filename, &options, results + i) != 0) {
+          res = 1;
+          break;
+        }
+      if (res)
+        break;
+      double mbps, files_per_s;
+      report(stdout, layout, sizes[s], &options, results, repetitions,
+        &mbps, &files_per_s);
+      if (min_mbps && sizes[s] >= 1024 * 1024 && mbps < min_mbps) {
+        fprintf(stderr, "%s/%" PRIu64 ": %.1f MB/s is below the %.1f MB/s target\n",
+          layout_names[layout], sizes[s], mbps, min_mbps);
+        res = 2;
+      }
+      if (min_files && files_per_s < min_files) {
+        fprintf(stderr, "%s/%" PRIu64 ": %.1f files/s is below the %.1f files/s target\n",
+          layout_names[layout], sizes[s], files_per_s, min_files);
+        res = 2;
+      }
+    }
+  }
+  free(results);
+
+  if (!keep) {
+    unlink(dol_filename);
+    unlink(elf_filename);
+    if (dir == dir_buffer)
+      remove_dir(dir);
+  }
+  return res;
+}
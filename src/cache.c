@@ -0,0 +1,325 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "doltool.h"
+
+// Bump when the generated ELF files change for the same input:
+#define CACHE_VERSION 1
+
+// Evict down to this fraction of the maximum size:
+#define CACHE_LOW_WATERMARK(size) ((size) / 10 * 9)
+
+struct cache_entry {
+  struct timespec mtime;
+  uint64_t size;
+  char *path;
+};
+
+int cache_open(struct cache *cache, const char *dir, uint64_t max_size)
+{
+  memset(cache, 0, sizeof(struct cache));
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+    fprintf(error_file(), "Could not create cache directory %s\n", dir);
+    return -1;
+  }
+  cache->dir = strdup(dir);
+  cache->max_size = max_size;
+  return 0;
+}
+
+void cache_close(struct cache *cache)
+{
+  if (cache->max_size)
+    cache_evict(cache);
+  free(cache->dir);
+  cache->dir = NULL;
+}
+
+static uint64_t options_hash(const struct dol2elf_options *options,
+  const struct rel_options *rel)
+{
+  uint64_t fields[7] = {
+    CACHE_VERSION,
+    options ? options->flags : 0,
+    options ? options->align : 0,
+    options ? options->compress_level : 0,
+    rel != NULL,
+    rel ? rel->base : 0,
+    options && options->symbols ? options->symbols->hash : 0,
+  };
+  return hash64(fields, sizeof(fields), 0);
+}
+
+// Only the DOL is hashed when converting a disc image:
+static int cache_key(int dol_fd, const char *dol_filename,
+  const struct dol2elf_options *options, const struct rel_options *rel,
+  uint64_t *key)
+{
+  struct dol_source source;
+  Dol_Hdr dhdr;
+  if (dol_locate(dol_fd, dol_filename, &source, &dhdr) != 0)
+    return -1;
+  struct dol_mapping mapping;
+  if (dol_map(dol_fd, &source, &mapping) != 0) {
+    fprintf(error_file(), "Could not map %s\n", dol_filename);
+    return -1;
+  }
+  *key = hash64(mapping.data, source.size, options_hash(options, rel));
+  dol_unmap(&mapping);
+  return 0;
+}
+
+// Reflink or copy the cache entry to the output. Never hard link it: the
+// output would share the inode of the entry and the next conversion
+// writing over the output would change the cached ELF file.
+static int cache_materialize(int entry_fd, const char *elf_filename)
+{
+  if (unlink(elf_filename) != 0 && errno != ENOENT) {
+    fprintf(error_file(), "Could not replace %s\n", elf_filename);
+    return -1;
+  }
+
+  int elf_fd = open(elf_filename, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (elf_fd >= 0) {
+    if (ioctl(elf_fd, FICLONE, entry_fd) == 0)
+      return close(elf_fd);
+    close(elf_fd);
+    unlink(elf_filename);
+  }
+
+  struct stat st;
+  elf_fd = open(elf_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (elf_fd < 0) {
+    fprintf(error_file(), "Could not open %s\n", elf_filename);
+    return -1;
+  }
+  if (fstat(entry_fd, &st) != 0 || fd_copy(entry_fd, 0, elf_fd, 0, st.st_size) != 0) {
+    fprintf(error_file(), "Could not write %s\n", elf_filename);
+    close(elf_fd);
+    unlink(elf_filename);
+    return -1;
+  }
+  return close(elf_fd);
+}
+
+// Convert into a temporary file and publish it atomically:
+static int cache_store(struct cache *cache, int dol_fd, const char *dol_filename,
+  const struct dol2elf_options *options, const struct rel_options *rel,
+  const char *entry_path)
+{
+  char subdir[PATH_MAX];
+  snprintf(subdir, sizeof(subdir), "%s", entry_path);
+  *strrchr(subdir, '/') = '\0';
+  if (mkdir(subdir, 0777) != 0 && errno != EEXIST) {
+    fprintf(error_file(), "Could not create cache directory %s\n", subdir);
+    return -1;
+  }
+
+  // Not an entry for cache_evict() until renamed, as it does not end in .elf:
+  struct aside_file entry;
+  if (aside_open(&entry, entry_path) != 0) {
+    fprintf(error_file(), "Could not create a temporary file in %s\n", cache->dir);
+    return -1;
+  }
+  struct stat st;
+  if (dol2elf_fd(dol_fd, entry.fd, dol_filename, options, rel) != 0
+    || fstat(entry.fd, &st) != 0) {
+    aside_abort(&entry);
+    return -1;
+  }
+  // Cache entries are never written after being stored:
+  if (aside_commit(&entry, entry_path, 0444) != 0) {
+    fprintf(error_file(), "Could not store %s in the cache\n", dol_filename);
+    return -1;
+  }
+
+  __sync_fetch_and_add(&cache->stored_bytes, st.st_size);
+  uint64_t pending = __sync_add_and_fetch(&cache->pending_bytes, st.st_size);
+  if (cache->max_size && pending > cache->max_size / 8) {
+    __sync_fetch_and_sub(&cache->pending_bytes, pending);
+    cache_evict(cache);
+  }
+  return 0;
+}
+
+int cache_convert(struct cache *cache, const char *dol_filename,
+  const char *elf_filename, const struct dol2elf_options *options,
+  const struct rel_options *rel)
+{
+  int dol_fd = open(dol_filename, O_RDONLY | O_CLOEXEC);
+  if (dol_fd < 0) {
+    fprintf(error_file(), "Could not open %s\n", dol_filename);
+    return 1;
+  }
+  STATS_BEGIN(STATS_CACHE_LOOKUP);
+  uint64_t key;
+  if (cache_key(dol_fd, dol_filename, options, rel, &key) != 0) {
+    close(dol_fd);
+    return 1;
+  }
+
+  char entry_path[PATH_MAX];
+  snprintf(entry_path, sizeof(entry_path), "%s/%02x/%016" PRIx64 ".elf",
+    cache->dir, (unsigned) (key >> 56), key);
+
+  int entry_fd = open(entry_path, O_RDONLY | O_CLOEXEC);
+  STATS_ADD(STATS_SYSCALLS, 1);
+  STATS_END(STATS_CACHE_LOOKUP);
+  if (entry_fd >= 0) {
+    __sync_fetch_and_add(&cache->hits, 1);
+    STATS_ADD(STATS_CACHE_HITS, 1);
+    // Most recently used:
+    futimens(entry_fd, NULL);
+  } else {
+    __sync_fetch_and_add(&cache->misses, 1);
+    STATS_ADD(STATS_CACHE_MISSES, 1);
+    if (cache_store(cache, dol_fd, dol_filename, options, rel, entry_path) != 0) {
+      close(dol_fd);
+      return 1;
+    }
+    entry_fd = open(entry_path, O_RDONLY | O_CLOEXEC);
+    if (entry_fd < 0) {
+      fprintf(error_file(), "Could not open %s\n", entry_path);
+      close(dol_fd);
+      return 1;
+    }
+  }
+  close(dol_fd);
+
+  STATS_BEGIN(STATS_CACHE_MATERIALIZE);
+  int res = cache_materialize(entry_fd, elf_filename);
+  close(entry_fd);
+  STATS_END(STATS_CACHE_MATERIALIZE);
+  return res == 0 ? 0 : 1;
+}
+
+// ***** Eviction
+
+static int entry_compare(const void *a, const void *b)
+{
+  const struct cache_entry *x = a;
+  const struct cache_entry *y = b;
+  if (x->mtime.tv_sec != y->mtime.tv_sec)
+    return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+  if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+static void scan_subdir(const char *path, struct cache_entry **entries,
+  size_t *count, size_t *allocated, uint64_t *total)
+{
+  DIR *dir = opendir(path);
+  if (!dir)
+    return;
+  struct dirent *dirent;
+  while ((dirent = readdir(dir))) {
+    const char *suffix = strrchr(dirent->d_name, '.');
+    if (!suffix || strcmp(suffix, ".elf") != 0)
+      continue;
+    struct stat st;
+    if (fstatat(dirfd(dir), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+      continue;
+    if (*count == *allocated) {
+      *allocated = *allocated ? 2 * *allocated : 1024;
+      *entries = realloc(*entries, *allocated * sizeof(struct cache_entry));
+    }
+    struct cache_entry *entry = *entries + (*count)++;
+    entry->mtime = st.st_mtim;
+    entry->size = st.st_size;
+    if (asprintf(&entry->path, "%s/%s", path, dirent->d_name) < 0)
+      entry->path = NULL;
+    *total += st.st_size;
+  }
+  closedir(dir);
+}
+
+// Least recently used entries go first. Only one process evicts at a time;
+// readers never lock: an entry removed under them stays readable.
+void cache_evict(struct cache *cache)
+{
+  char lock_path[PATH_MAX];
+  snprintf(lock_path, sizeof(lock_path), "%s/lock", cache->dir);
+  int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (lock_fd < 0)
+    return;
+  if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    close(lock_fd);
+    return;
+  }
+
+  struct cache_entry *entries = NULL;
+  size_t count = 0, allocated = 0;
+  uint64_t total = 0;
+  DIR *dir = opendir(cache->dir);
+  if (dir) {
+    struct dirent *dirent;
+    while ((dirent = readdir(dir))) {
+      if (strlen(dirent->d_name) != 2
+        || strspn(dirent->d_name, "0123456789abcdef") != 2)
+        continue;
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s/%s", cache->dir, dirent->d_name);
+      scan_subdir(path, &entries, &count, &allocated, &total);
+    }
+    closedir(dir);
+  }
+
+  if (total > cache->max_size) {
+    qsort(entries, count, sizeof(struct cache_entry), entry_compare);
+    for (size_t i = 0; i != count && total > CACHE_LOW_WATERMARK(cache->max_size); ++i) {
+      if (entries[i].path && unlink(entries[i].path) == 0) {
+        total -= entries[i].size;
+        __sync_fetch_and_add(&cache->evictions, 1);
+      }
+    }
+  }
+
+  for (size_t i = 0; i != count; ++i)
+    free(entries[i].path);
+  free(entries);
+  flock(lock_fd, LOCK_UN);
+  close(lock_fd);
+}
+
+void cache_print_stats(const struct cache *cache, FILE *file)
+{
+  fprintf(file,
+    "cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " bytes stored, "
+    "%" PRIu64 " evictions\n",
+    cache->hits, cache->misses, cache->stored_bytes, cache->evictions);
+}
@@ -0,0 +1,191 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <elf.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "doltool.h"
+
+#ifndef ELFCOMPRESS_ZSTD
+#define ELFCOMPRESS_ZSTD 2
+#endif
+
+struct compress_job {
+  const unsigned char *data;
+  uint32_t size;
+  struct compressed *output;
+  int res;
+};
+
+struct compress_pool {
+  struct compress_job *jobs;
+  size_t count;
+  size_t next;
+  unsigned flags;
+  int level;
+};
+
+int compress_supported(unsigned flags)
+{
+#ifndef HAVE_ZLIB
+  if (flags & DOL2ELF_COMPRESS_ZLIB)
+    return 0;
+#endif
+#ifndef HAVE_ZSTD
+  if (flags & DOL2ELF_COMPRESS_ZSTD)
+    return 0;
+#endif
+  return 1;
+}
+
+// Elf32_Chdr followed by the compressed data:
+static int compress_segment(const unsigned char *data, uint32_t size,
+  unsigned flags, int level, struct compressed *output)
+{
+  size_t capacity = 0;
+  uint32_t type = 0;
+#ifdef HAVE_ZSTD
+  if (flags & DOL2ELF_COMPRESS_ZSTD) {
+    capacity = ZSTD_compressBound(size);
+    type = ELFCOMPRESS_ZSTD;
+  }
+#endif
+#ifdef HAVE_ZLIB
+  if (flags & DOL2ELF_COMPRESS_ZLIB) {
+    capacity = compressBound(size);
+    type = ELFCOMPRESS_ZLIB;
+  }
+#endif
+  if (!type)
+    return -1;
+
+  unsigned char *buffer = malloc(sizeof(Elf32_Chdr) + capacity);
+  if (!buffer)
+    return -1;
+  Elf32_Chdr chdr;
+  chdr.ch_type = htonl(type);
+  chdr.ch_size = htonl(size);
+  chdr.ch_addralign = htonl(1);
+  memcpy(buffer, &chdr, sizeof(Elf32_Chdr));
+
+  size_t compressed_size = 0;
+#ifdef HAVE_ZLIB
+  if (type == ELFCOMPRESS_ZLIB) {
+    uLongf length = capacity;
+    if (compress2(buffer + sizeof(Elf32_Chdr), &length, data, size,
+        level ? level : Z_DEFAULT_COMPRESSION) != Z_OK) {
+      free(buffer);
+      return -1;
+    }
+    compressed_size = length;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (type == ELFCOMPRESS_ZSTD) {
+    size_t length = ZSTD_compress(buffer + sizeof(Elf32_Chdr), capacity,
+      data, size, level ? level : 3);
+    if (ZSTD_isError(length)) {
+      free(buffer);
+      return -1;
+    }
+    compressed_size = length;
+  }
+#endif
+
+  output->data = buffer;
+  output->size = sizeof(Elf32_Chdr) + compressed_size;
+  return 0;
+}
+
+static void *compress_worker(void *arg)
+{
+  struct compress_pool *pool = arg;
+  while (1) {
+    size_t i = __sync_fetch_and_add(&pool->next, 1);
+    if (i >= pool->count)
+      return NULL;
+    struct compress_job *job = pool->jobs + i;
+    job->res = compress_segment(job->data, job->size, pool->flags, pool->level,
+      job->output);
+  }
+}
+
+// Compress all the text and data segments, each one on its own thread:
+int compress_segments(const Dol_Hdr *dhdr, const void *dol, uint64_t dol_size,
+  const struct dol2elf_options *options, struct Elf *elf)
+{
+  struct compress_job jobs[DOL_TEXT_COUNT + DOL_DATA_COUNT];
+  size_t count = 0;
+  const unsigned char *base = dol;
+
+  for (int i=0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i]) {
+      uint32_t offset = ntohl(dhdr->text_offset[i]), size = ntohl(dhdr->text_size[i]);
+      if ((uint64_t) offset + size > dol_size)
+        return -1;
+      struct compress_job job = { base + offset, size, elf->text_compressed + i, 0 };
+      jobs[count++] = job;
+    }
+  for (int i=0; i != DOL_DATA_COUNT; ++i)
+    if (dhdr->data_size[i]) {
+      uint32_t offset = ntohl(dhdr->data_offset[i]), size = ntohl(dhdr->data_size[i]);
+      if ((uint64_t) offset + size > dol_size)
+        return -1;
+      struct compress_job job = { base + offset, size, elf->data_compressed + i, 0 };
+      jobs[count++] = job;
+    }
+
+  struct compress_pool pool = { jobs, count, 0, options->flags, options->compress_level };
+  size_t threads = options->threads;
+  if (threads == 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > count)
+    threads = count;
+
+  run_pool(&pool, compress_worker, threads);
+
+  for (size_t i = 0; i != count; ++i)
+    if (jobs[i].res != 0)
+      return -1;
+  elf->compressed = 1;
+  return 0;
+}
+
+void compressed_free(struct Elf *elf)
+{
+  for (int i=0; i != DOL_TEXT_COUNT; ++i)
+    free(elf->text_compressed[i].data);
+  for (int i=0; i != DOL_DATA_COUNT; ++i)
+    free(elf->data_compressed[i].data);
+}
@@ -0,0 +1,237 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "doltool.h"
+
+#define YAZ0_HEADER_SIZE 16
+
+static uint32_t read_be32(const unsigned char *data)
+{
+  return (uint32_t) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+// None of these magic numbers is a plausible DOL text offset:
+int decode_detect(const void *data, size_t size)
+{
+  const unsigned char *bytes = data;
+  if (size >= YAZ0_HEADER_SIZE && memcmp(bytes, "Yaz0", 4) == 0)
+    return DECODE_YAZ0;
+  if (size >= 18 && bytes[0] == 0x1f && bytes[1] == 0x8b)
+    return DECODE_GZIP;
+  if (size >= 4 && read_be32(bytes) == 0x28b52ffd)
+    return DECODE_ZSTD;
+  return DECODE_NONE;
+}
+
+const char *decode_name(int format)
+{
+  switch (format) {
+  case DECODE_YAZ0:
+    return "Yaz0";
+  case DECODE_GZIP:
+    return "gzip";
+  case DECODE_ZSTD:
+    return "zstd";
+  default:
+    return "raw";
+  }
+}
+
+int decode_size(int format, const void *data, size_t size, uint64_t *decoded_size)
+{
+  const unsigned char *bytes = data;
+  switch (format) {
+  case DECODE_YAZ0:
+    *decoded_size = read_be32(bytes + 4);
+    return 0;
+#ifdef HAVE_ZLIB
+  case DECODE_GZIP:
+    // ISIZE trailer, modulo 2^32 which is more than any DOL:
+    *decoded_size = (uint32_t) bytes[size - 1] << 24 | bytes[size - 2] << 16
+      | bytes[size - 3] << 8 | bytes[size - 4];
+    return 0;
+#endif
+#ifdef HAVE_ZSTD
+  case DECODE_ZSTD: {
+    unsigned long long frame_size = ZSTD_getFrameContentSize(data, size);
+    if (frame_size == ZSTD_CONTENTSIZE_UNKNOWN || frame_size == ZSTD_CONTENTSIZE_ERROR)
+      return -1;
+    *decoded_size = frame_size;
+    return 0;
+  }
+#endif
+  default:
+    return -1;
+  }
+}
+
+// Back-references may overlap their output (runs): the source is then
+// replicated with copies which double in size instead of a byte loop.
+static void copy_match(unsigned char *output, size_t distance, size_t length)
+{
+  const unsigned char *source = output - distance;
+  if (distance >= length) {
+    memcpy(output, source, length);
+    return;
+  }
+  if (distance == 1) {
+    memset(output, *source, length);
+    return;
+  }
+  while (length) {
+    size_t count = distance < length ? distance : length;
+    memcpy(output, source, count);
+    output += count;
+    length -= count;
+    distance += count;
+  }
+}
+
+// Decodes up to output_size bytes, which can be less than the whole stream:
+static int yaz0_decode(const unsigned char *input, size_t input_size,
+  unsigned char *output, size_t output_size)
+{
+  const unsigned char *in = input + YAZ0_HEADER_SIZE;
+  const unsigned char *in_end = input + input_size;
+  unsigned char *out = output;
+  unsigned char *out_end = output + output_size;
+
+  while (out != out_end) {
+    if (in == in_end)
+      return -1;
+    unsigned group = *in++;
+    for (int bit = 0; bit != 8 && out != out_end; ++bit, group <<= 1) {
+      if (group & 0x80) {
+        if (in == in_end)
+          return -1;
+        *out++ = *in++;
+        continue;
+      }
+      if (in_end - in < 2)
+        return -1;
+      size_t distance = ((in[0] & 0xf) << 8 | in[1]) + 1;
+      size_t length = in[0] >> 4;
+      in += 2;
+      if (length == 0) {
+        if (in == in_end)
+          return -1;
+        length = *in++ + 0x12;
+      } else {
+        length += 2;
+      }
+      if (distance > (size_t) (out - output))
+        return -1;
+      if (length > (size_t) (out_end - out))
+        length = out_end - out;
+      copy_match(out, distance, length);
+      out += length;
+    }
+  }
+  return 0;
+}
+
+#ifdef HAVE_ZLIB
+static int gzip_decode(const unsigned char *input, size_t input_size,
+  unsigned char *output, size_t output_size)
+{
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+    return -1;
+  int res = 0;
+  // zlib sizes are 32-bit:
+  while (stream.total_out != output_size) {
+    size_t in_left = input_size - stream.total_in;
+    size_t out_left = output_size - stream.total_out;
+    stream.next_in = (unsigned char*) input + stream.total_in;
+    stream.avail_in = in_left > UINT32_MAX ? UINT32_MAX : in_left;
+    stream.next_out = output + stream.total_out;
+    stream.avail_out = out_left > UINT32_MAX ? UINT32_MAX : out_left;
+    int status = inflate(&stream, Z_NO_FLUSH);
+    if (status == Z_STREAM_END && stream.total_out != output_size)
+      res = -1;
+    if (status != Z_OK || res != 0)
+      break;
+  }
+  if (stream.total_out != output_size)
+    res = -1;
+  inflateEnd(&stream);
+  return res;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int zstd_decode(const unsigned char *input, size_t input_size,
+  unsigned char *output, size_t output_size)
+{
+  ZSTD_DStream *stream = ZSTD_createDStream();
+  if (!stream)
+    return -1;
+  ZSTD_inBuffer in = { input, input_size, 0 };
+  ZSTD_outBuffer out = { output, output_size, 0 };
+  int res = 0;
+  while (out.pos != out.size) {
+    size_t in_pos = in.pos, out_pos = out.pos;
+    size_t status = ZSTD_decompressStream(stream, &out, &in);
+    // A truncated frame makes no progress, or ends the input mid-frame with
+    // room left in the output:
+    if (ZSTD_isError(status) || (status == 0 && out.pos != out.size)
+      || (in.pos == in_pos && out.pos == out_pos)
+      || (in.pos == in.size && status != 0 && out.pos != out.size)) {
+      res = -1;
+      break;
+    }
+  }
+  ZSTD_freeDStream(stream);
+  return res;
+}
+#endif
+
+int decode(int format, const void *input, size_t input_size,
+  void *output, size_t output_size)
+{
+  switch (format) {
+  case DECODE_YAZ0:
+    return yaz0_decode(input, input_size, output, output_size);
+#ifdef HAVE_ZLIB
+  case DECODE_GZIP:
+    return gzip_decode(input, input_size, output, output_size);
+#endif
+#ifdef HAVE_ZSTD
+  case DECODE_ZSTD:
+    return zstd_decode(input, input_size, output, output_size);
+#endif
+  default:
+    return -1;
+  }
+}
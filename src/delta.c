@@ -0,0 +1,554 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "doltool.h"
+
+// Delta: a header, then the operations (a control stream followed by the
+// literal bytes it refers to), zlib compressed when DELTA_ZLIB is set. All
+// the header fields are big-endian.
+//
+// The control stream is a list of varint triplets: the count of literal
+// bytes to append, the count of bytes to copy from the old DOL and where
+// they start relative to the end of the previous copy (zigzag encoded).
+#define DELTA_MAGIC 0x444f4c44 // "DOLD"
+#define DELTA_VERSION 1
+#define DELTA_ZLIB 1
+
+struct delta_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t flags;
+  uint32_t padding;
+  uint64_t old_size;
+  uint64_t new_size;
+  uint64_t old_hash;
+  uint64_t new_hash;
+  uint64_t control_size;
+  uint64_t literal_size;
+  // Size of the operations as stored:
+  uint64_t stored_size;
+};
+
+// Data moved to another offset is found from the hashes of blocks of the
+// old DOL. Every DELTA_STRIDE bytes, a block is indexed, so that moves of
+// at least DELTA_STRIDE + DELTA_BLOCK bytes are found:
+#define DELTA_BLOCK 32
+#define DELTA_STRIDE (4 * DELTA_BLOCK)
+#define DELTA_PRIME 0x01000193
+// Slots probed when looking a block up:
+#define DELTA_PROBES 8
+
+struct delta_slot {
+  uint32_t hash;
+  // Offset of the block + 1, 0 for an empty slot:
+  uint32_t offset;
+};
+
+struct delta_buffer {
+  unsigned char *data;
+  size_t size;
+  size_t allocated;
+};
+
+// Offsets are 32-bit in the delta:
+static int input_open(struct dol_file *input, const char *filename)
+{
+  if (dol_load(filename, "diff", input) != 0)
+    return -1;
+  if (input->size > UINT32_MAX) {
+    fprintf(stderr, "Invalid DOL file %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+static void buffer_reserve(struct delta_buffer *buffer, size_t size)
+{
+  if (buffer->size + size <= buffer->allocated)
+    return;
+  while (buffer->size + size > buffer->allocated)
+    buffer->allocated = buffer->allocated ? buffer->allocated * 2 : 4096;
+  buffer->data = realloc(buffer->data, buffer->allocated);
+}
+
+static void buffer_append(struct delta_buffer *buffer, const void *data, size_t size)
+{
+  buffer_reserve(buffer, size);
+  memcpy(buffer->data + buffer->size, data, size);
+  buffer->size += size;
+}
+
+static void put_varint(struct delta_buffer *buffer, uint64_t value)
+{
+  buffer_reserve(buffer, 10);
+  do {
+    unsigned char byte = value & 0x7f;
+    value >>= 7;
+    buffer->data[buffer->size++] = byte | (value ? 0x80 : 0);
+  } while (value);
+}
+
+static int get_varint(const unsigned char **data, const unsigned char *end,
+  uint64_t *value)
+{
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*data == end)
+      return -1;
+    unsigned char byte = *(*data)++;
+    *value |= (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return 0;
+  }
+  return -1;
+}
+
+// Rabin-Karp hash of a block, which can be rolled one byte at a time. The
+// powers of DELTA_PRIME make the products independent of each other:
+static void hash_powers(uint32_t *powers)
+{
+  uint32_t power = 1;
+  for (int i = DELTA_BLOCK - 1; i >= 0; --i) {
+    powers[i] = power;
+    power *= DELTA_PRIME;
+  }
+}
+
+static uint32_t block_hash(const unsigned char *data, const uint32_t *powers)
+{
+  uint32_t hash = 0;
+  for (int i = 0; i != DELTA_BLOCK; ++i)
+    hash += data[i] * powers[i];
+  return hash;
+}
+
+static uint32_t block_hash_roll(uint32_t hash, unsigned char out, unsigned char in,
+  uint32_t out_factor)
+{
+  return (hash - out * out_factor) * DELTA_PRIME + in;
+}
+
+static struct delta_slot *index_blocks(const unsigned char *data, uint64_t size,
+  const uint32_t *powers, size_t *mask)
+{
+  size_t count = 16;
+  while (count < size / DELTA_STRIDE * 2)
+    count *= 2;
+  struct delta_slot *slots = calloc(count, sizeof(struct delta_slot));
+  if (!slots)
+    return NULL;
+  *mask = count - 1;
+  for (uint64_t offset = 0; offset + DELTA_BLOCK <= size; offset += DELTA_STRIDE) {
+    uint32_t hash = block_hash(data + offset, powers);
+    // Only the first copy of repeated blocks is kept:
+    for (size_t i = 0; i != DELTA_PROBES; ++i) {
+      struct delta_slot *slot = slots + ((hash + i) & *mask);
+      if (slot->offset && slot->hash == hash
+        && memcmp(data + slot->offset - 1, data + offset, DELTA_BLOCK) == 0)
+        break;
+      if (!slot->offset) {
+        slot->hash = hash;
+        slot->offset = offset + 1;
+        break;
+      }
+    }
+  }
+  return slots;
+}
+
+// Equal bytes at the start of a and b, compared in large blocks with the
+// vectorised memcmp of the C library first:
+static size_t match_length(const unsigned char *a, const unsigned char *b, size_t size)
+{
+  size_t length = 0;
+  for (size_t block = 4096; block >= 16; block /= 16)
+    while (size - length >= block && memcmp(a + length, b + length, block) == 0)
+      length += block;
+  while (length != size && a[length] == b[length])
+    ++length;
+  return length;
+}
+
+struct delta_encoder {
+  const unsigned char *old_data, *new_data;
+  uint64_t old_size, new_size;
+  struct delta_buffer control;
+  struct delta_buffer literals;
+  uint64_t last;
+  uint64_t copied;
+  // Built when a block is not found at its predicted place:
+  struct delta_slot *slots;
+  size_t mask;
+};
+
+static void emit(struct delta_encoder *encoder, uint64_t literal_start,
+  uint64_t literal_end, uint64_t copy_offset, uint64_t copy_size)
+{
+  put_varint(&encoder->control, literal_end - literal_start);
+  buffer_append(&encoder->literals, encoder->new_data + literal_start,
+    literal_end - literal_start);
+  put_varint(&encoder->control, copy_size);
+  int64_t distance = (int64_t) (copy_offset - encoder->last);
+  put_varint(&encoder->control, ((uint64_t) distance << 1) ^ (uint64_t) (distance >> 63));
+  encoder->last = copy_offset + copy_size;
+  encoder->copied += copy_size;
+}
+
+static int block_equal(const struct delta_encoder *encoder, uint64_t new_offset,
+  uint64_t old_offset)
+{
+  return old_offset + DELTA_BLOCK <= encoder->old_size
+    && memcmp(encoder->new_data + new_offset, encoder->old_data + old_offset,
+      DELTA_BLOCK) == 0;
+}
+
+// Where a new segment was in the old DOL, from its address:
+struct delta_region {
+  uint64_t start, end;
+  uint64_t old_start;
+};
+
+static int compare_regions(const void *a, const void *b)
+{
+  const struct delta_region *x = a, *y = b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static size_t list_regions(const Dol_Hdr *old_dhdr, const Dol_Hdr *new_dhdr,
+  struct delta_region *regions)
+{
+  struct dol_segment old_segments[DOL_TEXT_COUNT + DOL_DATA_COUNT];
+  struct dol_segment new_segments[DOL_TEXT_COUNT + DOL_DATA_COUNT];
+  size_t old_count = dol_segments(old_dhdr, old_segments);
+  size_t new_count = dol_segments(new_dhdr, new_segments);
+  for (size_t i = 0; i != new_count; ++i) {
+    const struct dol_segment *segment = new_segments + i;
+    regions[i].start = segment->offset;
+    regions[i].end = (uint64_t) segment->offset + segment->size;
+    regions[i].old_start = UINT64_MAX;
+    for (size_t j = 0; j != old_count; ++j)
+      if (segment->address >= old_segments[j].address
+        && segment->address - old_segments[j].address < old_segments[j].size)
+        regions[i].old_start = old_segments[j].offset
+          + (segment->address - old_segments[j].address);
+  }
+  qsort(regions, new_count, sizeof(struct delta_region), compare_regions);
+  return new_count;
+}
+
+// Where the byte at offset was in the old DOL: at the same address for the
+// segments, at the same offset for the header and the padding. The cursor
+// follows the offsets, which mostly increase.
+static uint64_t predict(const struct delta_region *regions, size_t count,
+  size_t *cursor, uint64_t offset)
+{
+  while (*cursor != count && offset >= regions[*cursor].end)
+    ++*cursor;
+  while (*cursor && offset < regions[*cursor - 1].end)
+    --*cursor;
+  if (*cursor == count || offset < regions[*cursor].start)
+    return offset;
+  const struct delta_region *region = regions + *cursor;
+  return region->old_start == UINT64_MAX ? UINT64_MAX
+    : region->old_start + (offset - region->start);
+}
+
+static int encode(struct delta_encoder *encoder, const Dol_Hdr *old_dhdr,
+  const Dol_Hdr *new_dhdr)
+{
+  struct delta_region regions[DOL_TEXT_COUNT + DOL_DATA_COUNT];
+  size_t region_count = list_regions(old_dhdr, new_dhdr, regions);
+  size_t cursor = 0;
+  const unsigned char *data = encoder->new_data;
+  uint32_t powers[DELTA_BLOCK];
+  hash_powers(powers);
+
+  uint64_t position = 0, literal_start = 0;
+  uint32_t hash = 0;
+  int rolling = 0;
+  while (position + DELTA_BLOCK <= encoder->new_size) {
+    // Following the previous copy, at the same address, or anywhere else:
+    uint64_t match = UINT64_MAX;
+    if (block_equal(encoder, position, encoder->last)) {
+      match = encoder->last;
+    } else {
+      uint64_t predicted = predict(regions, region_count, &cursor, position);
+      if (predicted != UINT64_MAX && block_equal(encoder, position, predicted)) {
+        match = predicted;
+      } else {
+        hash = rolling ? block_hash_roll(hash, data[position - 1],
+            data[position + DELTA_BLOCK - 1], powers[0])
+          : block_hash(data + position, powers);
+        rolling = 1;
+        if (!encoder->slots) {
+          encoder->slots = index_blocks(encoder->old_data, encoder->old_size, powers,
+            &encoder->mask);
+          if (!encoder->slots)
+            return -1;
+        }
+        for (size_t i = 0; i != DELTA_PROBES; ++i) {
+          const struct delta_slot *slot = encoder->slots + ((hash + i) & encoder->mask);
+          if (!slot->offset)
+            break;
+          if (slot->hash == hash && block_equal(encoder, position, slot->offset - 1)) {
+            match = slot->offset - 1;
+            break;
+          }
+        }
+      }
+    }
+    if (match == UINT64_MAX) {
+      ++position;
+      continue;
+    }
+
+    // Take back the literal bytes which match too:
+    while (position > literal_start && match > 0
+      && data[position - 1] == encoder->old_data[match - 1]) {
+      --position;
+      --match;
+    }
+    uint64_t remaining = encoder->new_size - position;
+    if (encoder->old_size - match < remaining)
+      remaining = encoder->old_size - match;
+    size_t length = match_length(data + position, encoder->old_data + match, remaining);
+    emit(encoder, literal_start, position, match, length);
+    position += length;
+    literal_start = position;
+    rolling = 0;
+  }
+  if (literal_start != encoder->new_size)
+    emit(encoder, literal_start, encoder->new_size, encoder->last, 0);
+  return 0;
+}
+
+int delta_create(const char *delta_filename, const char *old_filename,
+  const char *new_filename)
+{
+  struct dol_file old_input, new_input;
+  struct delta_encoder encoder;
+  memset(&encoder, 0, sizeof(struct delta_encoder));
+  unsigned char *output = NULL;
+  int res = 1;
+
+  double start = now();
+  if (input_open(&old_input, old_filename) != 0) {
+    dol_release(&old_input);
+    return 1;
+  }
+  if (input_open(&new_input, new_filename) != 0)
+    goto out;
+
+  encoder.old_data = old_input.data;
+  encoder.old_size = old_input.size;
+  encoder.new_data = new_input.data;
+  encoder.new_size = new_input.size;
+  if (encode(&encoder, &old_input.dhdr, &new_input.dhdr) != 0) {
+    fprintf(stderr, "Could not index %s\n", old_filename);
+    goto out;
+  }
+
+  struct delta_header header;
+  memset(&header, 0, sizeof(struct delta_header));
+  header.magic = htonl(DELTA_MAGIC);
+  header.version = htonl(DELTA_VERSION);
+  header.old_size = htobe64(old_input.size);
+  header.new_size = htobe64(new_input.size);
+  header.old_hash = htobe64(hash64(old_input.data, old_input.size, 0));
+  header.new_hash = htobe64(hash64(new_input.data, new_input.size, 0));
+  header.control_size = htobe64(encoder.control.size);
+  header.literal_size = htobe64(encoder.literals.size);
+
+  // Control and literals, stored as they are without zlib:
+  size_t operations_size = encoder.control.size + encoder.literals.size;
+  buffer_append(&encoder.control, encoder.literals.data, encoder.literals.size);
+  const unsigned char *stored = encoder.control.data;
+  size_t stored_size = operations_size;
+#ifdef HAVE_ZLIB
+  uLongf length = compressBound(operations_size);
+  output = malloc(length);
+  if (output && compress2(output, &length, encoder.control.data, operations_size,
+      Z_BEST_COMPRESSION) == Z_OK && length < operations_size) {
+    header.flags = htonl(DELTA_ZLIB);
+    stored = output;
+    stored_size = length;
+  }
+#endif
+  header.stored_size = htobe64(stored_size);
+
+  struct delta_buffer file;
+  memset(&file, 0, sizeof(struct delta_buffer));
+  buffer_append(&file, &header, sizeof(struct delta_header));
+  buffer_append(&file, stored, stored_size);
+  res = write_file(delta_filename, file.data, file.size) != 0;
+  if (res == 0)
+    fprintf(stderr,
+      "%zu bytes delta for %" PRIu64 " bytes (%.2f%%): %" PRIu64 " bytes copied, "
+      "%zu literal bytes, in %.3fs\n",
+      file.size, new_input.size, new_input.size ? 100.0 * file.size / new_input.size : 0,
+      encoder.copied, encoder.literals.size, now() - start);
+  free(file.data);
+
+out:
+  free(output);
+  free(encoder.slots);
+  free(encoder.control.data);
+  free(encoder.literals.data);
+  dol_release(&new_input);
+  dol_release(&old_input);
+  return res;
+}
+
+static int decode_operations(const unsigned char *operations, size_t control_size,
+  size_t literal_size, const unsigned char *old_data, uint64_t old_size,
+  unsigned char *output, uint64_t new_size)
+{
+  const unsigned char *control = operations, *control_end = operations + control_size;
+  const unsigned char *literals = control_end, *literals_end = literals + literal_size;
+  uint64_t position = 0, last = 0;
+  while (control != control_end) {
+    uint64_t literal_count, copy_size, distance;
+    if (get_varint(&control, control_end, &literal_count) != 0
+      || get_varint(&control, control_end, &copy_size) != 0
+      || get_varint(&control, control_end, &distance) != 0
+      || literal_count > (uint64_t) (literals_end - literals)
+      || literal_count > new_size - position)
+      return -1;
+    memcpy(output + position, literals, literal_count);
+    literals += literal_count;
+    position += literal_count;
+
+    uint64_t offset = last + (uint64_t) ((int64_t) (distance >> 1) ^ -(int64_t) (distance & 1));
+    if (offset > old_size || copy_size > old_size - offset
+      || copy_size > new_size - position)
+      return -1;
+    memcpy(output + position, old_data + offset, copy_size);
+    position += copy_size;
+    last = offset + copy_size;
+  }
+  return position == new_size && literals == literals_end ? 0 : -1;
+}
+
+int delta_apply(const char *delta_filename, const char *old_filename,
+  const char *output_filename, const struct dol2elf_options *options)
+{
+  struct dol_file old_input;
+  unsigned char *operations = NULL, *output = NULL;
+  void *delta = MAP_FAILED;
+  struct stat st;
+  int res = 1;
+
+  int delta_fd = open(delta_filename, O_RDONLY | O_CLOEXEC);
+  if (delta_fd < 0 || fstat(delta_fd, &st) != 0) {
+    fprintf(stderr, "Could not open %s\n", delta_filename);
+    if (delta_fd >= 0)
+      close(delta_fd);
+    return 1;
+  }
+  if (input_open(&old_input, old_filename) != 0)
+    goto out;
+  if ((uint64_t) st.st_size >= sizeof(struct delta_header))
+    delta = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, delta_fd, 0);
+  if (delta == MAP_FAILED) {
+    fprintf(stderr, "Invalid delta %s\n", delta_filename);
+    goto out;
+  }
+
+  struct delta_header header;
+  memcpy(&header, delta, sizeof(struct delta_header));
+  uint64_t control_size = be64toh(header.control_size);
+  uint64_t literal_size = be64toh(header.literal_size);
+  uint64_t stored_size = be64toh(header.stored_size);
+  uint64_t new_size = be64toh(header.new_size);
+  unsigned flags = ntohl(header.flags);
+  if (ntohl(header.magic) != DELTA_MAGIC || ntohl(header.version) != DELTA_VERSION
+    || stored_size != st.st_size - sizeof(struct delta_header)
+    || control_size > SIZE_MAX - literal_size || new_size > UINT32_MAX
+    || (flags & ~DELTA_ZLIB)) {
+    fprintf(stderr, "Invalid delta %s\n", delta_filename);
+    goto out;
+  }
+  if (be64toh(header.old_size) != old_input.size
+    || be64toh(header.old_hash) != hash64(old_input.data, old_input.size, 0)) {
+    fprintf(stderr, "%s is not the DOL file %s was made for\n", old_filename,
+      delta_filename);
+    goto out;
+  }
+
+  const unsigned char *stored = (const unsigned char*) delta + sizeof(struct delta_header);
+  if (flags & DELTA_ZLIB) {
+#ifdef HAVE_ZLIB
+    uLongf length = control_size + literal_size;
+    operations = malloc(length ? length : 1);
+    if (!operations || uncompress(operations, &length, stored, stored_size) != Z_OK
+      || length != control_size + literal_size) {
+      fprintf(stderr, "Could not decompress %s\n", delta_filename);
+      goto out;
+    }
+    stored = operations;
+#else
+    fprintf(stderr, "Compressed delta not supported in this build: %s\n",
+      delta_filename);
+    goto out;
+#endif
+  } else if (stored_size != control_size + literal_size) {
+    fprintf(stderr, "Invalid delta %s\n", delta_filename);
+    goto out;
+  }
+
+  output = malloc(new_size ? new_size : 1);
+  if (!output || decode_operations(stored, control_size, literal_size,
+      old_input.data, old_input.size, output, new_size) != 0
+    || be64toh(header.new_hash) != hash64(output, new_size, 0)) {
+    fprintf(stderr, "Could not apply %s\n", delta_filename);
+    goto out;
+  }
+
+  res = (has_suffix(output_filename, ".elf")
+    ? write_dol_elf(output_filename, output, new_size, options)
+    : write_file(output_filename, output, new_size)) != 0;
+
+out:
+  free(output);
+  free(operations);
+  if (delta != MAP_FAILED)
+    munmap(delta, st.st_size);
+  close(delta_fd);
+  dol_release(&old_input);
+  return res;
+}
@@ -0,0 +1,157 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "doltool.h"
+
+// GameCube disc header ("boot.bin"):
+#define GCM_MAGIC_OFFSET 0x1c
+#define GCM_MAGIC 0xc2339f3d
+#define GCM_DOL_OFFSET 0x420
+// Wii discs have the same layout but their partitions are encrypted:
+#define WII_MAGIC_OFFSET 0x18
+#define WII_MAGIC 0x5d1c9ea3
+#define DISC_HEADER_SIZE 0x440
+
+static uint32_t read_be32(const unsigned char *data)
+{
+  return (uint32_t) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+// The DOL is not stored with its size, it ends with its last segment:
+uint64_t dol_extent(const Dol_Hdr *dhdr)
+{
+  uint64_t end = sizeof(Dol_Hdr);
+  for (int i=0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i]) {
+      uint64_t segment_end = (uint64_t) ntohl(dhdr->text_offset[i]) + ntohl(dhdr->text_size[i]);
+      if (segment_end > end)
+        end = segment_end;
+    }
+  for (int i=0; i != DOL_DATA_COUNT; ++i)
+    if (dhdr->data_size[i]) {
+      uint64_t segment_end = (uint64_t) ntohl(dhdr->data_offset[i]) + ntohl(dhdr->data_size[i]);
+      if (segment_end > end)
+        end = segment_end;
+    }
+  return end;
+}
+
+int dol_locate(int fd, const char *filename, struct dol_source *source,
+  Dol_Hdr *dhdr)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(error_file(), "Could not stat %s\n", filename);
+    return -1;
+  }
+
+  // Either a DOL header or a disc header:
+  unsigned char header[DISC_HEADER_SIZE];
+  ssize_t count = pread(fd, header, sizeof(header), 0);
+  STATS_ADD(STATS_SYSCALLS, 2);
+  if (count < (ssize_t) sizeof(Dol_Hdr)) {
+    fprintf(error_file(), "Could not read DOL header in %s\n", filename);
+    return -1;
+  }
+  STATS_ADD(STATS_BYTES_READ, count);
+
+  // Compressed DOL files are decoded by the caller:
+  source->format = decode_detect(header, count);
+  source->rel = 0;
+  if (source->format != DECODE_NONE) {
+    source->offset = 0;
+    source->size = st.st_size;
+    return 0;
+  }
+
+  // So are REL modules, which have no DOL header:
+  if (rel_detect(header, count)) {
+    source->offset = 0;
+    source->size = st.st_size;
+    source->rel = 1;
+    memset(dhdr, 0, sizeof(Dol_Hdr));
+    return 0;
+  }
+
+  if (read_be32(header + WII_MAGIC_OFFSET) == WII_MAGIC) {
+    fprintf(error_file(), "Could not read %s: Wii disc images are encrypted\n",
+      filename);
+    return -1;
+  }
+  if (read_be32(header + GCM_MAGIC_OFFSET) != GCM_MAGIC) {
+    source->offset = 0;
+    source->size = st.st_size;
+    memcpy(dhdr, header, sizeof(Dol_Hdr));
+    return 0;
+  }
+
+  // main.dol of a GameCube disc image:
+  if (count != sizeof(header)) {
+    fprintf(error_file(), "Could not read disc header in %s\n", filename);
+    return -1;
+  }
+  source->offset = read_be32(header + GCM_DOL_OFFSET);
+  if (pread(fd, dhdr, sizeof(Dol_Hdr), source->offset) != sizeof(Dol_Hdr)) {
+    fprintf(error_file(), "Could not read DOL header in %s\n", filename);
+    return -1;
+  }
+  STATS_ADD(STATS_SYSCALLS, 1);
+  STATS_ADD(STATS_BYTES_READ, sizeof(Dol_Hdr));
+  source->size = dol_extent(dhdr);
+  if (source->offset + source->size > (uint64_t) st.st_size) {
+    fprintf(error_file(), "Truncated DOL in disc image %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+// Only map the pages of the DOL, not the whole disc image:
+int dol_map(int fd, const struct dol_source *source, struct dol_mapping *mapping)
+{
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t start = source->offset & ~(page_size - 1);
+  mapping->length = source->offset - start + source->size;
+  mapping->base = mmap(NULL, mapping->length, PROT_READ, MAP_PRIVATE, fd, start);
+  if (mapping->base == MAP_FAILED) {
+    mapping->base = NULL;
+    return -1;
+  }
+  madvise(mapping->base, mapping->length, MADV_SEQUENTIAL);
+  mapping->data = (const char*) mapping->base + (source->offset - start);
+  STATS_ADD(STATS_SYSCALLS, 2);
+  STATS_ADD(STATS_BYTES_READ, source->size);
+  return 0;
+}
+
+void dol_unmap(struct dol_mapping *mapping)
+{
+  if (mapping->base)
+    munmap(mapping->base, mapping->length);
+  mapping->base = NULL;
+}
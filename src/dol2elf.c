@@ -26,6 +26,11 @@ THE SOFTWARE.
 #include <string.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 #include <elf.h>
@@ -66,7 +71,7 @@ static void fill_elf_header(const Dol_Hdr *dhdr, struct Elf* elf)
   ehdr->e_machine   = htons(EM_PPC);
   ehdr->e_version   = htonl(EV_CURRENT);
   ehdr->e_entry     = dhdr->entry_point;
-  ehdr->e_phoff     = htonl(sizeof(Elf32_Ehdr));
+  ehdr->e_phoff     = htonl(elf->phnum ? sizeof(Elf32_Ehdr) : 0);
   ehdr->e_shoff     = htonl(sizeof(Elf32_Ehdr) + elf->phnum * sizeof(Elf32_Phdr));
   ehdr->e_flags     = 0;
   ehdr->e_ehsize    = htons(sizeof(Elf32_Ehdr));
@@ -77,127 +82,381 @@ static void fill_elf_header(const Dol_Hdr *dhdr, struct Elf* elf)
   ehdr->e_shstrndx  = htons(SHSTRNDX);
 }
 
-int file_copy(FILE *input, FILE* output)
+// ***** Main code
+
+static void number_sections(const Dol_Hdr *dhdr, struct Elf *elf)
 {
-  char buffer[1024];
-  while (1) {
-    size_t read_count = fread(buffer, sizeof(char), 1024, input);
-    if (fwrite(buffer, sizeof(char), read_count, output) != read_count) {
+  // NULL section and .shstrtab come first:
+  uint16_t shindex = 2;
+  for (int i=0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i])
+      elf->text_shndx[i] = shindex++;
+  for (int i=0; i != DOL_DATA_COUNT; ++i)
+    if (dhdr->data_size[i])
+      elf->data_shndx[i] = shindex++;
+  if (dhdr->bss_size)
+    elf->bss_shndx = shindex++;
+  // .dolhdr, then .symtab and .strtab:
+  ++shindex;
+  elf->symtab_shndx = shindex;
+}
+
+int elf_prepare(const Dol_Hdr *dhdr, const void *dol, uint64_t dol_size,
+  const struct dol2elf_options *options, struct Elf *elf)
+{
+  memset(elf, 0, sizeof(struct Elf));
+  const struct dol2elf_symbols *symbols = options ? options->symbols : NULL;
+  unsigned compress = options ? options->flags & DOL2ELF_COMPRESS : 0;
+  if (compress == DOL2ELF_COMPRESS
+    || (options && (options->flags & DOL2ELF_NEEDS_DATA) && !dol))
+    return -1;
+
+  // The functions found are added to the given symbols:
+  if (options && (options->flags & DOL2ELF_FIND_FUNCTIONS)) {
+    elf->found_symbols = find_functions(dhdr, dol, dol_size, options);
+    if (!elf->found_symbols)
       return -1;
-    }
-    if (read_count != 1024) {
-      if (feof(output))
-        return -1;
-      else
-        return 0;
-    }
+    symbols = elf->found_symbols;
   }
+
+  // How many program headers:
+  elf->load_count = count_loads(dhdr);
+  // One ELF segment per DOL segment, none when the sections are compressed
+  // as they cannot be loaded anymore:
+  elf->phnum      = compress ? 0 : elf->load_count;
+  // One ELF section per DOL segment
+  // + NULL section, a .strtab section and a .dolhdr section
+  // + .symtab and .strtab sections when there are symbols
+  // + .note.dol2elf for incremental updates:
+  elf->has_note   = options && (options->flags & DOL2ELF_INCREMENTAL);
+  elf->shnum      = elf->load_count + 3 + (symbols ? 2 : 0) + elf->has_note;
+  number_sections(dhdr, elf);
+
+  // Create the strtab:
+  strtab_create(&elf->strtab);
+  strtab_fill(&elf->strtab, dhdr, symbols != NULL);
+  if (elf->has_note) {
+    strtab_index(&elf->strtab, ".note.dol2elf");
+    if (note_fill(dhdr, dol, dol_size, options, &elf->note) != 0)
+      return -1;
+  }
+
+  if (symbols)
+    create_symtab(dhdr, symbols, options->flags, elf);
+
+  // Offset added by the ELF data
+  // (headers, .symtab, .shstrtab, .strtab):
+  elf->symtab_offset =
+    sizeof(Elf32_Ehdr)
+    + elf->phnum * sizeof(Elf32_Phdr)
+    + elf->shnum * sizeof(Elf32_Shdr);
+  elf->strtab_offset =
+    elf->symtab_offset
+    + elf->symnum * sizeof(Elf32_Sym);
+  elf->symstrtab_offset =
+    elf->strtab_offset
+    + elf->strtab.used;
+  elf->note_offset =
+    elf->symstrtab_offset
+    + (elf->symstrtab ? elf->symstrtab->used : 0);
+  // Notes are made of 32-bit words:
+  if (elf->has_note)
+    elf->note_offset = (elf->note_offset + 3) & ~3;
+  elf->dol_offset =
+    elf->note_offset
+    + (elf->has_note ? sizeof(struct elf_note) : 0);
+
+  if (compress && compress_segments(dhdr, dol, dol_size, options, elf) != 0)
+    return -1;
+
+  // Where the DOL data goes:
+  if (elf_layout(dhdr, dol_size, options, elf) != 0)
+    return -1;
+
+  // Initialize the ELF header:
+  fill_elf_header(dhdr, elf);
+  assert(elf->phnum == ntohs(elf->ehdr.e_phnum));
+
+  create_shdrs(dhdr, elf);
+  if (elf->phnum)
+    create_phdrs(dhdr, elf);
+  return 0;
 }
 
-// ***** Main code
+int elf_headers_iov(struct Elf *elf, struct iovec *iov)
+{
+  int count = 0;
+  iov[count].iov_base = &elf->ehdr;
+  iov[count].iov_len  = sizeof(Elf32_Ehdr);
+  ++count;
+  iov[count].iov_base = elf->phdrs;
+  iov[count].iov_len  = elf->phnum * sizeof(Elf32_Phdr);
+  ++count;
+  iov[count].iov_base = elf->shdrs;
+  iov[count].iov_len  = elf->shnum * sizeof(Elf32_Shdr);
+  ++count;
+  if (elf->symnum) {
+    iov[count].iov_base = elf->syms;
+    iov[count].iov_len  = elf->symnum * sizeof(Elf32_Sym);
+    ++count;
+  }
+  iov[count].iov_base = elf->strtab.data;
+  iov[count].iov_len  = elf->strtab.used;
+  ++count;
+  if (elf->symstrtab) {
+    iov[count].iov_base = elf->symstrtab->data;
+    iov[count].iov_len  = elf->symstrtab->used;
+    ++count;
+  }
+  if (elf->has_note) {
+    static char padding[4];
+    size_t end = elf->symstrtab_offset + (elf->symstrtab ? elf->symstrtab->used : 0);
+    if (elf->note_offset != end) {
+      iov[count].iov_base = padding;
+      iov[count].iov_len  = elf->note_offset - end;
+      ++count;
+    }
+    iov[count].iov_base = &elf->note;
+    iov[count].iov_len  = sizeof(struct elf_note);
+    ++count;
+  }
+  return count;
+}
 
-static void elf_free(struct Elf *elf)
+void elf_free(struct Elf *elf)
 {
-  free(elf->strtab.data);
+  strtab_destroy(&elf->strtab);
+  free(elf->shdrs);
+  free(elf->phdrs);
+  free(elf->syms);
+  if (elf->merged_symstrtab.data)
+    strtab_destroy(&elf->merged_symstrtab);
+  compressed_free(elf);
+  dol2elf_symbols_free(elf->found_symbols);
 }
 
-int dol2elf(const char *dol_filename, const char *elf_filename)
+// Verbatim conversions are decoded straight into the output file, the
+// other layouts need the decoded DOL in memory:
+static int dol2elf_decoded(int dol_fd, int elf_fd, const char *dol_filename,
+  const struct dol_source *source, const struct dol2elf_options *options)
 {
-  FILE *dol_file = NULL;
-  FILE *elf_file = NULL;
   struct Elf elf;
   memset(&elf, 0, sizeof(struct Elf));
+  struct dol_mapping input;
+  memset(&input, 0, sizeof(struct dol_mapping));
+  void *output = MAP_FAILED;
+  unsigned char *buffer = NULL;
+  int in_place = !(options && (options->flags & (DOL2ELF_COMPACT | DOL2ELF_NEEDS_DATA)));
 
-  dol_file = fopen(dol_filename, "rb");
-  if (!dol_file) {
-    fprintf(stderr, "Could not open %s\n", dol_filename);
+  STATS_BEGIN(STATS_READ_HEADER);
+  if (dol_map(dol_fd, source, &input) != 0) {
+    fprintf(error_file(), "Could not map %s\n", dol_filename);
     goto err;
   }
-
-  // Read the DOL header:
+  uint64_t dol_size;
   Dol_Hdr dhdr;
-  if (fread(&dhdr, sizeof(Dol_Hdr), 1, dol_file) != 1) {
-    fprintf(stderr, "Could not read DOL header in %s\n", dol_filename);
+  if (decode_size(source->format, input.data, source->size, &dol_size) != 0
+    || dol_size < sizeof(Dol_Hdr) || dol_size > SIZE_MAX
+    || decode(source->format, input.data, source->size, &dhdr, sizeof(Dol_Hdr)) != 0) {
+    fprintf(error_file(), "Could not decode %s input %s\n",
+      decode_name(source->format), dol_filename);
     goto err;
   }
-  dol_dump(&dhdr, stderr);
+  STATS_END(STATS_READ_HEADER);
+  if (options && options->diag)
+    dol_dump(&dhdr, options->diag);
 
-  // How many program headers:
-  elf.load_count = count_loads(&dhdr);
-  // One ELF segment per DOL segment:
-  elf.phnum      = elf.load_count;
-  // One ELF section per DOL segment
-  // + NULL section, a .strtab section and a .dolhdr section:
-  elf.shnum      = elf.load_count + 3;
-
-  // Create the strtab:
-  strtab_create(&elf.strtab);
-  strtab_fill(&elf.strtab, &dhdr);
+  if (!in_place) {
+    STATS_BEGIN(STATS_DECODE);
+    buffer = malloc(dol_size);
+    if (!buffer || decode(source->format, input.data, source->size, buffer, dol_size) != 0) {
+      fprintf(error_file(), "Could not decode %s input %s\n",
+        decode_name(source->format), dol_filename);
+      goto err;
+    }
+    STATS_END(STATS_DECODE);
+  }
 
-  // Offset added by the ELF data:
-  elf.strtab_offset =
-    sizeof(Elf32_Ehdr)
-    + elf.phnum * sizeof(Elf32_Phdr)
-    + elf.shnum * sizeof(Elf32_Shdr);
-  elf.dol_offset =
-    sizeof(Elf32_Ehdr)
-    + elf.phnum * sizeof(Elf32_Phdr)
-    + elf.shnum * sizeof(Elf32_Shdr)
-    + elf.strtab.used;
+  STATS_BEGIN(STATS_PREPARE);
+  if (elf_prepare(&dhdr, buffer, dol_size, options, &elf) != 0) {
+    fprintf(error_file(), "Invalid DOL file %s\n", dol_filename);
+    goto err;
+  }
+  STATS_END(STATS_PREPARE);
 
-  // Initialize the ELF header:
-  fill_elf_header(&dhdr, &elf);
-  assert(elf.phnum == ntohs(elf.ehdr.e_phnum));
+  STATS_BEGIN(STATS_WRITE_HEADERS);
+  struct iovec iov[ELF_HEADERS_IOV_MAX];
+  if (writev_headers(elf_fd, iov, elf_headers_iov(&elf, iov)) != 0
+    || ftruncate(elf_fd, elf.size) != 0) {
+    fputs("Could not write ELF headers\n", error_file());
+    goto err;
+  }
+  STATS_ADD(STATS_SYSCALLS, 1);
+  STATS_END(STATS_WRITE_HEADERS);
 
-  create_shdrs(&dhdr, &elf);
-  create_phdrs(&dhdr, &elf);
+  if (in_place) {
+    // Write-only outputs cannot be mapped:
+    STATS_BEGIN(STATS_DECODE);
+    output = mmap(NULL, elf.size, PROT_READ | PROT_WRITE, MAP_SHARED, elf_fd, 0);
+    STATS_ADD(STATS_SYSCALLS, 1);
+    void *destination;
+    if (output != MAP_FAILED)
+      destination = (char*) output + elf.extents[0].offset;
+    else
+      destination = buffer = malloc(dol_size);
+    if (!destination
+      || decode(source->format, input.data, source->size, destination, dol_size) != 0) {
+      fprintf(error_file(), "Could not decode %s input %s\n",
+        decode_name(source->format), dol_filename);
+      goto err;
+    }
+    STATS_ADD(STATS_BYTES_WRITTEN, dol_size);
+    STATS_END(STATS_DECODE);
+  }
 
-  elf_file = fopen(elf_filename, "wb");
-  if (!elf_file) {
-    fprintf(stderr, "Could not open %s\n", elf_filename);
+  if (output == MAP_FAILED) {
+    STATS_BEGIN(STATS_COPY_PAYLOAD);
+    for (size_t i = 0; i != elf.extent_count; ++i) {
+      const struct elf_extent *extent = elf.extents + i;
+      if (pwrite_all(elf_fd, extent->data ? extent->data : buffer + extent->src_offset,
+          extent->size, extent->offset) != 0) {
+        fputs("Could not copy DOL file into ELF file\n", error_file());
+        goto err;
+      }
+    }
+    STATS_END(STATS_COPY_PAYLOAD);
+  } else if (munmap(output, elf.size) != 0) {
+    output = MAP_FAILED;
+    fputs("Could not write ELF file\n", error_file());
     goto err;
   }
-  if (fwrite(&elf.ehdr, sizeof(Elf32_Ehdr), 1, elf_file) != 1) {
-    fputs("Could not write ELF header\n", stderr);
+
+  free(buffer);
+  elf_free(&elf);
+  dol_unmap(&input);
+  return 0;
+
+err:
+  if (output != MAP_FAILED)
+    munmap(output, elf.size);
+  free(buffer);
+  elf_free(&elf);
+  dol_unmap(&input);
+  return 1;
+}
+
+int dol2elf_fd(int dol_fd, int elf_fd, const char *dol_filename,
+  const struct dol2elf_options *options, const struct rel_options *rel)
+{
+  struct Elf elf;
+  memset(&elf, 0, sizeof(struct Elf));
+  struct dol_mapping mapping;
+  memset(&mapping, 0, sizeof(struct dol_mapping));
+
+  // Read the DOL header:
+  STATS_BEGIN(STATS_READ_HEADER);
+  struct dol_source source;
+  Dol_Hdr dhdr;
+  if (dol_locate(dol_fd, dol_filename, &source, &dhdr) != 0)
     goto err;
-  }
-  if (fwrite(elf.phdrs, sizeof(Elf32_Phdr), elf.phnum, elf_file) != elf.phnum) {
-    fputs( "Could not write ELF program headers\n", stderr);
+  STATS_END(STATS_READ_HEADER);
+  if (source.rel)
+    return rel2elf_fd(dol_fd, elf_fd, dol_filename, options, rel);
+  if (source.format != DECODE_NONE)
+    return dol2elf_decoded(dol_fd, elf_fd, dol_filename, &source, options);
+  if (options && options->diag)
+    dol_dump(&dhdr, options->diag);
+
+  // The compressors and the analysis need the whole DOL file:
+  STATS_BEGIN(STATS_PREPARE);
+  if (options && (options->flags & DOL2ELF_NEEDS_DATA)
+    && dol_map(dol_fd, &source, &mapping) != 0) {
+    fprintf(error_file(), "Could not map %s\n", dol_filename);
     goto err;
   }
-  if (fwrite(elf.shdrs, sizeof(Elf32_Shdr), elf.shnum, elf_file) != elf.shnum) {
-    fputs("Could not write ELF section headers\n", stderr);
+  if (elf_prepare(&dhdr, mapping.data, source.size, options, &elf) != 0) {
+    fprintf(error_file(), "Invalid DOL file %s\n", dol_filename);
     goto err;
   }
-  if (fwrite(elf.strtab.data, elf.strtab.used, 1, elf_file) != 1) {
-    fputs("Could not write .strtab section\n", stderr);
+  STATS_END(STATS_PREPARE);
+
+  // All the headers in a single system call:
+  STATS_BEGIN(STATS_WRITE_HEADERS);
+  struct iovec iov[ELF_HEADERS_IOV_MAX];
+  if (writev_headers(elf_fd, iov, elf_headers_iov(&elf, iov)) != 0) {
+    fputs("Could not write ELF headers\n", error_file());
     goto err;
   }
-  if (fseek(dol_file, 0, SEEK_SET) < 0 || file_copy(dol_file, elf_file) != 0) {
-    fputs("Could not copy DOL file into ELF file\n", stderr);
+  STATS_END(STATS_WRITE_HEADERS);
+
+  // Gaps between the extents are left as holes:
+  STATS_BEGIN(STATS_COPY_PAYLOAD);
+  for (size_t i = 0; i != elf.extent_count; ++i) {
+    const struct elf_extent *extent = elf.extents + i;
+    if (extent->data
+      ? pwrite_all(elf_fd, extent->data, extent->size, extent->offset) != 0
+      : fd_copy(dol_fd, source.offset + extent->src_offset,
+          elf_fd, extent->offset, extent->size) != 0) {
+      fputs("Could not copy DOL file into ELF file\n", error_file());
+      goto err;
+    }
+  }
+  if (ftruncate(elf_fd, elf.size) != 0) {
+    fputs("Could not write ELF file\n", error_file());
     goto err;
   }
+  STATS_ADD(STATS_SYSCALLS, 1);
+  STATS_END(STATS_COPY_PAYLOAD);
 
-  fclose(dol_file);
-  fclose(elf_file);
   elf_free(&elf);
+  dol_unmap(&mapping);
   return 0;
 
 err:
-  if (dol_file)
-    fclose(dol_file);
-  if (elf_file)
-    fclose(elf_file);
   elf_free(&elf);
+  dol_unmap(&mapping);
   return 1;
 }
 
-int main(int argc, char **argv)
+static int is_seekable(int fd)
+{
+  struct stat st;
+  return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// "-" stands for stdin or stdout:
+int dol2elf(const char *dol_filename, const char *elf_filename,
+  const struct dol2elf_options *options, const struct rel_options *rel)
 {
-  if (argc != 3) {
-    fprintf(stderr, "Bad usage: dol2elf foo.dol foo.elf\n");
+  int dol_fd = strcmp(dol_filename, "-") == 0 ? STDIN_FILENO
+    : open(dol_filename, O_RDONLY | O_CLOEXEC);
+  if (dol_fd < 0) {
+    fprintf(error_file(), "Could not open %s\n", dol_filename);
+    return 1;
+  }
+  int elf_fd = strcmp(elf_filename, "-") == 0 ? STDOUT_FILENO
+    : open(elf_filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (elf_fd < 0) {
+    fprintf(error_file(), "Could not open %s\n", elf_filename);
+    if (dol_fd != STDIN_FILENO)
+      close(dol_fd);
     return 1;
   }
 
-  return dol2elf(argv[1], argv[2]);
+  // Pipes cannot be read twice or written out of order:
+  int res = is_seekable(dol_fd) && is_seekable(elf_fd)
+    ? dol2elf_fd(dol_fd, elf_fd, dol_filename, options, rel)
+    : dol2elf_stream(dol_fd, elf_fd, dol_filename, options);
+  if (dol_fd != STDIN_FILENO)
+    close(dol_fd);
+  if (elf_fd == STDOUT_FILENO)
+    return res;
+  if (close(elf_fd) != 0 && res == 0) {
+    fprintf(error_file(), "Could not write %s\n", elf_filename);
+    res = 1;
+  }
+  // Do not leave a bogus ELF file behind:
+  if (res != 0)
+    unlink(elf_filename);
+  return res;
 }
@@ -26,9 +26,13 @@ THE SOFTWARE.
 
 #include <stdint.h>
 #include <stdio.h>
+#include <limits.h>
+#include <sys/types.h>
 
 #include <elf.h>
 
+#include "libdol2elf.h"
+
 #define DOL_TEXT_COUNT 7
 #define DOL_DATA_COUNT 11
 
@@ -45,19 +49,180 @@ typedef struct {
   uint32_t padding[7];
 } __attribute__((packed)) Dol_Hdr;
 
-int dol2elf(const char *dol_filename, const char *elf_filename);
+// REL modules are only converted by the tool, the library has no REL
+// settings. Without rel_options, a module becomes a relocatable ELF file;
+// with them it is relocated at base:
+struct rel_options {
+  uint32_t base;
+};
+
+int dol2elf(const char *dol_filename, const char *elf_filename,
+  const struct dol2elf_options *options, const struct rel_options *rel);
+int dol2elf_fd(int dol_fd, int elf_fd, const char *dol_filename,
+  const struct dol2elf_options *options, const struct rel_options *rel);
+int dol2elf_stream(int dol_fd, int elf_fd, const char *dol_filename,
+  const struct dol2elf_options *options);
 int dol_dump(const Dol_Hdr *header, FILE *output);
+// Flat memory image: each segment at its address minus base, the gaps and
+// the bss left as holes.
+struct memory_image {
+  const char *filename;
+  // Lowest segment address unless has_base is set:
+  uint32_t base;
+  int has_base;
+  // Size of the image, 0 to end with the highest segment:
+  uint64_t size;
+};
+
+// Write the ELF file, and optionally a flat memory image and a segment map,
+// from a single read of the DOL:
+int dol2elf_fanout(const char *dol_filename, const char *elf_filename,
+  const struct memory_image *image, const char *map_filename,
+  const struct dol2elf_options *options);
+
+// Input container formats:
+#define DECODE_NONE 0
+#define DECODE_YAZ0 1
+#define DECODE_GZIP 2
+#define DECODE_ZSTD 3
+
+int decode_detect(const void *data, size_t size);
+const char *decode_name(int format);
+int decode_size(int format, const void *data, size_t size, uint64_t *decoded_size);
+int decode(int format, const void *input, size_t input_size,
+  void *output, size_t output_size);
+
+// Where the DOL is in the input file (a DOL file, a GameCube disc image or
+// a compressed DOL file when format is set):
+struct dol_source {
+  uint64_t offset;
+  uint64_t size;
+  int format;
+  // A REL module instead of a DOL:
+  int rel;
+};
+
+struct dol_mapping {
+  void *base;
+  size_t length;
+  const void *data;
+};
+
+uint64_t dol_extent(const Dol_Hdr *dhdr);
+int dol_locate(int fd, const char *filename, struct dol_source *source,
+  Dol_Hdr *dhdr);
+int dol_map(int fd, const struct dol_source *source, struct dol_mapping *mapping);
+void dol_unmap(struct dol_mapping *mapping);
+
+// A DOL file read from any input, decoded in memory when compressed. Its
+// segments are within size:
+struct dol_file {
+  struct dol_mapping mapping;
+  unsigned char *buffer;
+  const unsigned char *data;
+  uint64_t size;
+  Dol_Hdr dhdr;
+};
+
+// REL modules are refused as "Could not <action> REL module <filename>":
+int dol_load(const char *filename, const char *action, struct dol_file *file);
+void dol_release(struct dol_file *file);
+
+// The text and data segments of a DOL file, in the order of its header:
+struct dol_segment {
+  const char *name;
+  uint32_t offset, address, size;
+};
+
+size_t dol_segments(const Dol_Hdr *dhdr, struct dol_segment *segments);
+
+// REL modules:
+int rel_detect(const void *data, size_t size);
+int rel2elf_fd(int rel_fd, int elf_fd, const char *rel_filename,
+  const struct dol2elf_options *options, const struct rel_options *rel);
+
+int has_suffix(const char *filename, const char *suffix);
+// Mode of the files created by open() with 0666:
+mode_t creation_mode(void);
+// Create the parent directories of a file:
+int make_parents(char *path);
+// Monotonic clock, in seconds:
+double now(void);
+// Runs worker(pool) on threads threads, the calling thread included, until
+// it returns on each of them. Returns the number of threads used:
+int run_pool(void *pool, void *(*worker)(void *pool), int threads);
+
+// Where the file conversions of this thread report errors (stderr if NULL):
+extern __thread FILE *error_stream;
+FILE *error_file(void);
 
 extern const char* text_sections[DOL_TEXT_COUNT];
 extern const char* data_sections[DOL_DATA_COUNT];
 
 // Strtab:
+struct strtab_entry {
+  uint32_t hash;
+  uint32_t offset;
+};
+
 struct strtab_info {
   size_t allocated;
   char* data;
   size_t used;
+  // Open addressing hash table of the stored strings:
+  struct strtab_entry *buckets;
+  size_t bucket_count;
+  size_t count;
+};
+
+// Symbols:
+struct symbol {
+  uint32_t address;
+  uint32_t size;
+  uint32_t name;
 };
 
+// Sorted by address:
+struct dol2elf_symbols {
+  struct symbol *symbols;
+  size_t count;
+  struct strtab_info names;
+  uint64_t hash;
+};
+
+// A range of the DOL file copied in the ELF file:
+struct elf_extent {
+  uint32_t offset;
+  uint32_t src_offset;
+  uint32_t size;
+  // When set, the data comes from memory instead of the DOL file:
+  const void *data;
+};
+
+// A compressed section (Elf32_Chdr and the compressed stream):
+struct compressed {
+  void *data;
+  uint32_t size;
+};
+
+// Content hashes of the DOL recorded by DOL2ELF_INCREMENTAL, all fields
+// big-endian:
+#define ELF_NOTE_NAME "dol2elf"
+#define NT_DOL2ELF_HASHES 1
+
+struct elf_note {
+  Elf32_Nhdr nhdr;
+  char name[8];
+  uint64_t options;
+  // Bytes of the DOL outside of the segments (header and padding):
+  uint64_t rest;
+  uint64_t text[DOL_TEXT_COUNT];
+  uint64_t data[DOL_DATA_COUNT];
+} __attribute__((packed));
+
+// .dolhdr and one extent per DOL segment:
+#define ELF_EXTENTS_MAX (1 + DOL_TEXT_COUNT + DOL_DATA_COUNT)
+
 struct Elf {
   size_t load_count;
   size_t phnum;
@@ -68,14 +233,315 @@ struct Elf {
   Elf32_Ehdr ehdr;
   Elf32_Shdr *shdrs;
   Elf32_Phdr *phdrs;
+  // Section indexes:
+  uint16_t text_shndx[DOL_TEXT_COUNT];
+  uint16_t data_shndx[DOL_DATA_COUNT];
+  uint16_t bss_shndx;
+  uint16_t symtab_shndx;
+  // Symbols (.symtab and its .strtab):
+  size_t symnum;
+  Elf32_Sym *syms;
+  const struct strtab_info *symstrtab;
+  struct strtab_info merged_symstrtab;
+  struct dol2elf_symbols *found_symbols;
+  uint32_t symtab_offset;
+  uint32_t symstrtab_offset;
+  // .note.dol2elf, after the symbols:
+  int has_note;
+  struct elf_note note;
+  uint32_t note_offset;
+  // Layout of the DOL data in the ELF file:
+  uint32_t align;
+  uint32_t text_offset[DOL_TEXT_COUNT];
+  uint32_t data_offset[DOL_DATA_COUNT];
+  uint32_t bss_offset;
+  int compressed;
+  struct compressed text_compressed[DOL_TEXT_COUNT];
+  struct compressed data_compressed[DOL_DATA_COUNT];
+  struct elf_extent extents[ELF_EXTENTS_MAX];
+  size_t extent_count;
+  uint64_t size;
 };
 
 void strtab_create(struct strtab_info *strtatb);
 void strtab_destroy(struct strtab_info *strtatb);
+void strtab_reserve(struct strtab_info *strtab, size_t count, size_t size);
 size_t strtab_index(struct strtab_info *strtan, const char *name);
-void strtab_fill(struct strtab_info *strtatb, Dol_Hdr *dhdr);
+void strtab_merge(struct strtab_info *strtab,
+  const char *const *names, size_t count, uint32_t *offsets);
+void strtab_fill(struct strtab_info *strtatb, const Dol_Hdr *dhdr, int symtab);
+
+void create_shdrs(const Dol_Hdr *dhdr, struct Elf *elf);
+void create_phdrs(const Dol_Hdr *dhdr, struct Elf *elf);
+void create_symtab(const Dol_Hdr *dhdr, const struct dol2elf_symbols *symbols,
+  unsigned flags, struct Elf *elf);
+int elf_layout(const Dol_Hdr *dhdr, uint64_t dol_size,
+  const struct dol2elf_options *options, struct Elf *elf);
+
+// Compression:
+#define DOL2ELF_COMPRESS (DOL2ELF_COMPRESS_ZLIB | DOL2ELF_COMPRESS_ZSTD)
+// Conversions reading the whole DOL while preparing the ELF headers:
+#define DOL2ELF_NEEDS_DATA \
+  (DOL2ELF_COMPRESS | DOL2ELF_FIND_FUNCTIONS | DOL2ELF_INCREMENTAL)
+int compress_supported(unsigned flags);
+int compress_segments(const Dol_Hdr *dhdr, const void *dol, uint64_t dol_size,
+  const struct dol2elf_options *options, struct Elf *elf);
+void compressed_free(struct Elf *elf);
+
+// Function discovery:
+struct dol2elf_symbols *find_functions(const Dol_Hdr *dhdr, const void *dol,
+  uint64_t dol_size, const struct dol2elf_options *options);
+
+// Incremental updates:
+int note_fill(const Dol_Hdr *dhdr, const void *dol, uint64_t dol_size,
+  const struct dol2elf_options *options, struct elf_note *note);
+int dol2elf_update(const char *dol_filename, const char *elf_filename,
+  const struct dol2elf_options *options, const struct rel_options *rel);
+// Full conversion published with an atomic rename:
+int dol2elf_replace(const char *dol_filename, const char *elf_filename,
+  const struct dol2elf_options *options, const struct rel_options *rel);
+
+// Conversion:
+struct iovec;
+#define ELF_HEADERS_IOV_MAX 8
+// The DOL data is only needed when compressing:
+int elf_prepare(const Dol_Hdr *dhdr, const void *dol, uint64_t dol_size,
+  const struct dol2elf_options *options, struct Elf *elf);
+int elf_headers_iov(struct Elf *elf, struct iovec *iov);
+void elf_free(struct Elf *elf);
+
+// I/O:
+int writev_all(int fd, struct iovec *iov, int iovcnt);
+int writev_headers(int fd, struct iovec *iov, int iovcnt);
+int pwrite_all(int fd, const void *data, size_t size, off_t offset);
+int pwrite_sparse(int fd, const void *data, size_t size, off_t offset);
+int fd_copy(int in_fd, off_t in_offset, int out_fd, off_t out_offset,
+  uint64_t count);
+// Create or replace filename, removed when it could not be written:
+int write_file(const char *filename, const void *data, size_t size);
+// A file written aside, next to filename, and renamed over it by
+// aside_commit() so that readers never see it partially written. Both
+// aside_commit() and aside_abort() close it, the temporary file is removed
+// unless renamed:
+struct aside_file {
+  int fd;
+  char path[PATH_MAX + 8];
+};
+int aside_open(struct aside_file *file, const char *filename);
+int aside_commit(struct aside_file *file, const char *filename, mode_t mode);
+void aside_abort(struct aside_file *file);
+int write_dol_elf(const char *filename, const unsigned char *data, size_t size,
+  const struct dol2elf_options *options);
+
+// Statistics:
+#include <pthread.h>
+
+enum {
+  STATS_CONVERT,
+  STATS_READ_HEADER,
+  STATS_PREPARE,
+  STATS_WRITE_HEADERS,
+  STATS_COPY_PAYLOAD,
+  STATS_CACHE_LOOKUP,
+  STATS_CACHE_MATERIALIZE,
+  STATS_DECODE,
+  STATS_PHASE_COUNT
+};
+
+enum {
+  STATS_BYTES_READ,
+  STATS_BYTES_WRITTEN,
+  STATS_SYSCALLS,
+  STATS_CACHE_HITS,
+  STATS_CACHE_MISSES,
+  STATS_COUNTER_COUNT
+};
+
+#define STATS_TRACE_JSONL  0
+#define STATS_TRACE_CHROME 1
+
+// A single conversion:
+struct stats_record {
+  const char *name;
+  double first[STATS_PHASE_COUNT];
+  double wall_start[STATS_PHASE_COUNT];
+  double cpu_start[STATS_PHASE_COUNT];
+  double wall[STATS_PHASE_COUNT];
+  double cpu[STATS_PHASE_COUNT];
+  uint64_t calls[STATS_PHASE_COUNT];
+  uint64_t counters[STATS_COUNTER_COUNT];
+};
+
+// Aggregated over all the conversions:
+struct stats {
+  pthread_mutex_t lock;
+  double origin;
+  uint64_t files;
+  uint64_t failures;
+  double wall[STATS_PHASE_COUNT];
+  double cpu[STATS_PHASE_COUNT];
+  uint64_t calls[STATS_PHASE_COUNT];
+  uint64_t counters[STATS_COUNTER_COUNT];
+  FILE *trace;
+  int trace_format;
+  uint64_t events;
+};
+
+// Record of the conversion running on this thread, NULL when disabled:
+extern __thread struct stats_record *stats_record;
+
+#define STATS_BEGIN(phase) \
+  do { if (stats_record) stats_begin(stats_record, phase); } while (0)
+#define STATS_END(phase) \
+  do { if (stats_record) stats_end(stats_record, phase); } while (0)
+#define STATS_ADD(counter, n) \
+  do { if (stats_record) stats_record->counters[counter] += (n); } while (0)
+
+int stats_open(struct stats *stats, const char *trace_filename, int trace_format);
+void stats_close(struct stats *stats);
+void stats_begin_record(struct stats_record *record, const char *name);
+void stats_begin(struct stats_record *record, int phase);
+void stats_end(struct stats_record *record, int phase);
+void stats_merge(struct stats *stats, const struct stats_record *record, int status);
+void stats_print(struct stats *stats, FILE *file);
+
+// io_uring:
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct uring {
+  int fd;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_array, sq_mask;
+  unsigned *cq_head, *cq_tail, cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  // Entries filled but not yet submitted:
+  unsigned pending;
+  // Registered buffers:
+  char *buffers;
+  unsigned buffer_count;
+  unsigned *free_buffers;
+  unsigned free_count;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // Set while a thread waits for the completions in the kernel:
+  int reaping;
+};
+
+// Ring shared by all the conversions of the process, NULL to use
+// synchronous I/O:
+extern struct uring *io_ring;
+
+int uring_open(struct uring *ring, unsigned depth);
+void uring_close(struct uring *ring);
+int uring_pwritev(struct uring *ring, int fd, const struct iovec *iov, int iovcnt,
+  off_t offset);
+int uring_copy(struct uring *ring, int in_fd, off_t in_offset, int out_fd,
+  off_t out_offset, uint64_t count);
+
+// Hash:
+uint64_t hash64(const void *data, size_t size, uint64_t seed);
+
+// Cache:
+struct cache {
+  char *dir;
+  uint64_t max_size;
+  uint64_t pending_bytes;
+  // Statistics:
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t stored_bytes;
+  uint64_t evictions;
+};
+
+int cache_open(struct cache *cache, const char *dir, uint64_t max_size);
+void cache_close(struct cache *cache);
+int cache_convert(struct cache *cache, const char *dol_filename,
+  const char *elf_filename, const struct dol2elf_options *options,
+  const struct rel_options *rel);
+void cache_evict(struct cache *cache);
+void cache_print_stats(const struct cache *cache, FILE *file);
+
+// Batch:
+struct converter {
+  const struct dol2elf_options *options;
+  // NULL unless REL modules are relocated (--rel-base):
+  const struct rel_options *rel;
+  struct cache *cache;
+  struct stats *stats;
+  // Socket of a conversion server to forward the conversions to:
+  const char *server;
+};
+
+int convert_file(const struct converter *converter,
+  const char *dol_filename, const char *elf_filename);
+
+struct batch_job {
+  const char *dol_filename;
+  const char *elf_filename;
+  int status;
+  uint64_t dol_size;
+  uint64_t elf_size;
+};
+
+// Server:
+int server_run(const char *path, int threads, const struct converter *converter);
+int client_convert(const char *path, const char *dol_filename,
+  const char *elf_filename, const struct dol2elf_options *options,
+  const struct rel_options *rel);
+
+int batch_load_manifest(const char *filename,
+  struct batch_job **jobs, size_t *count);
+int batch_is_input(const char *name);
+int batch_job_init(struct batch_job *job, const char *dir, const char *name,
+  const char *output);
+int batch_scan_directory(const char *dir, const char *output, int create,
+  struct batch_job **jobs, size_t *count);
+int batch_run(struct batch_job *jobs, size_t count, int threads,
+  const struct converter *converter);
+// Verifies the ELF files of the jobs instead, segment_threads comparing the
+// segments of each file (0: one per CPU for a single file, 1 otherwise):
+int batch_verify(struct batch_job *jobs, size_t count, int threads,
+  int segment_threads);
+
+// Watch:
+int watch_run(struct batch_job *jobs, size_t count, const char **dirs,
+  const char **outputs, size_t dir_count, int threads, unsigned debounce_ms,
+  const struct converter *converter);
+
+// Verification of ELF files against their DOL, threads comparing the
+// segments of a file (0: one per CPU):
+int dol2elf_verify(const char *dol_filename, const char *elf_filename, int threads);
+
+// Deltas between two DOL files, applied to the old one to rebuild the new
+// DOL (or its ELF file when the output name ends with .elf):
+int delta_create(const char *delta_filename, const char *old_filename,
+  const char *new_filename);
+int delta_apply(const char *delta_filename, const char *old_filename,
+  const char *output_filename, const struct dol2elf_options *options);
+
+// Scan:
+int dol_plausible(const Dol_Hdr *dhdr, uint64_t file_size);
+int scan_run(const char *root, const char *output, int threads,
+  const struct converter *converter);
+
+// Segment store:
+int store_add(const char *dir, char **filenames, size_t count, int threads,
+  const struct dol2elf_options *options);
+int store_get(const char *dir, const char *name, const char *output_filename,
+  const struct dol2elf_options *options);
+
+// Address index:
+int index_build(const char *index_filename, char **filenames, size_t count);
+int index_query(const char *index_filename, char **addresses, size_t count);
 
-void create_shdrs(Dol_Hdr *dhdr, struct Elf *elf);
-void create_phdrs(Dol_Hdr *dhdr, struct Elf *elf);
+// Synthetic DOL files (benchmark and tests):
+void synthetic_add_text(Dol_Hdr *dhdr, int i, uint32_t size,
+  uint32_t *file_offset, uint32_t *vaddr);
+void synthetic_add_data(Dol_Hdr *dhdr, int i, uint32_t size,
+  uint32_t *file_offset, uint32_t *vaddr);
+uint32_t synthetic_random(uint32_t *state);
 
 #endif
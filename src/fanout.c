@@ -0,0 +1,257 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
+#include "doltool.h"
+
+// The DOL is read once and shared by the writers of all the outputs:
+struct fanout {
+  struct dol_file dol;
+  const struct dol2elf_options *options;
+  const struct memory_image *image;
+  FILE *errors;
+};
+
+struct fanout_output {
+  const struct fanout *fanout;
+  const char *filename;
+  int (*write)(const struct fanout *fanout, int fd);
+  int res;
+};
+
+static int write_elf(const struct fanout *fanout, int fd)
+{
+  struct Elf elf;
+  memset(&elf, 0, sizeof(struct Elf));
+  if (elf_prepare(&fanout->dol.dhdr, fanout->dol.data, fanout->dol.size, fanout->options, &elf) != 0) {
+    fputs("Invalid DOL file\n", error_file());
+    goto err;
+  }
+  struct iovec iov[ELF_HEADERS_IOV_MAX];
+  if (writev_headers(fd, iov, elf_headers_iov(&elf, iov)) != 0) {
+    fputs("Could not write ELF headers\n", error_file());
+    goto err;
+  }
+  for (size_t i = 0; i != elf.extent_count; ++i) {
+    const struct elf_extent *extent = elf.extents + i;
+    const void *data = extent->data ? extent->data : fanout->dol.data + extent->src_offset;
+    if (pwrite_all(fd, data, extent->size, extent->offset) != 0) {
+      fputs("Could not copy DOL file into ELF file\n", error_file());
+      goto err;
+    }
+  }
+  if (ftruncate(fd, elf.size) != 0) {
+    fputs("Could not write ELF file\n", error_file());
+    goto err;
+  }
+  elf_free(&elf);
+  return 0;
+
+err:
+  elf_free(&elf);
+  return 1;
+}
+
+static int overlaps(const struct dol_segment *segments, size_t count, size_t i)
+{
+  for (size_t j = 0; j != count; ++j)
+    if (j != i && segments[j].address < segments[i].address + segments[i].size
+      && segments[i].address < segments[j].address + segments[j].size)
+      return 1;
+  return 0;
+}
+
+// Only the segments are written: the gaps and the bss are holes of the
+// truncated file, and so are the blocks of zeros of the segments.
+static int write_image(const struct fanout *fanout, int fd)
+{
+  const struct memory_image *image = fanout->image;
+  struct dol_segment segments[DOL_TEXT_COUNT + DOL_DATA_COUNT];
+  size_t count = dol_segments(&fanout->dol.dhdr, segments);
+  uint64_t start = UINT64_MAX, end = 0;
+  for (size_t i = 0; i != count; ++i) {
+    if (segments[i].address < start)
+      start = segments[i].address;
+    if ((uint64_t) segments[i].address + segments[i].size > end)
+      end = (uint64_t) segments[i].address + segments[i].size;
+  }
+  uint32_t bss_address = ntohl(fanout->dol.dhdr.bss_address);
+  uint32_t bss_size = ntohl(fanout->dol.dhdr.bss_size);
+  if (bss_size) {
+    if (bss_address < start)
+      start = bss_address;
+    if ((uint64_t) bss_address + bss_size > end)
+      end = (uint64_t) bss_address + bss_size;
+  }
+  if (start > end)
+    start = end;
+  if (image->has_base)
+    start = image->base;
+  uint64_t size = image->size ? image->size : end > start ? end - start : 0;
+
+  for (size_t i = 0; i != count; ++i)
+    if (segments[i].address < start
+      || segments[i].address - start + (uint64_t) segments[i].size > size) {
+      fprintf(error_file(), "Segment %s outside of the memory image\n", segments[i].name);
+      return 1;
+    }
+  // Truncate first so that the skipped blocks read as zeros:
+  if (ftruncate(fd, size) != 0) {
+    fputs("Could not write memory image\n", error_file());
+    return 1;
+  }
+  for (size_t i = 0; i != count; ++i) {
+    // A zero block of a segment may hide the end of an overlapping one:
+    int (*write)(int, const void*, size_t, off_t) =
+      overlaps(segments, count, i) ? pwrite_all : pwrite_sparse;
+    if (write(fd, fanout->dol.data + segments[i].offset, segments[i].size,
+        segments[i].address - start) != 0) {
+      fputs("Could not write memory image\n", error_file());
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int print_map_json(const struct fanout *fanout, FILE *file)
+{
+  struct dol_segment segments[DOL_TEXT_COUNT + DOL_DATA_COUNT];
+  size_t count = dol_segments(&fanout->dol.dhdr, segments);
+  fputs("{\"segments\":[", file);
+  for (size_t i = 0; i != count; ++i)
+    fprintf(file,
+      "%s{\"name\":\"%s\",\"address\":%" PRIu32 ",\"size\":%" PRIu32 ",\"offset\":%" PRIu32 "}",
+      i ? "," : "", segments[i].name, segments[i].address, segments[i].size,
+      segments[i].offset);
+  fprintf(file,
+    "],\"bss\":{\"address\":%" PRIu32 ",\"size\":%" PRIu32 "},\"entry_point\":%" PRIu32 "}\n",
+    ntohl(fanout->dol.dhdr.bss_address), ntohl(fanout->dol.dhdr.bss_size),
+    ntohl(fanout->dol.dhdr.entry_point));
+  return 0;
+}
+
+static int write_map(int fd, const struct fanout *fanout,
+  int (*print)(const struct fanout *fanout, FILE *file))
+{
+  // The descriptor is closed by the caller:
+  FILE *file = fdopen(dup(fd), "w");
+  if (!file || print(fanout, file) != 0 || fclose(file) != 0) {
+    fputs("Could not write segment map\n", error_file());
+    return 1;
+  }
+  return 0;
+}
+
+static int print_map_text(const struct fanout *fanout, FILE *file)
+{
+  return dol_dump(&fanout->dol.dhdr, file);
+}
+
+static int write_map_text(const struct fanout *fanout, int fd)
+{
+  return write_map(fd, fanout, print_map_text);
+}
+
+static int write_map_json(const struct fanout *fanout, int fd)
+{
+  return write_map(fd, fanout, print_map_json);
+}
+
+static void *output_worker(void *arg)
+{
+  struct fanout_output *output = arg;
+  error_stream = output->fanout->errors;
+  int fd = strcmp(output->filename, "-") == 0 ? dup(STDOUT_FILENO)
+    : open(output->filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    fprintf(error_file(), "Could not open %s\n", output->filename);
+    output->res = 1;
+    return NULL;
+  }
+  output->res = output->write(output->fanout, fd);
+  if (close(fd) != 0 && output->res == 0) {
+    fprintf(error_file(), "Could not write %s\n", output->filename);
+    output->res = 1;
+  }
+  // Do not leave a bogus file behind:
+  if (output->res != 0 && strcmp(output->filename, "-") != 0)
+    unlink(output->filename);
+  return NULL;
+}
+
+int dol2elf_fanout(const char *dol_filename, const char *elf_filename,
+  const struct memory_image *image, const char *map_filename,
+  const struct dol2elf_options *options)
+{
+  struct fanout fanout;
+  memset(&fanout, 0, sizeof(struct fanout));
+  fanout.options = options;
+  fanout.image = image;
+  fanout.errors = error_file();
+  // The writers trust the segments:
+  if (dol_load(dol_filename, "write a memory image of", &fanout.dol) != 0)
+    return 1;
+  if (options && options->diag)
+    dol_dump(&fanout.dol.dhdr, options->diag);
+
+  struct fanout_output outputs[3];
+  size_t count = 0;
+  struct fanout_output elf = { &fanout, elf_filename, write_elf, 0 };
+  outputs[count++] = elf;
+  if (image) {
+    struct fanout_output output = { &fanout, image->filename, write_image, 0 };
+    outputs[count++] = output;
+  }
+  if (map_filename) {
+    struct fanout_output map = { &fanout, map_filename,
+      has_suffix(map_filename, ".json") ? write_map_json : write_map_text, 0 };
+    outputs[count++] = map;
+  }
+
+  // The calling thread writes the last output:
+  pthread_t workers[3];
+  int started[3] = { 0 };
+  for (size_t i = 0; i + 1 < count; ++i)
+    started[i] = pthread_create(&workers[i], NULL, output_worker, &outputs[i]) == 0;
+  for (size_t i = 0; i + 1 < count; ++i)
+    if (!started[i])
+      output_worker(&outputs[i]);
+  output_worker(&outputs[count - 1]);
+  int res = 0;
+  for (size_t i = 0; i != count; ++i) {
+    if (i + 1 < count && started[i])
+      pthread_join(workers[i], NULL);
+    res |= outputs[i].res;
+  }
+
+  dol_release(&fanout.dol);
+  return res;
+}
@@ -0,0 +1,290 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "doltool.h"
+
+// Text is scanned in chunks of this size so that big segments are split
+// among the threads:
+#define FUNCTIONS_CHUNK (1024*1024)
+#define FUNCTIONS_MAX_CHUNKS 4096
+
+// PowerPC instructions (value and mask):
+#define PPC_STWU_R1    0x94218000 // stwu r1,-x(r1)
+#define PPC_STWU_MASK  0xffff8000
+#define PPC_MFLR_R0    0x7c0802a6 // mflr r0
+#define PPC_BL         0x48000001 // bl target (relative)
+#define PPC_BL_MASK    0xfc000003
+
+// Four instructions matched at once (GCC vector extension), the patterns
+// are kept in the big-endian byte order of the DOL to avoid swapping:
+typedef uint32_t words4 __attribute__((vector_size(16)));
+typedef int32_t mask4 __attribute__((vector_size(16)));
+
+struct functions_job {
+  const unsigned char *data;
+  uint32_t address;
+  uint32_t size;
+  // Whether the chunk follows another one in the same segment:
+  int has_previous;
+  // Function starts found in the chunk:
+  uint32_t *starts;
+  size_t count;
+  size_t allocated;
+};
+
+struct functions_pool {
+  struct functions_job *jobs;
+  size_t count;
+  size_t next;
+};
+
+static void add_start(struct functions_job *job, uint32_t address)
+{
+  if (job->count == job->allocated) {
+    job->allocated = job->allocated ? job->allocated * 2 : 256;
+    job->starts = realloc(job->starts, job->allocated * sizeof(uint32_t));
+  }
+  job->starts[job->count++] = address;
+}
+
+static void match_word(struct functions_job *job, uint32_t offset)
+{
+  uint32_t word, previous = 0;
+  memcpy(&word, job->data + offset, 4);
+  word = ntohl(word);
+  uint32_t address = job->address + offset;
+  if ((word & PPC_STWU_MASK) == PPC_STWU_R1) {
+    // The stack frame is allocated before or after saving LR:
+    if (offset >= 4 || job->has_previous) {
+      memcpy(&previous, job->data + offset - 4, 4);
+      previous = ntohl(previous);
+    }
+    add_start(job, previous == PPC_MFLR_R0 ? address - 4 : address);
+  } else if ((word & PPC_BL_MASK) == PPC_BL) {
+    // 24-bit signed word displacement:
+    int32_t displacement = (int32_t) ((word & 0x03fffffc) << 6) >> 6;
+    add_start(job, address + displacement);
+  }
+}
+
+static void scan_chunk(struct functions_job *job)
+{
+  const words4 stwu = { htonl(PPC_STWU_R1), htonl(PPC_STWU_R1),
+    htonl(PPC_STWU_R1), htonl(PPC_STWU_R1) };
+  const words4 stwu_mask = { htonl(PPC_STWU_MASK), htonl(PPC_STWU_MASK),
+    htonl(PPC_STWU_MASK), htonl(PPC_STWU_MASK) };
+  const words4 bl = { htonl(PPC_BL), htonl(PPC_BL), htonl(PPC_BL), htonl(PPC_BL) };
+  const words4 bl_mask = { htonl(PPC_BL_MASK), htonl(PPC_BL_MASK),
+    htonl(PPC_BL_MASK), htonl(PPC_BL_MASK) };
+
+  uint32_t offset = 0;
+  for (; offset + 16 <= job->size; offset += 16) {
+    words4 words;
+    memcpy(&words, job->data + offset, 16);
+    mask4 hits = ((words & stwu_mask) == stwu) | ((words & bl_mask) == bl);
+    uint64_t any[2];
+    memcpy(any, &hits, 16);
+    if (!(any[0] | any[1]))
+      continue;
+    for (int i = 0; i != 4; ++i)
+      if (hits[i])
+        match_word(job, offset + 4 * i);
+  }
+  for (; offset + 4 <= job->size; offset += 4)
+    match_word(job, offset);
+}
+
+static void *functions_worker(void *arg)
+{
+  struct functions_pool *pool = arg;
+  while (1) {
+    size_t i = __sync_fetch_and_add(&pool->next, 1);
+    if (i >= pool->count)
+      return NULL;
+    scan_chunk(pool->jobs + i);
+  }
+}
+
+// Text segment containing the address, -1 if none:
+static int find_text(const Dol_Hdr *dhdr, uint32_t address)
+{
+  for (int i=0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i]
+      && address - ntohl(dhdr->text_address[i]) < ntohl(dhdr->text_size[i]))
+      return i;
+  return -1;
+}
+
+static int compare_symbols(const void *a, const void *b)
+{
+  const struct symbol *x = a, *y = b;
+  if (x->address != y->address)
+    return x->address < y->address ? -1 : 1;
+  return x->name < y->name ? -1 : x->name > y->name;
+}
+
+// Both the given symbols and the functions, the given symbols first:
+static struct dol2elf_symbols *merge_symbols(const Dol_Hdr *dhdr,
+  const uint32_t *starts, size_t count, const struct dol2elf_symbols *known)
+{
+  struct dol2elf_symbols *symbols = calloc(1, sizeof(struct dol2elf_symbols));
+  if (!symbols)
+    return NULL;
+  size_t known_count = known ? known->count : 0;
+  symbols->symbols = malloc((known_count + count) * sizeof(struct symbol));
+  strtab_create(&symbols->names);
+  strtab_reserve(&symbols->names, known_count + count,
+    (known ? known->names.used : 0) + count * sizeof("fn_80000000"));
+
+  size_t j = 0;
+  for (size_t i = 0; i != count; ++i) {
+    // Keep the names from the symbol map:
+    while (j != known_count && known->symbols[j].address < starts[i])
+      ++j;
+    if (j != known_count && known->symbols[j].address == starts[i])
+      continue;
+
+    int text = find_text(dhdr, starts[i]);
+    uint32_t end = ntohl(dhdr->text_address[text]) + ntohl(dhdr->text_size[text]);
+    if (i + 1 != count && starts[i + 1] < end)
+      end = starts[i + 1];
+    static const char digits[] = "0123456789abcdef";
+    char name[sizeof("fn_80000000")] = "fn_";
+    for (int k = 0; k != 8; ++k)
+      name[3 + k] = digits[(starts[i] >> (28 - 4 * k)) & 0xf];
+    name[11] = '\0';
+    struct symbol *symbol = symbols->symbols + symbols->count++;
+    symbol->address = starts[i];
+    symbol->size = end - starts[i];
+    symbol->name = strtab_index(&symbols->names, name);
+  }
+
+  // The functions found are already sorted:
+  for (size_t i = 0; i != known_count; ++i) {
+    struct symbol *symbol = symbols->symbols + symbols->count++;
+    *symbol = known->symbols[i];
+    symbol->name = strtab_index(&symbols->names, known->names.data + known->symbols[i].name);
+  }
+  if (known_count)
+    qsort(symbols->symbols, symbols->count, sizeof(struct symbol), compare_symbols);
+  return symbols;
+}
+
+// Function starts: stack frame allocations and call targets in the text
+// segments.
+struct dol2elf_symbols *find_functions(const Dol_Hdr *dhdr, const void *dol,
+  uint64_t dol_size, const struct dol2elf_options *options)
+{
+  struct functions_job *jobs = calloc(FUNCTIONS_MAX_CHUNKS, sizeof(struct functions_job));
+  if (!jobs)
+    return NULL;
+  size_t count = 0;
+  for (int i=0; i != DOL_TEXT_COUNT; ++i) {
+    uint32_t offset = ntohl(dhdr->text_offset[i]), size = ntohl(dhdr->text_size[i]);
+    if ((uint64_t) offset + size > dol_size) {
+      free(jobs);
+      return NULL;
+    }
+    for (uint32_t done = 0; done < size && count != FUNCTIONS_MAX_CHUNKS;
+      done += FUNCTIONS_CHUNK) {
+      struct functions_job *job = jobs + count++;
+      job->data = (const unsigned char*) dol + offset + done;
+      job->address = ntohl(dhdr->text_address[i]) + done;
+      job->size = size - done < FUNCTIONS_CHUNK ? size - done : FUNCTIONS_CHUNK;
+      job->has_previous = done != 0;
+      // The last chunk gets the rest:
+      if (count == FUNCTIONS_MAX_CHUNKS)
+        job->size = size - done;
+    }
+  }
+
+  struct functions_pool pool = { jobs, count, 0 };
+  size_t threads = options->threads;
+  if (threads == 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > count)
+    threads = count;
+
+  run_pool(&pool, functions_worker, threads);
+
+  // One bit per instruction of each text segment: the starts come out of
+  // it sorted and unique without sorting the many call targets.
+  uint64_t *bitmaps[DOL_TEXT_COUNT] = { NULL };
+  for (int i=0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i])
+      bitmaps[i] = calloc(ntohl(dhdr->text_size[i]) / 4 / 64 + 1, sizeof(uint64_t));
+  size_t total = 0;
+  for (size_t i = 0; i != count; ++i) {
+    for (size_t j = 0; j != jobs[i].count; ++j) {
+      uint32_t start = jobs[i].starts[j];
+      int text = find_text(dhdr, start);
+      if ((start & 3) || text < 0)
+        continue;
+      uint32_t index = (start - ntohl(dhdr->text_address[text])) / 4;
+      uint64_t bit = (uint64_t) 1 << (index % 64);
+      if (!(bitmaps[text][index / 64] & bit)) {
+        bitmaps[text][index / 64] |= bit;
+        ++total;
+      }
+    }
+    free(jobs[i].starts);
+  }
+  free(jobs);
+
+  // Segments by address:
+  int order[DOL_TEXT_COUNT];
+  int segment_count = 0;
+  for (int i=0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i]) {
+      int j = segment_count++;
+      for (; j && ntohl(dhdr->text_address[order[j - 1]]) > ntohl(dhdr->text_address[i]); --j)
+        order[j] = order[j - 1];
+      order[j] = i;
+    }
+
+  uint32_t *starts = malloc((total ? total : 1) * sizeof(uint32_t));
+  size_t unique = 0;
+  for (int k = 0; k != segment_count; ++k) {
+    int text = order[k];
+    uint32_t words = ntohl(dhdr->text_size[text]) / 4;
+    for (uint32_t index = 0; index < words; index += 64) {
+      uint64_t bits = bitmaps[text][index / 64];
+      while (bits) {
+        int bit = __builtin_ctzll(bits);
+        starts[unique++] = ntohl(dhdr->text_address[text]) + 4 * (index + bit);
+        bits &= bits - 1;
+      }
+    }
+    free(bitmaps[text]);
+  }
+
+  struct dol2elf_symbols *symbols = merge_symbols(dhdr, starts, unique, options->symbols);
+  free(starts);
+  return symbols;
+}
@@ -0,0 +1,126 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <string.h>
+
+#include "doltool.h"
+
+// XXH64 (https://github.com/Cyan4973/xxHash).
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap64(value);
+#endif
+  return value;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap32(value);
+#endif
+  return value;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t value)
+{
+  acc ^= round64(0, value);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t hash64(const void *data, size_t size, uint64_t seed)
+{
+  const unsigned char *p = data;
+  const unsigned char *end = p + size;
+  uint64_t hash;
+
+  if (size >= 32) {
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+    const unsigned char *limit = end - 32;
+    do {
+      v1 = round64(v1, read64(p));
+      v2 = round64(v2, read64(p + 8));
+      v3 = round64(v3, read64(p + 16));
+      v4 = round64(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+    hash = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    hash = merge64(hash, v1);
+    hash = merge64(hash, v2);
+    hash = merge64(hash, v3);
+    hash = merge64(hash, v4);
+  } else {
+    hash = seed + PRIME64_5;
+  }
+
+  hash += size;
+
+  while (p + 8 <= end) {
+    hash ^= round64(0, read64(p));
+    hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    hash ^= (uint64_t) read32(p) * PRIME64_1;
+    hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  while (p < end) {
+    hash ^= *p * PRIME64_5;
+    hash = rotl64(hash, 11) * PRIME64_1;
+    ++p;
+  }
+
+  hash ^= hash >> 33;
+  hash *= PRIME64_2;
+  hash ^= hash >> 29;
+  hash *= PRIME64_3;
+  hash ^= hash >> 32;
+  return hash;
+}
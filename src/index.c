@@ -0,0 +1,367 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "doltool.h"
+
+// Native byte order, the magic number tells if the index can be used here:
+#define INDEX_MAGIC 0x44584449 // "IDXD"
+#define INDEX_VERSION 1
+
+// Segment numbers, in the order of the DOL header:
+#define INDEX_BSS (DOL_TEXT_COUNT + DOL_DATA_COUNT)
+
+struct index_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t range_count;
+  uint32_t file_count;
+  uint32_t names_size;
+  uint32_t padding;
+};
+
+// Sorted by start address. max_end is the largest end of this range and
+// of the ones before it so that a lookup can stop scanning backwards:
+struct index_range {
+  uint32_t start;
+  uint32_t end;
+  uint32_t max_end;
+  uint32_t file;
+  uint64_t file_offset;
+  uint32_t segment;
+  uint32_t padding;
+};
+
+struct index_file {
+  uint32_t name;
+  uint32_t entry_point;
+};
+
+struct index {
+  void *data;
+  size_t size;
+  const struct index_header *header;
+  const struct index_range *ranges;
+  const struct index_file *files;
+  const char *names;
+};
+
+struct index_builder {
+  struct index_range *ranges;
+  size_t range_count;
+  size_t ranges_allocated;
+  struct index_file *files;
+  size_t file_count;
+  struct strtab_info names;
+};
+
+static void add_range(struct index_builder *builder, uint32_t start, uint32_t size,
+  uint64_t file_offset, uint32_t segment)
+{
+  if (!size || (uint64_t) start + size > UINT32_MAX + (uint64_t) 1)
+    return;
+  if (builder->range_count == builder->ranges_allocated) {
+    builder->ranges_allocated = builder->ranges_allocated ? builder->ranges_allocated * 2 : 256;
+    builder->ranges = realloc(builder->ranges,
+      builder->ranges_allocated * sizeof(struct index_range));
+  }
+  struct index_range *range = builder->ranges + builder->range_count++;
+  memset(range, 0, sizeof(struct index_range));
+  range->start = start;
+  range->end = start + size - 1;
+  range->file = builder->file_count;
+  range->file_offset = file_offset;
+  range->segment = segment;
+}
+
+// Compressed inputs are indexed with offsets in the decoded DOL:
+static int read_header(const char *filename, struct dol_source *source, Dol_Hdr *dhdr)
+{
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    return -1;
+  }
+  int res = dol_locate(fd, filename, source, dhdr);
+  if (res == 0 && source->rel) {
+    fprintf(stderr, "Could not index REL module %s\n", filename);
+    res = -1;
+  }
+  if (res == 0 && source->format != DECODE_NONE) {
+    struct dol_mapping mapping;
+    res = dol_map(fd, source, &mapping);
+    if (res == 0) {
+      res = decode(source->format, mapping.data, source->size, dhdr, sizeof(Dol_Hdr));
+      dol_unmap(&mapping);
+    }
+    if (res != 0)
+      fprintf(stderr, "Could not decode %s\n", filename);
+    source->offset = 0;
+  }
+  close(fd);
+  return res;
+}
+
+static int add_file(struct index_builder *builder, const char *filename)
+{
+  struct dol_source source;
+  Dol_Hdr dhdr;
+  if (read_header(filename, &source, &dhdr) != 0)
+    return -1;
+
+  for (int i=0; i != DOL_TEXT_COUNT; ++i)
+    add_range(builder, ntohl(dhdr.text_address[i]), ntohl(dhdr.text_size[i]),
+      source.offset + ntohl(dhdr.text_offset[i]), i);
+  for (int i=0; i != DOL_DATA_COUNT; ++i)
+    add_range(builder, ntohl(dhdr.data_address[i]), ntohl(dhdr.data_size[i]),
+      source.offset + ntohl(dhdr.data_offset[i]), DOL_TEXT_COUNT + i);
+  add_range(builder, ntohl(dhdr.bss_address), ntohl(dhdr.bss_size), 0, INDEX_BSS);
+
+  builder->files = realloc(builder->files,
+    (builder->file_count + 1) * sizeof(struct index_file));
+  struct index_file *file = builder->files + builder->file_count++;
+  file->name = strtab_index(&builder->names, filename);
+  file->entry_point = ntohl(dhdr.entry_point);
+  return 0;
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+  const struct index_range *x = a, *y = b;
+  if (x->start != y->start)
+    return x->start < y->start ? -1 : 1;
+  if (x->file != y->file)
+    return x->file < y->file ? -1 : 1;
+  return x->segment < y->segment ? -1 : x->segment > y->segment;
+}
+
+int index_build(const char *index_filename, char **filenames, size_t count)
+{
+  struct index_builder builder;
+  memset(&builder, 0, sizeof(struct index_builder));
+  strtab_create(&builder.names);
+  int res = 0;
+  for (size_t i = 0; i != count; ++i)
+    if (add_file(&builder, filenames[i]) != 0)
+      res = 1;
+
+  qsort(builder.ranges, builder.range_count, sizeof(struct index_range),
+    compare_ranges);
+  uint32_t max_end = 0;
+  for (size_t i = 0; i != builder.range_count; ++i) {
+    if (builder.ranges[i].end > max_end)
+      max_end = builder.ranges[i].end;
+    builder.ranges[i].max_end = max_end;
+  }
+
+  struct index_header header;
+  memset(&header, 0, sizeof(struct index_header));
+  header.magic = INDEX_MAGIC;
+  header.version = INDEX_VERSION;
+  header.range_count = builder.range_count;
+  header.file_count = builder.file_count;
+  header.names_size = builder.names.used;
+
+  // Written aside and renamed so that readers never see a partial index:
+  struct aside_file index;
+  if (aside_open(&index, index_filename) != 0) {
+    fprintf(stderr, "Could not create a temporary file for %s\n", index_filename);
+    res = 1;
+    goto out;
+  }
+  struct iovec iov[4] = {
+    { &header, sizeof(header) },
+    { builder.ranges, builder.range_count * sizeof(struct index_range) },
+    { builder.files, builder.file_count * sizeof(struct index_file) },
+    { builder.names.data, builder.names.used },
+  };
+  int written = writev_all(index.fd, iov, 4) == 0;
+  if (!written)
+    aside_abort(&index);
+  if (!written || aside_commit(&index, index_filename, 0644) != 0) {
+    fprintf(stderr, "Could not write %s\n", index_filename);
+    res = 1;
+    goto out;
+  }
+  fprintf(stderr, "%zu ranges of %zu files indexed\n",
+    builder.range_count, builder.file_count);
+
+out:
+  free(builder.ranges);
+  free(builder.files);
+  strtab_destroy(&builder.names);
+  return res;
+}
+
+static int index_open(struct index *index, const char *filename)
+{
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  index->size = st.st_size;
+  index->data = index->size >= sizeof(struct index_header)
+    ? mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (index->data == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s\n", filename);
+    return -1;
+  }
+
+  const struct index_header *header = index->data;
+  uint64_t size = sizeof(struct index_header)
+    + (uint64_t) header->range_count * sizeof(struct index_range)
+    + (uint64_t) header->file_count * sizeof(struct index_file)
+    + header->names_size;
+  if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION
+    || size != index->size || header->names_size == 0) {
+    fprintf(stderr, "Invalid index %s\n", filename);
+    munmap(index->data, index->size);
+    return -1;
+  }
+  index->header = header;
+  index->ranges = (const struct index_range*) (header + 1);
+  index->files = (const struct index_file*) (index->ranges + header->range_count);
+  index->names = (const char*) (index->files + header->file_count);
+
+  // Lookups follow the ranges to their file and print the names as strings:
+  int valid = index->names[header->names_size - 1] == '\0';
+  for (size_t i = 0; valid && i != header->range_count; ++i)
+    valid = index->ranges[i].file < header->file_count
+      && index->ranges[i].segment <= INDEX_BSS;
+  if (!valid) {
+    fprintf(stderr, "Invalid index %s\n", filename);
+    munmap(index->data, index->size);
+    return -1;
+  }
+  return 0;
+}
+
+static const char *segment_name(uint32_t segment)
+{
+  if (segment < DOL_TEXT_COUNT)
+    return text_sections[segment];
+  if (segment < INDEX_BSS)
+    return data_sections[segment - DOL_TEXT_COUNT];
+  return ".bss";
+}
+
+// Every range containing the address, the last one starting before it
+// first:
+static size_t index_lookup(const struct index *index, uint32_t address, FILE *output)
+{
+  const struct index_range *ranges = index->ranges;
+  size_t low = 0, high = index->header->range_count;
+  while (low != high) {
+    size_t middle = low + (high - low) / 2;
+    if (ranges[middle].start <= address)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  size_t count = 0;
+  for (size_t i = low; i-- && ranges[i].max_end >= address;) {
+    const struct index_range *range = ranges + i;
+    if (range->end < address)
+      continue;
+    const struct index_file *file = index->files + range->file;
+    const char *name = file->name < index->header->names_size
+      ? index->names + file->name : "?";
+    if (range->segment == INDEX_BSS)
+      fprintf(output, "0x%08" PRIx32 " %s %s -", address, name, ".bss");
+    else
+      fprintf(output, "0x%08" PRIx32 " %s %s 0x%" PRIx64, address, name,
+        segment_name(range->segment), range->file_offset + (address - range->start));
+    fputs(address == file->entry_point ? " entry\n" : "\n", output);
+    ++count;
+  }
+  if (!count)
+    fprintf(output, "0x%08" PRIx32 " -\n", address);
+  return count;
+}
+
+// A hexadecimal address, with nothing but blanks after it:
+static int parse_address(const char *text, uint32_t *address)
+{
+  char *end;
+  errno = 0;
+  unsigned long value = strtoul(text, &end, 16);
+  if (end == text || errno != 0 || value > UINT32_MAX)
+    return -1;
+  end += strspn(end, " \t\r\n");
+  if (*end != '\0')
+    return -1;
+  *address = value;
+  return 0;
+}
+
+// Addresses from the arguments or one per line on stdin:
+int index_query(const char *index_filename, char **addresses, size_t count)
+{
+  struct index index;
+  if (index_open(&index, index_filename) != 0)
+    return 1;
+
+  int res = 0;
+  uint32_t address;
+  if (count) {
+    for (size_t i = 0; i != count; ++i) {
+      if (parse_address(addresses[i], &address) != 0) {
+        fprintf(stderr, "Bad address: %s\n", addresses[i]);
+        res = 1;
+        continue;
+      }
+      index_lookup(&index, address, stdout);
+    }
+  } else {
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, stdin) >= 0) {
+      if (parse_address(line, &address) != 0) {
+        fprintf(stderr, "Bad address: %s", line);
+        res = 1;
+        continue;
+      }
+      index_lookup(&index, address, stdout);
+    }
+    free(line);
+  }
+  munmap(index.data, index.size);
+  return res;
+}
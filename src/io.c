@@ -0,0 +1,374 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+
+#include "doltool.h"
+
+#define COPY_BUFFER_SIZE (1024*1024)
+#define HOLE_BLOCK_SIZE 4096
+
+int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt) {
+    ssize_t count = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+    STATS_ADD(STATS_SYSCALLS, 1);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    STATS_ADD(STATS_BYTES_WRITTEN, count);
+    // Skip what has been written:
+    while (iovcnt && (size_t) count >= iov->iov_len) {
+      count -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt) {
+      iov->iov_base = (char*) iov->iov_base + count;
+      iov->iov_len -= count;
+    }
+  }
+  return 0;
+}
+
+// Writes the headers at the start of the file, through the ring if there is
+// one:
+int writev_headers(int fd, struct iovec *iov, int iovcnt)
+{
+  if (io_ring && uring_pwritev(io_ring, fd, iov, iovcnt, 0) == 0)
+    return 0;
+  STATS_ADD(STATS_SYSCALLS, 1);
+  if (lseek(fd, 0, SEEK_SET) != 0)
+    return -1;
+  return writev_all(fd, iov, iovcnt);
+}
+
+int pwrite_all(int fd, const void *data, size_t size, off_t offset)
+{
+  const char *buffer = data;
+  while (size) {
+    ssize_t count = pwrite(fd, buffer, size, offset);
+    STATS_ADD(STATS_SYSCALLS, 1);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    STATS_ADD(STATS_BYTES_WRITTEN, count);
+    buffer += count;
+    size -= count;
+    offset += count;
+  }
+  return 0;
+}
+
+static int is_zero(const char *data, size_t size)
+{
+  return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+// Blocks of zeros are not written: they stay holes in a file that was
+// truncated beforehand.
+int pwrite_sparse(int fd, const void *data, size_t size, off_t offset)
+{
+  const char *buffer = data;
+  size_t start = 0;
+  for (size_t position = 0; position != size; ) {
+    // Blocks are aligned on the file offsets:
+    size_t block = HOLE_BLOCK_SIZE - (offset + position) % HOLE_BLOCK_SIZE;
+    if (block > size - position)
+      block = size - position;
+    if (is_zero(buffer + position, block)) {
+      if (pwrite_all(fd, buffer + start, position - start, offset + start) != 0)
+        return -1;
+      start = position + block;
+    }
+    position += block;
+  }
+  return pwrite_all(fd, buffer + start, size - start, offset + start);
+}
+
+// Share the extents when both offsets are block aligned (btrfs, XFS):
+static int fd_clone(int in_fd, off_t in_offset, int out_fd, off_t out_offset,
+  uint64_t count)
+{
+#ifdef FICLONERANGE
+  struct stat st;
+  if (fstat(out_fd, &st) != 0 || st.st_blksize <= 0)
+    return -1;
+  if (in_offset % st.st_blksize || out_offset % st.st_blksize)
+    return -1;
+  struct file_clone_range range;
+  range.src_fd = in_fd;
+  range.src_offset = in_offset;
+  range.src_length = count;
+  range.dest_offset = out_offset;
+  STATS_ADD(STATS_SYSCALLS, 1);
+  if (ioctl(out_fd, FICLONERANGE, &range) != 0)
+    return -1;
+  STATS_ADD(STATS_BYTES_READ, count);
+  STATS_ADD(STATS_BYTES_WRITTEN, count);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+static int fd_copy_buffer(int in_fd, off_t in_offset, int out_fd, off_t out_offset,
+  uint64_t count)
+{
+  char *buffer = malloc(COPY_BUFFER_SIZE);
+  if (!buffer)
+    return -1;
+  int res = 0;
+  while (count) {
+    size_t chunk = count < COPY_BUFFER_SIZE ? count : COPY_BUFFER_SIZE;
+    ssize_t read_count = pread(in_fd, buffer, chunk, in_offset);
+    STATS_ADD(STATS_SYSCALLS, 1);
+    if (read_count < 0 && errno == EINTR)
+      continue;
+    if (read_count <= 0) {
+      res = -1;
+      break;
+    }
+    ssize_t written = 0;
+    while (written != read_count) {
+      ssize_t n = pwrite(out_fd, buffer + written, read_count - written,
+        out_offset + written);
+      if (n < 0 && errno == EINTR)
+        continue;
+      STATS_ADD(STATS_SYSCALLS, 1);
+      if (n <= 0) {
+        res = -1;
+        break;
+      }
+      written += n;
+    }
+    if (res)
+      break;
+    STATS_ADD(STATS_BYTES_READ, read_count);
+    STATS_ADD(STATS_BYTES_WRITTEN, read_count);
+    in_offset += read_count;
+    out_offset += read_count;
+    count -= read_count;
+  }
+  free(buffer);
+  return res;
+}
+
+int fd_copy(int in_fd, off_t in_offset, int out_fd, off_t out_offset,
+  uint64_t count)
+{
+  if (count == 0)
+    return 0;
+
+  if (fd_clone(in_fd, in_offset, out_fd, out_offset, count) == 0)
+    return 0;
+
+  if (io_ring && uring_copy(io_ring, in_fd, in_offset, out_fd, out_offset, count) == 0)
+    return 0;
+
+  // In-kernel copy, which may itself reflink or offload the copy:
+  loff_t in_pos = in_offset, out_pos = out_offset;
+  while (count) {
+    ssize_t n = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, count, 0);
+    STATS_ADD(STATS_SYSCALLS, 1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    STATS_ADD(STATS_BYTES_READ, n);
+    STATS_ADD(STATS_BYTES_WRITTEN, n);
+    count -= n;
+  }
+  if (count == 0)
+    return 0;
+
+  // sendfile writes at the current file offset of the output:
+  if (lseek(out_fd, out_pos, SEEK_SET) == out_pos) {
+    off_t pos = in_pos;
+    while (count) {
+      ssize_t n = sendfile(out_fd, in_fd, &pos, count);
+      STATS_ADD(STATS_SYSCALLS, 1);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      STATS_ADD(STATS_BYTES_READ, n);
+      STATS_ADD(STATS_BYTES_WRITTEN, n);
+      count -= n;
+    }
+    in_pos = pos;
+    out_pos = lseek(out_fd, 0, SEEK_CUR);
+    if (count == 0)
+      return 0;
+    if (out_pos < 0)
+      return -1;
+  }
+
+  return fd_copy_buffer(in_fd, in_pos, out_fd, out_pos, count);
+}
+
+int dol_load(const char *filename, const char *action, struct dol_file *file)
+{
+  memset(file, 0, sizeof(struct dol_file));
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(error_file(), "Could not open %s\n", filename);
+    return -1;
+  }
+  struct dol_source source;
+  if (dol_locate(fd, filename, &source, &file->dhdr) != 0)
+    goto err;
+  if (source.rel) {
+    fprintf(error_file(), "Could not %s REL module %s\n", action, filename);
+    goto err;
+  }
+  // The mapping outlives the descriptor:
+  if (dol_map(fd, &source, &file->mapping) != 0) {
+    fprintf(error_file(), "Could not map %s\n", filename);
+    goto err;
+  }
+  file->data = file->mapping.data;
+  file->size = source.size;
+  if (source.format != DECODE_NONE) {
+    if (decode_size(source.format, file->mapping.data, source.size, &file->size) != 0
+      || file->size < sizeof(Dol_Hdr) || file->size > SIZE_MAX
+      || !(file->buffer = malloc(file->size))
+      || decode(source.format, file->mapping.data, source.size, file->buffer,
+        file->size) != 0) {
+      fprintf(error_file(), "Could not decode %s input %s\n",
+        decode_name(source.format), filename);
+      goto err;
+    }
+    memcpy(&file->dhdr, file->buffer, sizeof(Dol_Hdr));
+    file->data = file->buffer;
+  }
+  if (dol_extent(&file->dhdr) > file->size) {
+    fprintf(error_file(), "Invalid DOL file %s\n", filename);
+    goto err;
+  }
+  close(fd);
+  return 0;
+
+err:
+  dol_release(file);
+  close(fd);
+  return -1;
+}
+
+void dol_release(struct dol_file *file)
+{
+  free(file->buffer);
+  file->buffer = NULL;
+  dol_unmap(&file->mapping);
+}
+
+int write_file(const char *filename, const void *data, size_t size)
+{
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    return -1;
+  }
+  if (pwrite_all(fd, data, size, 0) != 0 || close(fd) != 0) {
+    fprintf(stderr, "Could not write %s\n", filename);
+    unlink(filename);
+    return -1;
+  }
+  return 0;
+}
+
+int aside_open(struct aside_file *file, const char *filename)
+{
+  file->fd = -1;
+  if ((size_t) snprintf(file->path, sizeof(file->path), "%s.XXXXXX", filename)
+    >= sizeof(file->path))
+    return -1;
+  file->fd = mkostemp(file->path, O_CLOEXEC);
+  return file->fd >= 0 ? 0 : -1;
+}
+
+int aside_commit(struct aside_file *file, const char *filename, mode_t mode)
+{
+  int res = fchmod(file->fd, mode);
+  if (close(file->fd) != 0)
+    res = -1;
+  file->fd = -1;
+  if (res == 0 && rename(file->path, filename) == 0)
+    return 0;
+  unlink(file->path);
+  return -1;
+}
+
+void aside_abort(struct aside_file *file)
+{
+  if (file->fd < 0)
+    return;
+  close(file->fd);
+  file->fd = -1;
+  unlink(file->path);
+}
+
+// The ELF file of a DOL held in memory (never a REL module), converted as
+// from any input file:
+int write_dol_elf(const char *filename, const unsigned char *data, size_t size,
+  const struct dol2elf_options *options)
+{
+  int dol_fd = memfd_create("dol", MFD_CLOEXEC);
+  if (dol_fd < 0 || pwrite_all(dol_fd, data, size, 0) != 0) {
+    fprintf(stderr, "Could not write the DOL of %s\n", filename);
+    if (dol_fd >= 0)
+      close(dol_fd);
+    return -1;
+  }
+  int elf_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (elf_fd < 0) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    close(dol_fd);
+    return -1;
+  }
+  int res = dol2elf_fd(dol_fd, elf_fd, filename, options, NULL);
+  if (close(elf_fd) != 0 && res == 0) {
+    fprintf(stderr, "Could not write %s\n", filename);
+    res = 1;
+  }
+  if (res != 0)
+    unlink(filename);
+  close(dol_fd);
+  return res ? -1 : 0;
+}
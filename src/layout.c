@@ -0,0 +1,165 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "doltool.h"
+
+#define DEFAULT_ALIGN 4096
+
+static int layout_verbatim(const Dol_Hdr *dhdr, uint64_t dol_size, struct Elf *elf)
+{
+  if (elf->dol_offset + dol_size > UINT32_MAX)
+    return -1;
+
+  // The whole DOL file follows the ELF data:
+  for (int i=0; i != DOL_TEXT_COUNT; ++i)
+    elf->text_offset[i] = ntohl(dhdr->text_offset[i]) + elf->dol_offset;
+  for (int i=0; i != DOL_DATA_COUNT; ++i)
+    elf->data_offset[i] = ntohl(dhdr->data_offset[i]) + elf->dol_offset;
+
+  elf->bss_offset = 0;
+  elf->align = 0;
+  elf->extents[0].offset = elf->dol_offset;
+  elf->extents[0].src_offset = 0;
+  elf->extents[0].size = dol_size;
+  elf->extent_count = 1;
+  elf->size = elf->dol_offset + dol_size;
+  return 0;
+}
+
+// Smallest offset not before the given one which is congruent with the
+// address modulo the page size:
+static uint64_t congruent_offset(uint64_t offset, uint32_t address, uint32_t align)
+{
+  return offset + ((address - offset) & (align - 1));
+}
+
+static int layout_segment(uint32_t src_offset, uint32_t address, uint32_t size,
+  uint64_t dol_size, uint32_t *offset, struct Elf *elf)
+{
+  if ((uint64_t) src_offset + size > dol_size)
+    return -1;
+  uint64_t start = congruent_offset(elf->size, address, elf->align);
+  if (start + size > UINT32_MAX)
+    return -1;
+  struct elf_extent *extent = elf->extents + elf->extent_count++;
+  extent->offset = start;
+  extent->src_offset = src_offset;
+  extent->size = size;
+  *offset = start;
+  elf->size = start + size;
+  return 0;
+}
+
+static int layout_compact(const Dol_Hdr *dhdr, uint64_t dol_size,
+  uint32_t align, struct Elf *elf)
+{
+  if (dol_size < sizeof(Dol_Hdr))
+    return -1;
+
+  // Only the DOL header follows the ELF data:
+  elf->align = align;
+  elf->extents[0].offset = elf->dol_offset;
+  elf->extents[0].src_offset = 0;
+  elf->extents[0].size = sizeof(Dol_Hdr);
+  elf->extent_count = 1;
+  elf->size = elf->dol_offset + sizeof(Dol_Hdr);
+
+  // Each segment is then mappable on its own:
+  memset(elf->text_offset, 0, sizeof(elf->text_offset));
+  memset(elf->data_offset, 0, sizeof(elf->data_offset));
+  for (int i=0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i]
+      && layout_segment(ntohl(dhdr->text_offset[i]), ntohl(dhdr->text_address[i]),
+        ntohl(dhdr->text_size[i]), dol_size, elf->text_offset + i, elf) != 0)
+      return -1;
+  for (int i=0; i != DOL_DATA_COUNT; ++i)
+    if (dhdr->data_size[i]
+      && layout_segment(ntohl(dhdr->data_offset[i]), ntohl(dhdr->data_address[i]),
+        ntohl(dhdr->data_size[i]), dol_size, elf->data_offset + i, elf) != 0)
+      return -1;
+
+  // Keep the .bss congruent as well even if it has no file data:
+  elf->bss_offset = congruent_offset(elf->size, ntohl(dhdr->bss_address), align);
+  return 0;
+}
+
+static int layout_blob(const struct compressed *blob, uint32_t *offset,
+  struct Elf *elf)
+{
+  // Elf32_Chdr is made of 32-bit words:
+  uint64_t start = (elf->size + 3) & ~(uint64_t) 3;
+  if (start + blob->size > UINT32_MAX)
+    return -1;
+  struct elf_extent *extent = elf->extents + elf->extent_count++;
+  extent->offset = start;
+  extent->src_offset = 0;
+  extent->size = blob->size;
+  extent->data = blob->data;
+  *offset = start;
+  elf->size = start + blob->size;
+  return 0;
+}
+
+static int layout_compressed(const Dol_Hdr *dhdr, uint64_t dol_size, struct Elf *elf)
+{
+  if (dol_size < sizeof(Dol_Hdr))
+    return -1;
+
+  // The DOL header, then the compressed sections:
+  elf->align = 0;
+  elf->extents[0].offset = elf->dol_offset;
+  elf->extents[0].src_offset = 0;
+  elf->extents[0].size = sizeof(Dol_Hdr);
+  elf->extent_count = 1;
+  elf->size = elf->dol_offset + sizeof(Dol_Hdr);
+
+  memset(elf->text_offset, 0, sizeof(elf->text_offset));
+  memset(elf->data_offset, 0, sizeof(elf->data_offset));
+  for (int i=0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i]
+      && layout_blob(elf->text_compressed + i, elf->text_offset + i, elf) != 0)
+      return -1;
+  for (int i=0; i != DOL_DATA_COUNT; ++i)
+    if (dhdr->data_size[i]
+      && layout_blob(elf->data_compressed + i, elf->data_offset + i, elf) != 0)
+      return -1;
+  elf->bss_offset = 0;
+  return 0;
+}
+
+int elf_layout(const Dol_Hdr *dhdr, uint64_t dol_size,
+  const struct dol2elf_options *options, struct Elf *elf)
+{
+  if (elf->compressed)
+    return layout_compressed(dhdr, dol_size, elf);
+  if (!options || !(options->flags & DOL2ELF_COMPACT))
+    return layout_verbatim(dhdr, dol_size, elf);
+
+  uint32_t align = options->align ? options->align : DEFAULT_ALIGN;
+  if (align & (align - 1))
+    return -1;
+  return layout_compact(dhdr, dol_size, align, elf);
+}
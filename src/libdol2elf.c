@@ -0,0 +1,173 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "doltool.h"
+#include "libdol2elf.h"
+
+const char *dol2elf_strerror(int error)
+{
+  switch (error) {
+  case DOL2ELF_OK:
+    return "Success";
+  case DOL2ELF_EINVAL:
+    return "Invalid DOL image";
+  case DOL2ELF_ENOSPC:
+    return "Output buffer too small";
+  case DOL2ELF_ENOMEM:
+    return "Out of memory";
+  default:
+    return "Unknown error";
+  }
+}
+
+static int load(const void *dol, size_t dol_size,
+  const struct dol2elf_options *options, struct Elf *elf)
+{
+  FILE *diag = options ? options->diag : NULL;
+  if (dol_size < sizeof(Dol_Hdr)) {
+    if (diag)
+      fputs("Could not read DOL header\n", diag);
+    return DOL2ELF_EINVAL;
+  }
+
+  // The DOL image may not be aligned:
+  Dol_Hdr dhdr;
+  memcpy(&dhdr, dol, sizeof(Dol_Hdr));
+  if (diag)
+    dol_dump(&dhdr, diag);
+
+  // The segments are read from the image:
+  if (dol_extent(&dhdr) > dol_size) {
+    if (diag)
+      fputs("Truncated DOL image\n", diag);
+    return DOL2ELF_EINVAL;
+  }
+  if (elf_prepare(&dhdr, dol, dol_size, options, elf) != 0) {
+    elf_free(elf);
+    if (diag)
+      fputs("Invalid DOL image\n", diag);
+    return DOL2ELF_EINVAL;
+  }
+  return DOL2ELF_OK;
+}
+
+int dol2elf_size(const void *dol, size_t dol_size,
+  const struct dol2elf_options *options, size_t *elf_size)
+{
+  struct Elf elf;
+  int res = load(dol, dol_size, options, &elf);
+  if (res != DOL2ELF_OK)
+    return res;
+  *elf_size = elf.size;
+  elf_free(&elf);
+  return DOL2ELF_OK;
+}
+
+int dol2elf_headers_size(const void *dol, size_t dol_size,
+  const struct dol2elf_options *options, size_t *headers_size)
+{
+  struct Elf elf;
+  int res = load(dol, dol_size, options, &elf);
+  if (res != DOL2ELF_OK)
+    return res;
+  *headers_size = elf.dol_offset;
+  elf_free(&elf);
+  return DOL2ELF_OK;
+}
+
+static size_t gather_headers(struct Elf *elf, char *buffer)
+{
+  struct iovec iov[ELF_HEADERS_IOV_MAX];
+  int count = elf_headers_iov(elf, iov);
+  size_t offset = 0;
+  for (int i = 0; i != count; ++i) {
+    memcpy(buffer + offset, iov[i].iov_base, iov[i].iov_len);
+    offset += iov[i].iov_len;
+  }
+  return offset;
+}
+
+int dol2elf_convert(const void *dol, size_t dol_size,
+  void *elf_data, size_t elf_size, const struct dol2elf_options *options)
+{
+  struct Elf elf;
+  int res = load(dol, dol_size, options, &elf);
+  if (res != DOL2ELF_OK)
+    return res;
+  if (elf_size < elf.size) {
+    res = DOL2ELF_ENOSPC;
+  } else {
+    char *output = elf_data;
+    size_t offset = gather_headers(&elf, output);
+    for (size_t i = 0; i != elf.extent_count; ++i) {
+      const struct elf_extent *extent = elf.extents + i;
+      memset(output + offset, 0, extent->offset - offset);
+      memcpy(output + extent->offset,
+        extent->data ? extent->data : (const char*) dol + extent->src_offset,
+        extent->size);
+      offset = extent->offset + extent->size;
+    }
+  }
+  elf_free(&elf);
+  return res;
+}
+
+int dol2elf_convert_chunks(const void *dol, size_t dol_size,
+  void *headers, size_t headers_size,
+  struct dol2elf_chunk *chunks, size_t *chunk_count,
+  const struct dol2elf_options *options)
+{
+  // The compressed sections and found symbols would not outlive this call:
+  if (options && (options->flags & DOL2ELF_NEEDS_DATA))
+    return DOL2ELF_EINVAL;
+
+  struct Elf elf;
+  int res = load(dol, dol_size, options, &elf);
+  if (res != DOL2ELF_OK)
+    return res;
+  if (headers_size < elf.dol_offset || *chunk_count < 1 + 2 * elf.extent_count) {
+    res = DOL2ELF_ENOSPC;
+  } else {
+    size_t count = 0;
+    chunks[count].data = headers;
+    chunks[count].size = gather_headers(&elf, headers);
+    size_t offset = chunks[count++].size;
+    for (size_t i = 0; i != elf.extent_count; ++i) {
+      const struct elf_extent *extent = elf.extents + i;
+      if (extent->offset != offset) {
+        chunks[count].data = NULL;
+        chunks[count++].size = extent->offset - offset;
+      }
+      chunks[count].data = (const char*) dol + extent->src_offset;
+      chunks[count++].size = extent->size;
+      offset = extent->offset + extent->size;
+    }
+    *chunk_count = count;
+  }
+  elf_free(&elf);
+  return res;
+}
@@ -0,0 +1,111 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef DOLTOOL_LIBDOL2ELF_H
+#define DOLTOOL_LIBDOL2ELF_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Error codes:
+#define DOL2ELF_OK        0
+#define DOL2ELF_EINVAL   -1 // Truncated or invalid DOL image
+#define DOL2ELF_ENOSPC   -2 // Output buffer or chunk list too small
+#define DOL2ELF_ENOMEM   -3
+
+// Flags:
+#define DOL2ELF_MERGE_STRINGS 1 // Share the tails of symbol names in .strtab
+#define DOL2ELF_COMPACT       2 // Only copy the segments, at aligned offsets
+#define DOL2ELF_COMPRESS_ZLIB 4 // SHF_COMPRESSED sections, no program headers
+#define DOL2ELF_COMPRESS_ZSTD 8
+#define DOL2ELF_FIND_FUNCTIONS 16 // Add the functions found in the text to .symtab
+#define DOL2ELF_INCREMENTAL   64 // Record the segment hashes in a .note section
+
+struct dol2elf_symbols;
+
+struct dol2elf_options {
+  // When set, the DOL header and errors are reported there.
+  // Nothing is ever written to stderr otherwise.
+  FILE *diag;
+  unsigned flags;
+  // When set, a .symtab is generated from these symbols:
+  const struct dol2elf_symbols *symbols;
+  // Page size for DOL2ELF_COMPACT (power of two, default 4096):
+  unsigned align;
+  // Compression level (0 for the default):
+  int compress_level;
+  // Number of threads compressing or analysing the segments of a file
+  // (0 for one per CPU):
+  unsigned threads;
+};
+
+// A piece of the ELF image. A NULL data pointer stands for size zero bytes.
+struct dol2elf_chunk {
+  const void *data;
+  size_t size;
+};
+
+// Upper bound on the number of chunks used by dol2elf_convert_chunks():
+#define DOL2ELF_MAX_CHUNKS 64
+
+const char *dol2elf_strerror(int error);
+
+// Symbol maps: "address name" or "address size name" lines, or CodeWarrior
+// .map files. A symbol table can be shared by concurrent conversions.
+struct dol2elf_symbols *dol2elf_symbols_parse(const char *text, size_t size);
+struct dol2elf_symbols *dol2elf_symbols_load(const char *filename, FILE *diag);
+size_t dol2elf_symbols_count(const struct dol2elf_symbols *symbols);
+void dol2elf_symbols_free(struct dol2elf_symbols *symbols);
+
+// Size of the ELF image generated from a DOL image:
+int dol2elf_size(const void *dol, size_t dol_size,
+  const struct dol2elf_options *options, size_t *elf_size);
+
+// Write the ELF image into a caller provided buffer of at least
+// dol2elf_size() bytes:
+int dol2elf_convert(const void *dol, size_t dol_size,
+  void *elf, size_t elf_size, const struct dol2elf_options *options);
+
+// Size of the ELF headers generated for a DOL image:
+int dol2elf_headers_size(const void *dol, size_t dol_size,
+  const struct dol2elf_options *options, size_t *headers_size);
+
+// Describe the ELF image as a list of chunks without copying the payload:
+// the ELF headers are written in the caller provided headers buffer and the
+// other chunks point into the DOL image which must outlive them.
+// *chunk_count is the capacity of chunks on input and the number of used
+// chunks on output. Compressed conversions are not supported.
+int dol2elf_convert_chunks(const void *dol, size_t dol_size,
+  void *headers, size_t headers_size,
+  struct dol2elf_chunk *chunks, size_t *chunk_count,
+  const struct dol2elf_options *options);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
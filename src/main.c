@@ -0,0 +1,534 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "doltool.h"
+
+static uint64_t parse_size(const char *text)
+{
+  char *end;
+  uint64_t size = strtoull(text, &end, 10);
+  switch (*end) {
+  case 'G': case 'g':
+    size *= 1024;
+    /* fall through */
+  case 'M': case 'm':
+    size *= 1024;
+    /* fall through */
+  case 'K': case 'k':
+    size *= 1024;
+  }
+  return size;
+}
+
+static void usage(FILE *file)
+{
+  fputs(
+    "Usage: dol2elf foo.dol foo.elf (- for stdin/stdout)\n"
+    "       dol2elf [-j N] [-v] foo.dol foo.elf bar.dol bar.elf...\n"
+    "       dol2elf [-j N] [-v] -m manifest\n"
+    "       dol2elf [-j N] [-v] images/ elfs/\n"
+    "       dol2elf [-j N] --server SOCKET\n"
+    "       dol2elf [-j N] --scan DIR [OUTDIR]\n"
+    "       dol2elf [-j N] --watch foo.dol foo.elf... (or images/ elfs/)\n"
+    "       dol2elf [-j N] --verify foo.dol foo.elf... (or images/ elfs/)\n"
+    "       dol2elf --delta-create DELTA old.dol new.dol\n"
+    "       dol2elf --delta-apply DELTA old.dol new.dol (or new.elf)\n"
+    "       dol2elf [-j N] --store-add STORE foo.dol bar.iso...\n"
+    "       dol2elf --store-get STORE NAME foo.dol (or foo.elf)\n"
+    "       dol2elf --index-build INDEX foo.dol bar.iso...\n"
+    "       dol2elf --index-query INDEX [ADDRESS...]\n"
+    "\n"
+    "  -j, --jobs N           number of worker threads for batch conversion\n"
+    "  -m, --manifest FILE    read \"foo.dol foo.elf\" lines from FILE (- for stdin)\n"
+    "  -s, --symbols FILE     generate a .symtab from a symbol map\n"
+    "                         (\"address name\" lines or CodeWarrior .map)\n"
+    "      --merge-strings    share the tails of symbol names in .strtab\n"
+    "  -c, --compact          only copy the DOL segments, at page aligned offsets\n"
+    "      --align N          page size for --compact (default 4096)\n"
+    "      --incremental      record segment hashes in the ELF file and only\n"
+    "                         patch the segments that changed next time\n"
+    "      --rel-base ADDR    apply the relocations of REL modules for this\n"
+    "                         load address (default: .rela sections)\n"
+    "      --compress ALGO    compress the segments (zlib or zstd), the ELF file\n"
+    "                         has sections but no program headers\n"
+    "      --compress-level N compression level\n"
+    "      --find-functions   add the functions found in the text segments\n"
+    "                         to .symtab\n"
+    "      --threads N        threads compressing or analysing the segments of\n"
+    "                         a file (default: one per CPU, 1 in batch mode)\n"
+    "      --image FILE       also write a flat memory image of the segments,\n"
+    "                         sparse: gaps, bss and zero blocks are holes\n"
+    "      --image-base ADDR  address of the start of the image (default: the\n"
+    "                         lowest segment)\n"
+    "      --image-size N     size of the image (K, M and G suffixes allowed)\n"
+    "      --map FILE         also write the segment map (JSON for .json files)\n"
+    "      --uring DEPTH      copy through io_uring with DEPTH registered 1 MiB\n"
+    "                         buffers, shared by all the files (default: off)\n"
+    "      --cache DIR        reuse the ELF files of unchanged inputs from DIR\n"
+    "      --cache-size N     evict least recently used entries above N bytes\n"
+    "                         (K, M and G suffixes allowed)\n"
+    "      --cache-stats      print the cache hits and misses\n"
+    "      --stats            print the time spent in each phase and I/O counters\n"
+    "      --trace FILE       write per-file phase timings to FILE\n"
+    "      --trace-format F   jsonl (default) or chrome (trace event format)\n"
+    "      --server SOCKET    serve conversion requests on a Unix socket\n"
+    "      --connect SOCKET   forward the conversions to a server\n"
+    "                         (default: $DOL2ELF_SOCKET)\n"
+    "      --watch            convert the inputs again whenever they change\n"
+    "      --debounce MS      wait for MS milliseconds without events before\n"
+    "                         converting a changed input (default 5)\n"
+    "      --verify           check that the ELF files hold the segments and the\n"
+    "                         entry point of their DOL instead of converting\n"
+    "      --scan DIR         list the DOL files found in DIR by their header,\n"
+    "                         or convert them into OUTDIR\n"
+    "      --delta-create DELTA\n"
+    "                         write the changes from old.dol to new.dol\n"
+    "      --delta-apply DELTA\n"
+    "                         rebuild new.dol from old.dol, or convert it\n"
+    "      --store-add STORE  store the segments of the input files once in\n"
+    "                         STORE, with a manifest per file\n"
+    "      --store-get STORE  rebuild a stored DOL file, or its ELF file\n"
+    "      --index-build INDEX\n"
+    "                         index the segments of the input files\n"
+    "      --index-query INDEX\n"
+    "                         find the files and segments containing the\n"
+    "                         addresses (read from stdin without arguments)\n"
+    "  -v, --verbose          dump the DOL headers in batch mode\n",
+    file);
+}
+
+static int is_directory(const char *filename)
+{
+  struct stat st;
+  return stat(filename, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+enum { RUN_CONVERT, RUN_WATCH, RUN_VERIFY };
+
+static int run_batch(const struct converter *converter, const char *manifest,
+  int argc, char **argv, long threads, int mode, long debounce_ms)
+{
+  if (argc % 2 != 0 || (!manifest && argc == 0)) {
+    fprintf(stderr, "Bad usage: dol2elf foo.dol foo.elf\n");
+    usage(stderr);
+    return 1;
+  }
+
+  int res = 1;
+  struct batch_job *jobs = NULL;
+  size_t count = 0;
+  const char **dirs = calloc(argc / 2 + 1, sizeof(const char*));
+  const char **outputs = calloc(argc / 2 + 1, sizeof(const char*));
+  size_t dir_count = 0;
+  if (!dirs || !outputs) {
+    fputs("Could not allocate memory\n", stderr);
+    goto out;
+  }
+  if (manifest && batch_load_manifest(manifest, &jobs, &count) != 0)
+    goto out;
+  for (int i = 0; i != argc; i += 2) {
+    if (is_directory(argv[i])) {
+      // Verification reads the output directory, it does not create it:
+      if (batch_scan_directory(argv[i], argv[i + 1], mode != RUN_VERIFY,
+          &jobs, &count) != 0)
+        goto out;
+      dirs[dir_count] = argv[i];
+      outputs[dir_count++] = argv[i + 1];
+      continue;
+    }
+    struct batch_job *grown = realloc(jobs, (count + 1) * sizeof(struct batch_job));
+    if (!grown) {
+      fputs("Could not allocate memory\n", stderr);
+      goto out;
+    }
+    jobs = grown;
+    struct batch_job *job = jobs + count++;
+    memset(job, 0, sizeof(struct batch_job));
+    job->dol_filename = argv[i];
+    job->elf_filename = argv[i + 1];
+  }
+
+  if (mode == RUN_VERIFY)
+    res = batch_verify(jobs, count, threads, converter->options->threads);
+  else if (mode == RUN_WATCH)
+    res = watch_run(jobs, count, dirs, outputs, dir_count, threads, debounce_ms,
+      converter);
+  else
+    res = batch_run(jobs, count, threads, converter);
+
+out:
+  free(jobs);
+  free(dirs);
+  free(outputs);
+  return res;
+}
+
+int main(int argc, char **argv)
+{
+  static const struct option options[] = {
+    { "jobs",     required_argument, NULL, 'j' },
+    { "manifest", required_argument, NULL, 'm' },
+    { "symbols",  required_argument, NULL, 's' },
+    { "merge-strings", no_argument,  NULL, 'M' },
+    { "compact",  no_argument,       NULL, 'c' },
+    { "align",    required_argument, NULL, 'A' },
+    { "incremental", no_argument,    NULL, 'N' },
+    { "rel-base", required_argument, NULL, 'J' },
+    { "compress", required_argument, NULL, 'Z' },
+    { "compress-level", required_argument, NULL, 'L' },
+    { "find-functions", no_argument, NULL, 'U' },
+    { "threads",  required_argument, NULL, 'W' },
+    { "image",    required_argument, NULL, 'G' },
+    { "image-base", required_argument, NULL, 'B' },
+    { "image-size", required_argument, NULL, 'H' },
+    { "map",      required_argument, NULL, 'K' },
+    { "uring",    required_argument, NULL, 'O' },
+    { "cache",    required_argument, NULL, 'C' },
+    { "cache-size", required_argument, NULL, 'S' },
+    { "cache-stats", no_argument,    NULL, 'T' },
+    { "stats",    no_argument,       NULL, 'P' },
+    { "trace",    required_argument, NULL, 'R' },
+    { "trace-format", required_argument, NULL, 'F' },
+    { "server",   required_argument, NULL, 'D' },
+    { "connect",  required_argument, NULL, 'E' },
+    { "watch",    no_argument,       NULL, 'w' },
+    { "debounce", required_argument, NULL, 'b' },
+    { "verify",   no_argument,       NULL, 'V' },
+    { "scan",     required_argument, NULL, 'X' },
+    { "delta-create", required_argument, NULL, 'Y' },
+    { "delta-apply", required_argument, NULL, 'y' },
+    { "store-add", required_argument, NULL, 'k' },
+    { "store-get", required_argument, NULL, 'g' },
+    { "index-build", required_argument, NULL, 'I' },
+    { "index-query", required_argument, NULL, 'Q' },
+    { "verbose",  no_argument,       NULL, 'v' },
+    { "help",     no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  long segment_threads = -1;
+  long uring_depth = 0;
+  int watch = 0;
+  int verify = 0;
+  long debounce_ms = 5;
+  struct memory_image image;
+  memset(&image, 0, sizeof(image));
+  const char *map = NULL;
+  const char *manifest = NULL;
+  const char *symbols = NULL;
+  struct dol2elf_options conversion;
+  memset(&conversion, 0, sizeof(conversion));
+  // REL modules are relocated with --rel-base:
+  struct rel_options rel = { 0 }, *relocation = NULL;
+  const char *cache_dir = NULL;
+  uint64_t cache_size = 0;
+  int cache_stats = 0;
+  int print_stats = 0;
+  const char *trace = NULL;
+  int trace_format = STATS_TRACE_JSONL;
+  const char *server = NULL;
+  const char *scan = NULL;
+  const char *delta_create_filename = NULL;
+  const char *delta_apply_filename = NULL;
+  const char *store_add_dir = NULL;
+  const char *store_get_dir = NULL;
+  const char *index_build_filename = NULL;
+  const char *index_query_filename = NULL;
+  const char *connect_socket = getenv("DOL2ELF_SOCKET");
+  int verbose = 0;
+  int batch = 0;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "j:m:s:cvh", options, NULL)) != -1) {
+    switch (opt) {
+    case 'j':
+      threads = strtol(optarg, NULL, 10);
+      batch = 1;
+      break;
+    case 'm':
+      manifest = optarg;
+      batch = 1;
+      break;
+    case 's':
+      symbols = optarg;
+      break;
+    case 'M':
+      conversion.flags |= DOL2ELF_MERGE_STRINGS;
+      break;
+    case 'c':
+      conversion.flags |= DOL2ELF_COMPACT;
+      break;
+    case 'A':
+      conversion.align = strtoul(optarg, NULL, 0);
+      if (conversion.align == 0 || (conversion.align & (conversion.align - 1))) {
+        fprintf(stderr, "Bad alignment: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'N':
+      conversion.flags |= DOL2ELF_INCREMENTAL;
+      break;
+    case 'J':
+      rel.base = strtoul(optarg, NULL, 0);
+      relocation = &rel;
+      break;
+    case 'Z':
+      conversion.flags &= ~DOL2ELF_COMPRESS;
+      if (strcmp(optarg, "zlib") == 0) {
+        conversion.flags |= DOL2ELF_COMPRESS_ZLIB;
+      } else if (strcmp(optarg, "zstd") == 0) {
+        conversion.flags |= DOL2ELF_COMPRESS_ZSTD;
+      } else {
+        fprintf(stderr, "Unknown compression: %s\n", optarg);
+        return 1;
+      }
+      if (!compress_supported(conversion.flags)) {
+        fprintf(stderr, "Compression not supported in this build: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'U':
+      conversion.flags |= DOL2ELF_FIND_FUNCTIONS;
+      break;
+    case 'L':
+      conversion.compress_level = strtol(optarg, NULL, 10);
+      break;
+    case 'W':
+      segment_threads = strtol(optarg, NULL, 10);
+      break;
+    case 'G':
+      image.filename = optarg;
+      break;
+    case 'B':
+      image.base = strtoul(optarg, NULL, 0);
+      image.has_base = 1;
+      break;
+    case 'H':
+      image.size = parse_size(optarg);
+      break;
+    case 'K':
+      map = optarg;
+      break;
+    case 'O':
+      uring_depth = strtol(optarg, NULL, 10);
+      break;
+    case 'C':
+      cache_dir = optarg;
+      break;
+    case 'S':
+      cache_size = parse_size(optarg);
+      break;
+    case 'T':
+      cache_stats = 1;
+      break;
+    case 'P':
+      print_stats = 1;
+      break;
+    case 'R':
+      trace = optarg;
+      break;
+    case 'F':
+      if (strcmp(optarg, "chrome") == 0) {
+        trace_format = STATS_TRACE_CHROME;
+      } else if (strcmp(optarg, "jsonl") == 0) {
+        trace_format = STATS_TRACE_JSONL;
+      } else {
+        fprintf(stderr, "Unknown trace format: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'D':
+      server = optarg;
+      break;
+    case 'E':
+      connect_socket = optarg;
+      break;
+    case 'w':
+      watch = 1;
+      break;
+    case 'b':
+      debounce_ms = strtol(optarg, NULL, 10);
+      break;
+    case 'V':
+      verify = 1;
+      break;
+    case 'X':
+      scan = optarg;
+      break;
+    case 'Y':
+      delta_create_filename = optarg;
+      break;
+    case 'y':
+      delta_apply_filename = optarg;
+      break;
+    case 'k':
+      store_add_dir = optarg;
+      break;
+    case 'g':
+      store_get_dir = optarg;
+      break;
+    case 'I':
+      index_build_filename = optarg;
+      break;
+    case 'Q':
+      index_query_filename = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'h':
+      usage(stdout);
+      return 0;
+    default:
+      usage(stderr);
+      return 1;
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  // Creating deltas, stores and indexes does not convert anything:
+  if ((delta_create_filename || delta_apply_filename || store_get_dir) && argc != 2) {
+    usage(stderr);
+    return 1;
+  }
+  if (delta_create_filename)
+    return delta_create(delta_create_filename, argv[0], argv[1]);
+  if (store_add_dir)
+    return store_add(store_add_dir, argv, argc, threads, &conversion);
+  if (index_build_filename)
+    return index_build(index_build_filename, argv, argc);
+  if (index_query_filename)
+    return index_query(index_query_filename, argv, argc);
+  // Neither does the verification, its files are compared in place:
+  if (verify) {
+    conversion.threads = segment_threads >= 0 ? segment_threads : 0;
+    struct converter converter = { &conversion, NULL, NULL, NULL, NULL };
+    return run_batch(&converter, manifest, argc, argv, threads, RUN_VERIFY, 0);
+  }
+
+  // Requests only carry conversion options, the symbols of a server would
+  // end up in the ELF files of all its clients:
+  if (server && symbols) {
+    fputs("--symbols cannot be used with --server\n", stderr);
+    return 1;
+  }
+  if (symbols) {
+    struct dol2elf_symbols *table = dol2elf_symbols_load(symbols, stderr);
+    if (!table)
+      return 1;
+    conversion.symbols = table;
+  }
+
+  // The options apply to the conversion of the rebuilt DOL (the ones of
+  // the manifest for a stored one):
+  if (delta_apply_filename)
+    return delta_apply(delta_apply_filename, argv[0], argv[1], &conversion);
+  if (store_get_dir)
+    return store_get(store_get_dir, argv[0], argv[1], &conversion);
+
+  // Kernels without io_uring keep the synchronous I/O:
+  struct uring ring;
+  if (uring_depth > 0 && uring_open(&ring, uring_depth) == 0)
+    io_ring = &ring;
+  struct cache cache;
+  struct stats stats;
+  struct converter converter = { &conversion, relocation, NULL, NULL, NULL };
+  if (cache_dir) {
+    if (cache_open(&cache, cache_dir, cache_size) != 0)
+      return 1;
+    converter.cache = &cache;
+  }
+  if (print_stats || trace) {
+    if (stats_open(&stats, trace, trace_format) != 0)
+      return 1;
+    converter.stats = &stats;
+  }
+
+  // Symbol maps are only known locally:
+  if (connect_socket && *connect_socket && !conversion.symbols)
+    converter.server = connect_socket;
+
+  // Files are already converted in parallel:
+  if (segment_threads >= 0)
+    conversion.threads = segment_threads;
+  else if (batch || server || scan || watch || argc > 2)
+    conversion.threads = 1;
+
+  int res;
+  if (server) {
+    res = server_run(server, threads, &converter);
+  } else if (scan) {
+    if (argc > 1) {
+      usage(stderr);
+      return 1;
+    }
+    if (verbose)
+      conversion.diag = stderr;
+    res = scan_run(scan, argc ? argv[0] : NULL, threads, &converter);
+  } else if (watch) {
+    if (verbose)
+      conversion.diag = stderr;
+    res = run_batch(&converter, manifest, argc, argv, threads, RUN_WATCH,
+      debounce_ms > 0 ? debounce_ms : 1);
+  } else if (image.filename || map) {
+    // The outputs are written in place from a single read of the input:
+    if (batch || manifest || argc != 2 || strcmp(argv[0], "-") == 0
+      || strcmp(argv[1], "-") == 0) {
+      fprintf(stderr, "--image and --map need a single DOL file and ELF file\n");
+      return 1;
+    }
+    conversion.diag = stderr;
+    res = dol2elf_fanout(argv[0], argv[1], image.filename ? &image : NULL, map,
+      &conversion);
+  } else if (!batch && !manifest && argc == 2 && !is_directory(argv[0])) {
+    conversion.diag = stderr;
+    res = convert_file(&converter, argv[0], argv[1]);
+  } else {
+    if (verbose)
+      conversion.diag = stderr;
+    res = run_batch(&converter, manifest, argc, argv, threads, RUN_CONVERT, 0);
+  }
+
+  if (converter.cache) {
+    cache_close(&cache);
+    if (cache_stats)
+      cache_print_stats(&cache, stderr);
+  }
+  if (converter.stats) {
+    if (print_stats)
+      stats_print(&stats, stderr);
+    stats_close(&stats);
+  }
+  if (io_ring)
+    uring_close(io_ring);
+  return res;
+}
@@ -29,45 +29,43 @@ THE SOFTWARE.
 
 #include "doltool.h"
 
-#define ALIGN 0
-
 static void init_load_text_phdr(const Dol_Hdr *dhdr, int i, Elf32_Phdr *phdr, struct Elf *elf)
 {
   phdr->p_type    = htonl(PT_LOAD);
-  phdr->p_offset  = htonl( ntohl(dhdr->text_offset[i]) + elf->dol_offset );
+  phdr->p_offset  = htonl(elf->text_offset[i]);
   phdr->p_vaddr   = dhdr->text_address[i];
   phdr->p_paddr   = dhdr->text_address[i];
   phdr->p_filesz  = dhdr->text_size[i];
   phdr->p_memsz   = dhdr->text_size[i];
   phdr->p_flags   = htonl(PF_X | PF_R);
-  phdr->p_align   = htonl(ALIGN);
+  phdr->p_align   = htonl(elf->align);
 }
 
 static void init_load_data_phdr(const Dol_Hdr *dhdr, int i, Elf32_Phdr *phdr, struct Elf *elf)
 {
   phdr->p_type    = htonl(PT_LOAD);
-  phdr->p_offset  = htonl( ntohl(dhdr->data_offset[i]) + elf->dol_offset );
+  phdr->p_offset  = htonl(elf->data_offset[i]);
   phdr->p_vaddr   = dhdr->data_address[i];
   phdr->p_paddr   = dhdr->data_address[i];
   phdr->p_filesz  = dhdr->data_size[i];
   phdr->p_memsz   = dhdr->data_size[i];
   phdr->p_flags   = htonl(PF_R | PF_W);
-  phdr->p_align   = htonl(ALIGN);
+  phdr->p_align   = htonl(elf->align);
 }
 
 static void init_load_bss_phdr(const Dol_Hdr *dhdr, Elf32_Phdr *phdr, struct Elf *elf)
 {
   phdr->p_type    = htonl(PT_LOAD);
-  phdr->p_offset  = 0;
+  phdr->p_offset  = htonl(elf->bss_offset);
   phdr->p_vaddr   = dhdr->bss_address;
   phdr->p_paddr   = dhdr->bss_address;
   phdr->p_filesz  = 0;
   phdr->p_memsz   = dhdr->bss_size;
   phdr->p_flags   = htonl(PF_R | PF_W);
-  phdr->p_align   = htonl(ALIGN);
+  phdr->p_align   = htonl(elf->align);
 }
 
-void create_phdrs(Dol_Hdr *dhdr, struct Elf *elf)
+void create_phdrs(const Dol_Hdr *dhdr, struct Elf *elf)
 {
   elf->phdrs = malloc(sizeof(Elf32_Phdr) * elf->phnum);
 
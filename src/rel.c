@@ -0,0 +1,710 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <elf.h>
+#include <arpa/inet.h>
+
+#include "doltool.h"
+
+// REL module header (version 1, 2 and 3):
+typedef struct {
+  uint32_t id;
+  uint32_t next;
+  uint32_t prev;
+  uint32_t section_count;
+  uint32_t section_offset;
+  uint32_t name_offset;
+  uint32_t name_size;
+  uint32_t version;
+  uint32_t bss_size;
+  uint32_t rel_offset;
+  uint32_t imp_offset;
+  uint32_t imp_size;
+  uint8_t prolog_section;
+  uint8_t epilog_section;
+  uint8_t unresolved_section;
+  uint8_t bss_section;
+  uint32_t prolog;
+  uint32_t epilog;
+  uint32_t unresolved;
+  // Version 2:
+  uint32_t align;
+  uint32_t bss_align;
+  // Version 3:
+  uint32_t fix_size;
+} __attribute__((packed)) Rel_Hdr;
+
+static const uint32_t rel_header_sizes[] = { 0, 0x40, 0x48, 0x4c };
+
+typedef struct {
+  // Bit 0 is set for executable sections, 0 for the bss:
+  uint32_t offset;
+  uint32_t size;
+} __attribute__((packed)) Rel_Section;
+
+// Relocations against each module:
+typedef struct {
+  uint32_t module;
+  uint32_t offset;
+} __attribute__((packed)) Rel_Imp;
+
+typedef struct {
+  // From the previous relocation:
+  uint16_t offset;
+  uint8_t type;
+  uint8_t section;
+  uint32_t addend;
+} __attribute__((packed)) Rel_Reloc;
+
+#define R_DOLPHIN_NOP     201
+#define R_DOLPHIN_SECTION 202
+#define R_DOLPHIN_END     203
+#define R_DOLPHIN_MRKREF  204
+
+#define REL_SECTION_ALIGN 32
+
+// How each relocation type patches the code:
+struct howto {
+  uint8_t size;
+  uint8_t shift;
+  uint8_t relative;
+  // High half adjusted for the sign of the low half:
+  uint8_t ha;
+  uint32_t mask;
+};
+
+static const struct howto howtos[R_PPC_REL14_BRNTAKEN + 1] = {
+  [R_PPC_NONE]           = { 0, 0, 0, 0, 0 },
+  [R_PPC_ADDR32]         = { 4, 0, 0, 0, 0xffffffff },
+  [R_PPC_ADDR24]         = { 4, 0, 0, 0, 0x03fffffc },
+  [R_PPC_ADDR16]         = { 2, 0, 0, 0, 0xffff },
+  [R_PPC_ADDR16_LO]      = { 2, 0, 0, 0, 0xffff },
+  [R_PPC_ADDR16_HI]      = { 2, 16, 0, 0, 0xffff },
+  [R_PPC_ADDR16_HA]      = { 2, 16, 0, 1, 0xffff },
+  [R_PPC_ADDR14]         = { 4, 0, 0, 0, 0xfffc },
+  [R_PPC_ADDR14_BRTAKEN] = { 4, 0, 0, 0, 0xfffc },
+  [R_PPC_ADDR14_BRNTAKEN] = { 4, 0, 0, 0, 0xfffc },
+  [R_PPC_REL24]          = { 4, 0, 1, 0, 0x03fffffc },
+  [R_PPC_REL14]          = { 4, 0, 1, 0, 0xfffc },
+  [R_PPC_REL14_BRTAKEN]  = { 4, 0, 1, 0, 0xfffc },
+  [R_PPC_REL14_BRNTAKEN] = { 4, 0, 1, 0, 0xfffc },
+};
+
+// A relocation of the current run, the symbol value and addend folded:
+struct reloc {
+  uint32_t offset;
+  uint32_t type;
+  uint32_t value;
+  uint32_t sym;
+};
+
+struct rela_list {
+  Elf32_Rela *entries;
+  size_t count;
+  size_t allocated;
+};
+
+struct rel_section {
+  uint32_t offset;
+  uint32_t size;
+  int exec;
+  int bss;
+  uint32_t address;
+  uint16_t shndx;
+  uint16_t rela_shndx;
+  uint32_t sym;
+  uint32_t elf_offset;
+  uint32_t rela_offset;
+  struct rela_list rela;
+};
+
+// Symbols of the sections of another module:
+struct import {
+  uint32_t module;
+  uint32_t section;
+  uint32_t sym;
+};
+
+struct rel {
+  const char *filename;
+  const unsigned char *data;
+  size_t size;
+  Rel_Hdr hdr;
+  uint32_t header_size;
+  uint32_t id;
+  uint32_t section_count;
+  struct rel_section *sections;
+  // Relocated copy of the module, NULL for relocatable ELF files:
+  unsigned char *image;
+  struct strtab_info shstrtab;
+  struct strtab_info strtab;
+  Elf32_Sym *syms;
+  size_t symnum;
+  size_t symbols_allocated;
+  size_t local_count;
+  struct import *imports;
+  size_t import_count;
+  size_t unresolved;
+  struct reloc *batch;
+  size_t batch_count;
+  size_t batch_allocated;
+};
+
+static uint32_t read_be32(const unsigned char *data)
+{
+  return (uint32_t) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+// REL modules have no magic: the next and prev links are only set at run
+// time and the section table follows the header of the given version.
+int rel_detect(const void *data, size_t size)
+{
+  const unsigned char *header = data;
+  if (size < 0x40)
+    return 0;
+  uint32_t version = read_be32(header + 0x1c);
+  uint32_t section_count = read_be32(header + 0x0c);
+  return version >= 1 && version <= 3
+    && read_be32(header + 0x04) == 0 && read_be32(header + 0x08) == 0
+    && section_count != 0 && section_count <= 256
+    && read_be32(header + 0x10) == rel_header_sizes[version];
+}
+
+static uint32_t add_symbol(struct rel *rel, const char *name, uint32_t value,
+  uint32_t size, unsigned char info, uint16_t shndx)
+{
+  if (rel->symnum == rel->symbols_allocated) {
+    rel->symbols_allocated = rel->symbols_allocated ? 2 * rel->symbols_allocated : 32;
+    rel->syms = realloc(rel->syms, rel->symbols_allocated * sizeof(Elf32_Sym));
+  }
+  Elf32_Sym *sym = rel->syms + rel->symnum;
+  sym->st_name = htonl(strtab_index(&rel->strtab, name));
+  sym->st_value = htonl(value);
+  sym->st_size = htonl(size);
+  sym->st_info = info;
+  sym->st_other = STV_DEFAULT;
+  sym->st_shndx = htons(shndx);
+  return rel->symnum++;
+}
+
+static uint32_t import_symbol(struct rel *rel, uint32_t module, uint32_t section)
+{
+  for (size_t i = 0; i != rel->import_count; ++i)
+    if (rel->imports[i].module == module && rel->imports[i].section == section)
+      return rel->imports[i].sym;
+  char name[64];
+  snprintf(name, sizeof(name), "module%u_section%u", module, section);
+  rel->imports = realloc(rel->imports, (rel->import_count + 1) * sizeof(struct import));
+  struct import *import = rel->imports + rel->import_count++;
+  import->module = module;
+  import->section = section;
+  import->sym = add_symbol(rel, name, 0, 0, ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), SHN_UNDEF);
+  return import->sym;
+}
+
+static int read_sections(struct rel *rel, const struct rel_options *relocation)
+{
+  const Rel_Section *table = (const Rel_Section*) (rel->data + rel->header_size);
+  if (rel->header_size + (uint64_t) rel->section_count * sizeof(Rel_Section) > rel->size)
+    return -1;
+  rel->sections = calloc(rel->section_count, sizeof(struct rel_section));
+
+  uint32_t base = relocation ? relocation->base : 0;
+  uint32_t bss_align = ntohl(rel->hdr.version) >= 2 && rel->hdr.bss_align
+    ? ntohl(rel->hdr.bss_align) : REL_SECTION_ALIGN;
+  if (bss_align & (bss_align - 1))
+    return -1;
+  // The bss is allocated after the module:
+  uint32_t bss_address = (base + rel->size + bss_align - 1) & ~(bss_align - 1);
+
+  for (uint32_t i = 0; i != rel->section_count; ++i) {
+    struct rel_section *section = rel->sections + i;
+    uint32_t offset = ntohl(table[i].offset);
+    section->exec = offset & 1;
+    section->offset = offset & ~1u;
+    section->size = ntohl(table[i].size);
+    section->bss = section->offset == 0 && section->size != 0;
+    if (!section->bss && (uint64_t) section->offset + section->size > rel->size)
+      return -1;
+    section->address = section->bss ? bss_address : base + section->offset;
+  }
+  return 0;
+}
+
+// NULL section, .shstrtab and .relhdr come first, then the module sections,
+// .symtab and .strtab:
+#define REL_FIRST_SHNDX 3
+
+static uint16_t number_sections(struct rel *rel)
+{
+  uint16_t shindex = REL_FIRST_SHNDX;
+  for (uint32_t i = 0; i != rel->section_count; ++i)
+    if (rel->sections[i].size)
+      rel->sections[i].shndx = shindex++;
+  return shindex;
+}
+
+// The .rela sections come last, once the relocations are known:
+static uint16_t number_rela_sections(struct rel *rel, uint16_t symtab_shndx)
+{
+  uint16_t shindex = symtab_shndx + 2;
+  for (uint32_t i = 0; i != rel->section_count; ++i)
+    if (rel->sections[i].rela.count)
+      rel->sections[i].rela_shndx = shindex++;
+  return shindex;
+}
+
+static const char *section_name(const struct rel_section *section, uint32_t i,
+  char *buffer, size_t size)
+{
+  snprintf(buffer, size, "%s.%u",
+    section->bss ? ".bss" : section->exec ? ".text" : ".data", i);
+  return buffer;
+}
+
+static void add_rela(struct rela_list *list, uint32_t offset, uint32_t sym,
+  uint32_t type, uint32_t addend)
+{
+  if (list->count == list->allocated) {
+    list->allocated = list->allocated ? 2 * list->allocated : 64;
+    list->entries = realloc(list->entries, list->allocated * sizeof(Elf32_Rela));
+  }
+  Elf32_Rela *rela = list->entries + list->count++;
+  rela->r_offset = htonl(offset);
+  rela->r_info = htonl(ELF32_R_INFO(sym, type));
+  rela->r_addend = htonl(addend);
+}
+
+// Patch the relocations of a run in the relocated image:
+static void apply_batch(unsigned char *data, uint32_t address,
+  const struct reloc *relocs, size_t count)
+{
+  for (size_t i = 0; i != count; ++i) {
+    const struct reloc *reloc = relocs + i;
+    const struct howto *howto = howtos + reloc->type;
+    uint32_t value = reloc->value;
+    if (howto->relative)
+      value -= address + reloc->offset;
+    if (howto->ha)
+      value += 0x8000;
+    value >>= howto->shift;
+    unsigned char *field = data + reloc->offset;
+    if (howto->size == 4) {
+      uint32_t word;
+      memcpy(&word, field, 4);
+      word = htonl((ntohl(word) & ~howto->mask) | (value & howto->mask));
+      memcpy(field, &word, 4);
+    } else if (howto->size == 2) {
+      uint16_t half;
+      memcpy(&half, field, 2);
+      half = htons((ntohs(half) & ~howto->mask) | (value & howto->mask));
+      memcpy(field, &half, 2);
+    }
+  }
+}
+
+// A run of relocations of one section against one module:
+static void flush_batch(struct rel *rel, struct rel_section *section, int resolved)
+{
+  if (resolved && rel->image) {
+    apply_batch(rel->image + section->offset, section->address, rel->batch,
+      rel->batch_count);
+  } else {
+    // Relocatable files use section offsets:
+    uint32_t base = rel->image ? section->address : 0;
+    for (size_t i = 0; i != rel->batch_count; ++i) {
+      const struct reloc *reloc = rel->batch + i;
+      add_rela(&section->rela, base + reloc->offset, reloc->sym, reloc->type,
+        reloc->value);
+    }
+    if (rel->image)
+      rel->unresolved += rel->batch_count;
+  }
+  rel->batch_count = 0;
+}
+
+static int read_relocations(struct rel *rel, uint32_t module, uint32_t offset)
+{
+  // Imports from main.dol use absolute addresses:
+  int resolved = module == 0 || module == rel->id;
+  struct rel_section *section = NULL;
+  uint32_t position = 0;
+  for (; ; offset += sizeof(Rel_Reloc)) {
+    if ((uint64_t) offset + sizeof(Rel_Reloc) > rel->size)
+      return -1;
+    const Rel_Reloc *entry = (const Rel_Reloc*) (rel->data + offset);
+    uint32_t type = entry->type;
+    position += ntohs(entry->offset);
+
+    if (type == R_DOLPHIN_NOP || type == R_DOLPHIN_MRKREF)
+      continue;
+    if (type == R_DOLPHIN_SECTION || type == R_DOLPHIN_END) {
+      if (section)
+        flush_batch(rel, section, resolved);
+      if (type == R_DOLPHIN_END)
+        return 0;
+      if (entry->section >= rel->section_count || rel->sections[entry->section].bss)
+        return -1;
+      section = rel->sections + entry->section;
+      position = 0;
+      continue;
+    }
+    if (type > R_PPC_REL14_BRNTAKEN || !section
+      || (uint64_t) position + howtos[type].size > section->size)
+      return -1;
+
+    struct reloc reloc = { position, type, ntohl(entry->addend), 0 };
+    if (module == rel->id) {
+      if (entry->section >= rel->section_count || !rel->sections[entry->section].size)
+        return -1;
+      const struct rel_section *target = rel->sections + entry->section;
+      if (rel->image)
+        reloc.value += target->address;
+      else
+        reloc.sym = target->sym;
+    } else if (module != 0) {
+      reloc.sym = import_symbol(rel, module, entry->section);
+    }
+    if (rel->batch_count == rel->batch_allocated) {
+      rel->batch_allocated = rel->batch_allocated ? 2 * rel->batch_allocated : 1024;
+      rel->batch = realloc(rel->batch, rel->batch_allocated * sizeof(struct reloc));
+    }
+    rel->batch[rel->batch_count++] = reloc;
+  }
+}
+
+static void add_symbols(struct rel *rel)
+{
+  add_symbol(rel, "", 0, 0, 0, SHN_UNDEF);
+  for (uint32_t i = 0; i != rel->section_count; ++i) {
+    struct rel_section *section = rel->sections + i;
+    if (!section->size)
+      continue;
+    section->sym = add_symbol(rel, "", rel->image ? section->address : 0, 0,
+      ELF32_ST_INFO(STB_LOCAL, STT_SECTION), section->shndx);
+  }
+  rel->local_count = rel->symnum;
+
+  // Entry points of the module:
+  const struct {
+    const char *name;
+    uint8_t section;
+    uint32_t offset;
+  } entries[] = {
+    { "_prolog", rel->hdr.prolog_section, ntohl(rel->hdr.prolog) },
+    { "_epilog", rel->hdr.epilog_section, ntohl(rel->hdr.epilog) },
+    { "_unresolved", rel->hdr.unresolved_section, ntohl(rel->hdr.unresolved) },
+  };
+  for (size_t i = 0; i != sizeof(entries) / sizeof(entries[0]); ++i) {
+    if (!entries[i].section || entries[i].section >= rel->section_count)
+      continue;
+    const struct rel_section *section = rel->sections + entries[i].section;
+    if (!section->size)
+      continue;
+    add_symbol(rel, entries[i].name,
+      (rel->image ? section->address : 0) + entries[i].offset, 0,
+      ELF32_ST_INFO(STB_GLOBAL, STT_FUNC), section->shndx);
+  }
+}
+
+static void init_shdr(Elf32_Shdr *shdr, uint32_t name, uint32_t type,
+  uint32_t flags, uint32_t address, uint32_t offset, uint32_t size)
+{
+  shdr->sh_name  = htonl(name);
+  shdr->sh_type  = htonl(type);
+  shdr->sh_flags = htonl(flags);
+  shdr->sh_addr  = htonl(address);
+  shdr->sh_offset = htonl(offset);
+  shdr->sh_size = htonl(size);
+  shdr->sh_link = 0;
+  shdr->sh_info = 0;
+  shdr->sh_addralign = 0;
+  shdr->sh_entsize = 0;
+}
+
+static void fill_elf_header(const struct rel *rel, Elf32_Ehdr *ehdr,
+  size_t phnum, size_t shnum)
+{
+  memset(ehdr, 0, sizeof(Elf32_Ehdr));
+  ehdr->e_ident[EI_MAG0]       = 0x7f;
+  ehdr->e_ident[EI_MAG1]       = 'E';
+  ehdr->e_ident[EI_MAG2]       = 'L';
+  ehdr->e_ident[EI_MAG3]       = 'F';
+  ehdr->e_ident[EI_CLASS]      = ELFCLASS32;
+  ehdr->e_ident[EI_DATA]       = ELFDATA2MSB;
+  ehdr->e_ident[EI_VERSION]    = EV_CURRENT;
+  ehdr->e_ident[EI_OSABI]      = ELFOSABI_STANDALONE;
+  ehdr->e_type      = htons(rel->image ? ET_EXEC : ET_REL);
+  ehdr->e_machine   = htons(EM_PPC);
+  ehdr->e_version   = htonl(EV_CURRENT);
+  uint8_t prolog = rel->hdr.prolog_section;
+  if (rel->image && prolog && prolog < rel->section_count)
+    ehdr->e_entry = htonl(rel->sections[prolog].address + ntohl(rel->hdr.prolog));
+  ehdr->e_phoff     = htonl(phnum ? sizeof(Elf32_Ehdr) : 0);
+  ehdr->e_shoff     = htonl(sizeof(Elf32_Ehdr) + phnum * sizeof(Elf32_Phdr));
+  ehdr->e_ehsize    = htons(sizeof(Elf32_Ehdr));
+  ehdr->e_phentsize = htons(sizeof(Elf32_Phdr));
+  ehdr->e_phnum     = htons(phnum);
+  ehdr->e_shentsize = htons(sizeof(Elf32_Shdr));
+  ehdr->e_shnum     = htons(shnum);
+  ehdr->e_shstrndx  = htons(1);
+}
+
+static int write_elf(struct rel *rel, int elf_fd)
+{
+  uint16_t symtab_shndx = number_sections(rel);
+  size_t shnum = number_rela_sections(rel, symtab_shndx);
+  size_t phnum = 0;
+  if (rel->image)
+    for (uint32_t i = 0; i != rel->section_count; ++i)
+      if (rel->sections[i].size)
+        ++phnum;
+
+  // Section names:
+  char name[32];
+  uint32_t *names = calloc(2 * rel->section_count, sizeof(uint32_t));
+  for (uint32_t i = 0; i != rel->section_count; ++i) {
+    const struct rel_section *section = rel->sections + i;
+    if (!section->size)
+      continue;
+    names[2 * i] = strtab_index(&rel->shstrtab, section_name(section, i, name, sizeof(name)));
+    if (section->rela.count) {
+      char rela_name[40];
+      snprintf(rela_name, sizeof(rela_name), ".rela%s", name);
+      names[2 * i + 1] = strtab_index(&rel->shstrtab, rela_name);
+    }
+  }
+  uint32_t shstrtab_name = strtab_index(&rel->shstrtab, ".shstrtab");
+  uint32_t relhdr_name = strtab_index(&rel->shstrtab, ".relhdr");
+  uint32_t symtab_name = strtab_index(&rel->shstrtab, ".symtab");
+  uint32_t strtab_name = strtab_index(&rel->shstrtab, ".strtab");
+
+  // Layout: headers, REL header, sections, then the tables:
+  size_t headers_size = sizeof(Elf32_Ehdr) + phnum * sizeof(Elf32_Phdr)
+    + shnum * sizeof(Elf32_Shdr);
+  uint64_t offset = headers_size;
+  uint32_t relhdr_offset = offset;
+  offset += rel->header_size;
+  for (uint32_t i = 0; i != rel->section_count; ++i) {
+    struct rel_section *section = rel->sections + i;
+    if (!section->size)
+      continue;
+    offset = (offset + REL_SECTION_ALIGN - 1) & ~(uint64_t) (REL_SECTION_ALIGN - 1);
+    section->elf_offset = offset;
+    if (!section->bss)
+      offset += section->size;
+  }
+  uint32_t shstrtab_offset = offset;
+  offset += rel->shstrtab.used;
+  offset = (offset + 3) & ~3;
+  uint32_t symtab_offset = offset;
+  offset += rel->symnum * sizeof(Elf32_Sym);
+  uint32_t strtab_offset = offset;
+  offset += rel->strtab.used;
+  for (uint32_t i = 0; i != rel->section_count; ++i) {
+    struct rel_section *section = rel->sections + i;
+    if (!section->rela.count)
+      continue;
+    offset = (offset + 3) & ~3;
+    section->rela_offset = offset;
+    offset += section->rela.count * sizeof(Elf32_Rela);
+  }
+  if (offset > UINT32_MAX) {
+    free(names);
+    return -1;
+  }
+
+  unsigned char *headers = calloc(1, headers_size);
+  fill_elf_header(rel, (Elf32_Ehdr*) headers, phnum, shnum);
+  Elf32_Phdr *phdr = (Elf32_Phdr*) (headers + sizeof(Elf32_Ehdr));
+  Elf32_Shdr *shdrs = (Elf32_Shdr*) (headers + sizeof(Elf32_Ehdr) + phnum * sizeof(Elf32_Phdr));
+  init_shdr(shdrs + 1, shstrtab_name, SHT_STRTAB, 0, 0, shstrtab_offset, rel->shstrtab.used);
+  init_shdr(shdrs + 2, relhdr_name, SHT_PROGBITS, 0, 0, relhdr_offset, rel->header_size);
+  for (uint32_t i = 0; i != rel->section_count; ++i) {
+    const struct rel_section *section = rel->sections + i;
+    if (!section->size)
+      continue;
+    uint32_t flags = SHF_ALLOC | (section->exec ? SHF_EXECINSTR : SHF_WRITE);
+    uint32_t address = rel->image ? section->address : 0;
+    Elf32_Shdr *shdr = shdrs + section->shndx;
+    init_shdr(shdr, names[2 * i], section->bss ? SHT_NOBITS : SHT_PROGBITS, flags,
+      address, section->elf_offset, section->size);
+    shdr->sh_addralign = htonl(4);
+    if (section->rela.count) {
+      shdr = shdrs + section->rela_shndx;
+      init_shdr(shdr, names[2 * i + 1], SHT_RELA, SHF_INFO_LINK, 0,
+        section->rela_offset, section->rela.count * sizeof(Elf32_Rela));
+      shdr->sh_link = htonl(symtab_shndx);
+      shdr->sh_info = htonl(section->shndx);
+      shdr->sh_addralign = htonl(4);
+      shdr->sh_entsize = htonl(sizeof(Elf32_Rela));
+    }
+    if (rel->image) {
+      phdr->p_type    = htonl(PT_LOAD);
+      phdr->p_offset  = htonl(section->elf_offset);
+      phdr->p_vaddr   = htonl(section->address);
+      phdr->p_paddr   = htonl(section->address);
+      phdr->p_filesz  = htonl(section->bss ? 0 : section->size);
+      phdr->p_memsz   = htonl(section->size);
+      phdr->p_flags   = htonl(section->exec ? PF_X | PF_R : PF_R | PF_W);
+      phdr->p_align   = htonl(1);
+      ++phdr;
+    }
+  }
+  Elf32_Shdr *shdr = shdrs + symtab_shndx;
+  init_shdr(shdr, symtab_name, SHT_SYMTAB, 0, 0, symtab_offset,
+    rel->symnum * sizeof(Elf32_Sym));
+  shdr->sh_link = htonl(symtab_shndx + 1);
+  shdr->sh_info = htonl(rel->local_count);
+  shdr->sh_addralign = htonl(4);
+  shdr->sh_entsize = htonl(sizeof(Elf32_Sym));
+  init_shdr(shdrs + symtab_shndx + 1, strtab_name, SHT_STRTAB, 0, 0,
+    strtab_offset, rel->strtab.used);
+  free(names);
+
+  const unsigned char *payload = rel->image ? rel->image : rel->data;
+  int res = pwrite_all(elf_fd, headers, headers_size, 0);
+  free(headers);
+  res |= pwrite_all(elf_fd, rel->data, rel->header_size, relhdr_offset);
+  for (uint32_t i = 0; i != rel->section_count && res == 0; ++i) {
+    const struct rel_section *section = rel->sections + i;
+    if (section->size && !section->bss)
+      res |= pwrite_all(elf_fd, payload + section->offset, section->size,
+        section->elf_offset);
+    if (section->rela.count)
+      res |= pwrite_all(elf_fd, section->rela.entries,
+        section->rela.count * sizeof(Elf32_Rela), section->rela_offset);
+  }
+  if (res != 0
+    || pwrite_all(elf_fd, rel->shstrtab.data, rel->shstrtab.used, shstrtab_offset) != 0
+    || pwrite_all(elf_fd, rel->syms, rel->symnum * sizeof(Elf32_Sym), symtab_offset) != 0
+    || pwrite_all(elf_fd, rel->strtab.data, rel->strtab.used, strtab_offset) != 0
+    || ftruncate(elf_fd, offset) != 0)
+    return -1;
+  return 0;
+}
+
+static void rel_free(struct rel *rel)
+{
+  if (rel->sections)
+    for (uint32_t i = 0; i != rel->section_count; ++i)
+      free(rel->sections[i].rela.entries);
+  free(rel->sections);
+  free(rel->image);
+  strtab_destroy(&rel->shstrtab);
+  strtab_destroy(&rel->strtab);
+  free(rel->syms);
+  free(rel->imports);
+  free(rel->batch);
+}
+
+int rel2elf_fd(int rel_fd, int elf_fd, const char *rel_filename,
+  const struct dol2elf_options *options, const struct rel_options *relocation)
+{
+  struct rel rel;
+  memset(&rel, 0, sizeof(struct rel));
+  rel.filename = rel_filename;
+  strtab_create(&rel.shstrtab);
+  strtab_create(&rel.strtab);
+  struct dol_mapping mapping;
+  memset(&mapping, 0, sizeof(struct dol_mapping));
+
+  STATS_BEGIN(STATS_READ_HEADER);
+  struct stat st;
+  if (fstat(rel_fd, &st) != 0 || st.st_size < (off_t) sizeof(Rel_Hdr)) {
+    fprintf(error_file(), "Could not read REL header in %s\n", rel_filename);
+    goto err;
+  }
+  struct dol_source source = { 0, st.st_size, DECODE_NONE, 1 };
+  if (dol_map(rel_fd, &source, &mapping) != 0) {
+    fprintf(error_file(), "Could not map %s\n", rel_filename);
+    goto err;
+  }
+  rel.data = mapping.data;
+  rel.size = source.size;
+  memcpy(&rel.hdr, rel.data, sizeof(Rel_Hdr));
+  STATS_END(STATS_READ_HEADER);
+  if (!rel_detect(rel.data, rel.size)) {
+    fprintf(error_file(), "Invalid REL file %s\n", rel_filename);
+    goto err;
+  }
+  rel.id = ntohl(rel.hdr.id);
+  rel.section_count = ntohl(rel.hdr.section_count);
+  rel.header_size = rel_header_sizes[ntohl(rel.hdr.version)];
+  if (options && options->diag)
+    fprintf(options->diag, "REL module %u: %u sections\n", rel.id, rel.section_count);
+
+  STATS_BEGIN(STATS_PREPARE);
+  if (read_sections(&rel, relocation) != 0) {
+    fprintf(error_file(), "Invalid REL file %s\n", rel_filename);
+    goto err;
+  }
+  // Relocations are applied to a copy of the module:
+  if (relocation) {
+    rel.image = malloc(rel.size);
+    if (!rel.image) {
+      fprintf(error_file(), "Could not allocate memory for %s\n", rel_filename);
+      goto err;
+    }
+    memcpy(rel.image, rel.data, rel.size);
+  }
+  number_sections(&rel);
+  add_symbols(&rel);
+  uint32_t imp_offset = ntohl(rel.hdr.imp_offset);
+  uint32_t imp_size = ntohl(rel.hdr.imp_size);
+  if ((uint64_t) imp_offset + imp_size > rel.size) {
+    fprintf(error_file(), "Invalid REL file %s\n", rel_filename);
+    goto err;
+  }
+  const Rel_Imp *imps = (const Rel_Imp*) (rel.data + imp_offset);
+  for (uint32_t i = 0; i != imp_size / sizeof(Rel_Imp); ++i)
+    if (read_relocations(&rel, ntohl(imps[i].module), ntohl(imps[i].offset)) != 0) {
+      fprintf(error_file(), "Invalid relocations in REL file %s\n", rel_filename);
+      goto err;
+    }
+  if (rel.image && rel.unresolved && options && options->diag)
+    fprintf(options->diag, "%zu relocations against other modules left in .rela sections\n",
+      rel.unresolved);
+  STATS_END(STATS_PREPARE);
+
+  STATS_BEGIN(STATS_COPY_PAYLOAD);
+  if (write_elf(&rel, elf_fd) != 0) {
+    fputs("Could not write ELF file\n", error_file());
+    goto err;
+  }
+  STATS_END(STATS_COPY_PAYLOAD);
+
+  rel_free(&rel);
+  dol_unmap(&mapping);
+  return 0;
+
+err:
+  rel_free(&rel);
+  dol_unmap(&mapping);
+  return 1;
+}
@@ -0,0 +1,287 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "doltool.h"
+
+// GameCube and Wii main memory (24 MiB and the MEM1 of the Wii):
+#define SCAN_RAM_START 0x80000000u
+#define SCAN_RAM_END   0x81800000u
+// DOL files are usually padded after their last segment:
+#define SCAN_MAX_PADDING 0x1000
+// Candidates of a directory whose headers are read together:
+#define SCAN_BATCH 64
+
+struct scan {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  // Stack of directories to scan and number of directories being scanned:
+  char **queue;
+  size_t count;
+  size_t allocated;
+  size_t busy;
+  const char *root;
+  const char *output;
+  const struct converter *converter;
+  // Counters:
+  size_t directories;
+  size_t files;
+  size_t matches;
+  size_t failed;
+};
+
+struct scan_candidate {
+  char *name;
+  int fd;
+  off_t size;
+};
+
+static int in_ram(uint32_t address, uint32_t size)
+{
+  return address >= SCAN_RAM_START && address <= SCAN_RAM_END
+    && size <= SCAN_RAM_END - address;
+}
+
+// Whether the segment fits in the file after the header, not before the
+// previous one:
+static int plausible_segment(uint32_t offset, uint32_t address, uint32_t size,
+  uint64_t file_size, uint64_t *end)
+{
+  if (!size)
+    return 1;
+  if (offset < sizeof(Dol_Hdr) || offset < *end || offset + (uint64_t) size > file_size
+    || !in_ram(address, size))
+    return 0;
+  *end = offset + (uint64_t) size;
+  return 1;
+}
+
+int dol_plausible(const Dol_Hdr *dhdr, uint64_t file_size)
+{
+  uint64_t end = sizeof(Dol_Hdr);
+  uint32_t entry = ntohl(dhdr->entry_point);
+  int has_entry = 0;
+  for (int i=0; i != DOL_TEXT_COUNT; ++i) {
+    uint32_t address = ntohl(dhdr->text_address[i]), size = ntohl(dhdr->text_size[i]);
+    if (!plausible_segment(ntohl(dhdr->text_offset[i]), address, size, file_size, &end))
+      return 0;
+    if (size && entry >= address && entry - address < size)
+      has_entry = 1;
+  }
+  for (int i=0; i != DOL_DATA_COUNT; ++i)
+    if (!plausible_segment(ntohl(dhdr->data_offset[i]), ntohl(dhdr->data_address[i]),
+        ntohl(dhdr->data_size[i]), file_size, &end))
+      return 0;
+  if (dhdr->bss_size && !in_ram(ntohl(dhdr->bss_address), ntohl(dhdr->bss_size)))
+    return 0;
+  return has_entry && file_size - end <= SCAN_MAX_PADDING;
+}
+
+static void scan_push(struct scan *scan, char *path)
+{
+  pthread_mutex_lock(&scan->lock);
+  if (scan->count == scan->allocated) {
+    scan->allocated = scan->allocated ? scan->allocated * 2 : 64;
+    scan->queue = realloc(scan->queue, scan->allocated * sizeof(char*));
+  }
+  scan->queue[scan->count++] = path;
+  pthread_cond_signal(&scan->cond);
+  pthread_mutex_unlock(&scan->lock);
+}
+
+static void scan_match(struct scan *scan, const char *path)
+{
+  __sync_fetch_and_add(&scan->matches, 1);
+  if (!scan->output) {
+    // One line per file even with concurrent workers:
+    flockfile(stdout);
+    fputs(path, stdout);
+    putc_unlocked('\n', stdout);
+    funlockfile(stdout);
+    return;
+  }
+
+  // The tree of the matches is mirrored in the output directory:
+  char *elf_filename;
+  const char *relative = path + strlen(scan->root);
+  if (asprintf(&elf_filename, "%s%s.elf", scan->output, relative) < 0)
+    return;
+  if (make_parents(elf_filename) != 0
+    || convert_file(scan->converter, path, elf_filename) != 0) {
+    fprintf(stderr, "Could not convert %s\n", path);
+    __sync_fetch_and_add(&scan->failed, 1);
+  }
+  free(elf_filename);
+}
+
+// Open the candidates and hint the kernel to fetch all their headers
+// before reading the first one:
+static void scan_candidates(struct scan *scan, const char *dir, int dir_fd,
+  struct scan_candidate *candidates, size_t count)
+{
+  for (size_t i = 0; i != count; ++i) {
+    struct scan_candidate *candidate = candidates + i;
+    struct stat st;
+    candidate->fd = openat(dir_fd, candidate->name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    if (candidate->fd >= 0 && fstat(candidate->fd, &st) == 0 && S_ISREG(st.st_mode)
+      && st.st_size >= (off_t) sizeof(Dol_Hdr)) {
+      candidate->size = st.st_size;
+      posix_fadvise(candidate->fd, 0, sizeof(Dol_Hdr), POSIX_FADV_WILLNEED);
+    } else {
+      candidate->size = 0;
+    }
+  }
+
+  for (size_t i = 0; i != count; ++i) {
+    struct scan_candidate *candidate = candidates + i;
+    Dol_Hdr dhdr;
+    if (candidate->size
+      && pread(candidate->fd, &dhdr, sizeof(Dol_Hdr), 0) == sizeof(Dol_Hdr)
+      && dol_plausible(&dhdr, candidate->size)) {
+      char *path;
+      if (asprintf(&path, "%s/%s", dir, candidate->name) >= 0) {
+        scan_match(scan, path);
+        free(path);
+      }
+    }
+    if (candidate->fd >= 0)
+      close(candidate->fd);
+    free(candidate->name);
+  }
+}
+
+static void scan_directory(struct scan *scan, const char *path)
+{
+  DIR *dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "Could not open directory %s\n", path);
+    return;
+  }
+  __sync_fetch_and_add(&scan->directories, 1);
+
+  struct scan_candidate candidates[SCAN_BATCH];
+  size_t count = 0;
+  struct dirent *dirent;
+  while ((dirent = readdir(dir))) {
+    const char *name = dirent->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+      continue;
+    unsigned char type = dirent->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+      if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        continue;
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    // Symbolic links are not followed:
+    if (type == DT_DIR) {
+      char *subdir;
+      if (asprintf(&subdir, "%s/%s", path, name) >= 0)
+        scan_push(scan, subdir);
+    } else if (type == DT_REG) {
+      __sync_fetch_and_add(&scan->files, 1);
+      candidates[count].name = strdup(name);
+      if (++count == SCAN_BATCH) {
+        scan_candidates(scan, path, dirfd(dir), candidates, count);
+        count = 0;
+      }
+    }
+  }
+  scan_candidates(scan, path, dirfd(dir), candidates, count);
+  closedir(dir);
+}
+
+static void *scan_worker(void *arg)
+{
+  struct scan *scan = arg;
+  pthread_mutex_lock(&scan->lock);
+  while (1) {
+    while (scan->count == 0 && scan->busy != 0)
+      pthread_cond_wait(&scan->cond, &scan->lock);
+    // Nothing queued and nothing left which could queue more:
+    if (scan->count == 0) {
+      pthread_cond_broadcast(&scan->cond);
+      pthread_mutex_unlock(&scan->lock);
+      return NULL;
+    }
+    char *path = scan->queue[--scan->count];
+    ++scan->busy;
+    pthread_mutex_unlock(&scan->lock);
+
+    scan_directory(scan, path);
+    free(path);
+
+    pthread_mutex_lock(&scan->lock);
+    if (--scan->busy == 0 && scan->count == 0)
+      pthread_cond_broadcast(&scan->cond);
+  }
+}
+
+// Find the DOL files in a tree, list them or convert them in output:
+int scan_run(const char *root, const char *output, int threads,
+  const struct converter *converter)
+{
+  struct scan scan;
+  memset(&scan, 0, sizeof(struct scan));
+  pthread_mutex_init(&scan.lock, NULL);
+  pthread_cond_init(&scan.cond, NULL);
+  scan.root = root;
+  scan.output = output;
+  scan.converter = converter;
+  if (output && mkdir(output, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Could not create directory %s\n", output);
+    return 1;
+  }
+  scan_push(&scan, strdup(root));
+  if (threads < 1)
+    threads = 1;
+
+  double start = now();
+
+  threads = run_pool(&scan, scan_worker, threads);
+
+  double elapsed = now() - start;
+  if (elapsed <= 0)
+    elapsed = 1e-9;
+  fflush(stdout);
+  fprintf(stderr,
+    "%zu DOL files (%zu failed) among %zu files in %zu directories in %.3fs "
+    "on %i threads: %.1f files/s\n",
+    scan.matches, scan.failed, scan.files, scan.directories, elapsed,
+    threads, scan.files / elapsed);
+
+  free(scan.queue);
+  pthread_mutex_destroy(&scan.lock);
+  pthread_cond_destroy(&scan.cond);
+  return scan.failed ? 1 : 0;
+}
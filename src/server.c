@@ -0,0 +1,381 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "doltool.h"
+
+#define SERVER_MAGIC 0x444f4c32 // "DOL2"
+#define SERVER_BACKLOG 128
+#define SERVER_NAME_SIZE 256
+
+// Request flags:
+#define SERVER_VERBOSE 1
+// REL modules are relocated at rel_base:
+#define SERVER_RELOCATE 2
+
+// Sent along with the DOL and ELF file descriptors:
+struct server_request {
+  uint32_t magic;
+  uint32_t flags;
+  uint32_t conversion_flags;
+  uint32_t align;
+  int32_t compress_level;
+  uint32_t rel_base;
+  char name[SERVER_NAME_SIZE];
+};
+
+// Followed by message_size bytes of diagnostics:
+struct server_reply {
+  int32_t status;
+  uint32_t message_size;
+};
+
+struct server {
+  int listen_fd;
+  const struct converter *converter;
+};
+
+static int socket_address(const char *path, struct sockaddr_un *address)
+{
+  memset(address, 0, sizeof(struct sockaddr_un));
+  address->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address->sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(address->sun_path, path);
+  return 0;
+}
+
+static int send_all(int fd, const void *data, size_t size)
+{
+  const char *p = data;
+  while (size) {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+static int recv_all(int fd, void *data, size_t size)
+{
+  char *p = data;
+  while (size) {
+    ssize_t n = recv(fd, p, size, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// ***** Server
+
+// Receive a request and its two file descriptors. Returns 0 at the end of
+// the connection.
+static int receive_request(int fd, struct server_request *request, int fds[2])
+{
+  union {
+    char buffer[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { request, sizeof(struct server_request) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+
+  ssize_t n;
+  do {
+    n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return n;
+
+  int count = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      int *data = (int*) CMSG_DATA(cmsg);
+      for (int i = 0; i != received; ++i) {
+        if (count < 2)
+          fds[count++] = data[i];
+        else
+          close(data[i]);
+      }
+    }
+
+  if (n != sizeof(struct server_request) || count != 2
+    || request->magic != SERVER_MAGIC || (msg.msg_flags & MSG_CTRUNC)) {
+    for (int i = 0; i != count; ++i)
+      close(fds[i]);
+    return -1;
+  }
+  request->name[SERVER_NAME_SIZE - 1] = '\0';
+  return 1;
+}
+
+static int handle_request(const struct server *server,
+  const struct server_request *request, int dol_fd, int elf_fd, int client_fd)
+{
+  const struct converter *converter = server->converter;
+  // Only the threads per file are the server's, the rest is the client's:
+  struct dol2elf_options options;
+  memset(&options, 0, sizeof(options));
+  options.threads = converter->options->threads;
+  options.flags = request->conversion_flags;
+  options.align = request->align;
+  options.compress_level = request->compress_level;
+  struct rel_options rel = { request->rel_base };
+
+  // Diagnostics go back to the client:
+  char *message = NULL;
+  size_t message_size = 0;
+  FILE *stream = open_memstream(&message, &message_size);
+  error_stream = stream;
+  options.diag = (request->flags & SERVER_VERBOSE) ? stream : NULL;
+
+  struct stats_record record;
+  if (converter->stats) {
+    stats_begin_record(&record, request->name);
+    stats_record = &record;
+    STATS_BEGIN(STATS_CONVERT);
+  }
+  int status = dol2elf_fd(dol_fd, elf_fd, request->name, &options,
+    (request->flags & SERVER_RELOCATE) ? &rel : NULL);
+  if (converter->stats) {
+    STATS_END(STATS_CONVERT);
+    stats_record = NULL;
+    stats_merge(converter->stats, &record, status);
+  }
+
+  error_stream = NULL;
+  if (stream)
+    fclose(stream);
+
+  struct server_reply reply = { status, message ? message_size : 0 };
+  int res = send_all(client_fd, &reply, sizeof(reply));
+  if (res == 0 && reply.message_size)
+    res = send_all(client_fd, message, reply.message_size);
+  free(message);
+  return res;
+}
+
+static void *server_worker(void *arg)
+{
+  const struct server *server = arg;
+  while (1) {
+    int client_fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client_fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      // The listening socket has been shut down:
+      return NULL;
+    }
+    // Several requests per connection:
+    while (1) {
+      struct server_request request;
+      int fds[2];
+      if (receive_request(client_fd, &request, fds) <= 0)
+        break;
+      int res = handle_request(server, &request, fds[0], fds[1], client_fd);
+      close(fds[0]);
+      close(fds[1]);
+      if (res != 0)
+        break;
+    }
+    close(client_fd);
+  }
+}
+
+int server_run(const char *path, int threads, const struct converter *converter)
+{
+  struct sockaddr_un address;
+  if (socket_address(path, &address) != 0)
+    return 1;
+
+  struct server server = { -1, converter };
+  server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server.listen_fd < 0) {
+    fputs("Could not create socket\n", stderr);
+    return 1;
+  }
+  // Replace a stale socket:
+  unlink(path);
+  if (bind(server.listen_fd, (struct sockaddr*) &address, sizeof(address)) != 0
+    || listen(server.listen_fd, SERVER_BACKLOG) != 0) {
+    fprintf(stderr, "Could not listen on %s\n", path);
+    close(server.listen_fd);
+    return 1;
+  }
+
+  // The workers inherit the signal mask: only this thread handles them.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (threads < 1)
+    threads = 1;
+  pthread_t *workers = calloc(threads, sizeof(pthread_t));
+  int started = 0;
+  for (int i = 0; i != threads; ++i) {
+    if (pthread_create(&workers[i], NULL, server_worker, &server) != 0)
+      break;
+    ++started;
+  }
+
+  int res = 0;
+  if (started == 0) {
+    fputs("Could not start the server threads\n", stderr);
+    res = 1;
+  } else {
+    int signal_number;
+    sigwait(&signals, &signal_number);
+  }
+
+  // Wake up the workers blocked in accept():
+  shutdown(server.listen_fd, SHUT_RDWR);
+  for (int i = 0; i != started; ++i)
+    pthread_join(workers[i], NULL);
+  free(workers);
+  close(server.listen_fd);
+  unlink(path);
+  return res;
+}
+
+// ***** Client
+
+// Returns -1 when the server cannot be reached.
+int client_convert(const char *path, const char *dol_filename,
+  const char *elf_filename, const struct dol2elf_options *options,
+  const struct rel_options *rel)
+{
+  struct sockaddr_un address;
+  if (socket_address(path, &address) != 0)
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  int dol_fd = open(dol_filename, O_RDONLY | O_CLOEXEC);
+  if (dol_fd < 0) {
+    fprintf(stderr, "Could not open %s\n", dol_filename);
+    close(fd);
+    return 1;
+  }
+  int elf_fd = open(elf_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (elf_fd < 0) {
+    fprintf(stderr, "Could not open %s\n", elf_filename);
+    close(dol_fd);
+    close(fd);
+    return 1;
+  }
+
+  struct server_request request;
+  memset(&request, 0, sizeof(request));
+  request.magic = SERVER_MAGIC;
+  request.flags = (options && options->diag ? SERVER_VERBOSE : 0)
+    | (rel ? SERVER_RELOCATE : 0);
+  request.conversion_flags = options ? options->flags : 0;
+  request.align = options ? options->align : 0;
+  request.compress_level = options ? options->compress_level : 0;
+  request.rel_base = rel ? rel->base : 0;
+  snprintf(request.name, sizeof(request.name), "%s", dol_filename);
+
+  union {
+    char buffer[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = { &request, sizeof(request) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buffer;
+  msg.msg_controllen = sizeof(control.buffer);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+  int fds[2] = { dol_fd, elf_fd };
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  int res = 1;
+  ssize_t n;
+  do {
+    n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  close(dol_fd);
+  close(elf_fd);
+
+  struct server_reply reply;
+  if (n != sizeof(request) || recv_all(fd, &reply, sizeof(reply)) != 0) {
+    fprintf(stderr, "Conversion server failed on %s\n", dol_filename);
+  } else {
+    // Relay the diagnostics:
+    char buffer[4096];
+    uint32_t remaining = reply.message_size;
+    while (remaining) {
+      size_t chunk = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+      if (recv_all(fd, buffer, chunk) != 0)
+        break;
+      fwrite(buffer, 1, chunk, stderr);
+      remaining -= chunk;
+    }
+    res = reply.status;
+  }
+  close(fd);
+
+  if (res != 0)
+    unlink(elf_filename);
+  return res;
+}
@@ -43,36 +43,48 @@ static void init_null_shdr(Elf32_Shdr *shdr, struct Elf *elf)
   shdr->sh_entsize = 0;
 }
 
-static void init_text_shdr(Dol_Hdr *dhdr, int i, Elf32_Shdr *shdr, struct Elf *elf)
+// SHF_ALLOC sections cannot be compressed:
+static void init_compressed_shdr(const struct compressed *blob, Elf32_Shdr *shdr)
+{
+  shdr->sh_flags = htonl((ntohl(shdr->sh_flags) & ~SHF_ALLOC) | SHF_COMPRESSED);
+  shdr->sh_size = htonl(blob->size);
+  shdr->sh_addralign = htonl(4);
+}
+
+static void init_text_shdr(const Dol_Hdr *dhdr, int i, Elf32_Shdr *shdr, struct Elf *elf)
 {
   shdr->sh_name  = htonl(strtab_index(&elf->strtab, text_sections[i]));
   shdr->sh_type  = htonl(SHT_PROGBITS);
   shdr->sh_flags = htonl(SHF_ALLOC | SHF_EXECINSTR);
   shdr->sh_addr  = dhdr->text_address[i];
-  shdr->sh_offset = htonl(ntohl(dhdr->text_offset[i]) + elf->dol_offset);
+  shdr->sh_offset = htonl(elf->text_offset[i]);
   shdr->sh_size = dhdr->text_size[i];
   shdr->sh_link = 0;
   shdr->sh_info = 0;
   shdr->sh_addralign = 0;
   shdr->sh_entsize = 0;
+  if (elf->compressed)
+    init_compressed_shdr(elf->text_compressed + i, shdr);
 }
 
-static void init_data_shdr(Dol_Hdr *dhdr, int i, Elf32_Shdr *shdr, struct Elf *elf)
+static void init_data_shdr(const Dol_Hdr *dhdr, int i, Elf32_Shdr *shdr, struct Elf *elf)
 {
   shdr->sh_name  = htonl(strtab_index(&elf->strtab, data_sections[i]));
   shdr->sh_type  = htonl(SHT_PROGBITS);
   shdr->sh_flags = htonl(SHF_ALLOC | SHF_WRITE);
   shdr->sh_addr  = dhdr->data_address[i];
-  shdr->sh_offset = htonl(ntohl(dhdr->data_offset[i]) + elf->dol_offset);
+  shdr->sh_offset = htonl(elf->data_offset[i]);
   shdr->sh_size = dhdr->data_size[i];
   shdr->sh_link = 0;
   shdr->sh_info = 0;
   shdr->sh_addralign = 0;
   shdr->sh_entsize = 0;
+  if (elf->compressed)
+    init_compressed_shdr(elf->data_compressed + i, shdr);
 }
 
 
-static void init_bss_shdr(Dol_Hdr *dhdr, Elf32_Shdr *shdr, struct Elf *elf)
+static void init_bss_shdr(const Dol_Hdr *dhdr, Elf32_Shdr *shdr, struct Elf *elf)
 {
   shdr->sh_name  = htonl(strtab_index(&elf->strtab, ".bss"));
   shdr->sh_type  = htonl(SHT_NOBITS);
@@ -114,7 +126,50 @@ static void init_dol_shdr(Elf32_Shdr *shdr, struct Elf *elf)
   shdr->sh_entsize = 0;
 }
 
-void create_shdrs(Dol_Hdr *dhdr, struct Elf *elf)
+static void init_note_shdr(Elf32_Shdr *shdr, struct Elf *elf)
+{
+  shdr->sh_name  = htonl(strtab_index(&elf->strtab, ".note.dol2elf"));
+  shdr->sh_type  = htonl(SHT_NOTE);
+  shdr->sh_flags = 0;
+  shdr->sh_addr  = 0;
+  shdr->sh_offset = htonl(elf->note_offset);
+  shdr->sh_size = htonl(sizeof(struct elf_note));
+  shdr->sh_link = 0;
+  shdr->sh_info = 0;
+  shdr->sh_addralign = htonl(4);
+  shdr->sh_entsize = 0;
+}
+
+static void init_symtab_shdr(Elf32_Shdr *shdr, struct Elf *elf)
+{
+  shdr->sh_name  = htonl(strtab_index(&elf->strtab, ".symtab"));
+  shdr->sh_type  = htonl(SHT_SYMTAB);
+  shdr->sh_flags = 0;
+  shdr->sh_addr  = 0;
+  shdr->sh_offset = htonl(elf->symtab_offset);
+  shdr->sh_size = htonl(elf->symnum * sizeof(Elf32_Sym));
+  // The .strtab follows, only the null symbol is local:
+  shdr->sh_link = htonl(elf->symtab_shndx + 1);
+  shdr->sh_info = htonl(1);
+  shdr->sh_addralign = htonl(4);
+  shdr->sh_entsize = htonl(sizeof(Elf32_Sym));
+}
+
+static void init_symstrtab_shdr(Elf32_Shdr *shdr, struct Elf *elf)
+{
+  shdr->sh_name  = htonl(strtab_index(&elf->strtab, ".strtab"));
+  shdr->sh_type  = htonl(SHT_STRTAB);
+  shdr->sh_flags = 0;
+  shdr->sh_addr  = 0;
+  shdr->sh_offset = htonl(elf->symstrtab_offset);
+  shdr->sh_size = htonl(elf->symstrtab->used);
+  shdr->sh_link = 0;
+  shdr->sh_info = 0;
+  shdr->sh_addralign = 0;
+  shdr->sh_entsize = 0;
+}
+
+void create_shdrs(const Dol_Hdr *dhdr, struct Elf *elf)
 {
   elf->shdrs = malloc(sizeof(Elf32_Shdr) * elf->shnum);
 
@@ -127,12 +182,14 @@ void create_shdrs(Dol_Hdr *dhdr, struct Elf *elf)
 
   for (int i=0; i != DOL_TEXT_COUNT; ++i)
     if (dhdr->text_size[i]) {
+      assert(shindex == elf->text_shndx[i]);
       init_text_shdr(dhdr, i, elf->shdrs + shindex, elf);
       ++shindex;
     }
 
   for (int i=0; i != DOL_DATA_COUNT; ++i)
     if (dhdr->data_size[i]) {
+      assert(shindex == elf->data_shndx[i]);
       init_data_shdr(dhdr, i, elf->shdrs + shindex, elf);
       ++shindex;
     }
@@ -144,4 +201,18 @@ void create_shdrs(Dol_Hdr *dhdr, struct Elf *elf)
 
   init_dol_shdr(elf->shdrs + shindex, elf);
   ++shindex;
+
+  if (elf->symnum) {
+    assert(shindex == elf->symtab_shndx);
+    init_symtab_shdr(elf->shdrs + shindex, elf);
+    ++shindex;
+    init_symstrtab_shdr(elf->shdrs + shindex, elf);
+    ++shindex;
+  }
+
+  if (elf->has_note) {
+    init_note_shdr(elf->shdrs + shindex, elf);
+    ++shindex;
+  }
+  assert(shindex == elf->shnum);
 }
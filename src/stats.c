@@ -0,0 +1,213 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "doltool.h"
+
+__thread struct stats_record *stats_record = NULL;
+
+static const char *phase_names[STATS_PHASE_COUNT] = {
+  "convert",
+  "read_header",
+  "prepare",
+  "write_headers",
+  "copy_payload",
+  "cache_lookup",
+  "cache_materialize",
+  "decode",
+};
+
+static const char *counter_names[STATS_COUNTER_COUNT] = {
+  "bytes_read",
+  "bytes_written",
+  "syscalls",
+  "cache_hits",
+  "cache_misses",
+};
+
+static double cpu_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int stats_open(struct stats *stats, const char *trace_filename, int trace_format)
+{
+  memset(stats, 0, sizeof(struct stats));
+  pthread_mutex_init(&stats->lock, NULL);
+  stats->origin = now();
+  stats->trace_format = trace_format;
+  if (trace_filename) {
+    stats->trace = fopen(trace_filename, "w");
+    if (!stats->trace) {
+      fprintf(stderr, "Could not open %s\n", trace_filename);
+      return -1;
+    }
+    if (trace_format == STATS_TRACE_CHROME)
+      fputs("[\n", stats->trace);
+  }
+  return 0;
+}
+
+void stats_close(struct stats *stats)
+{
+  if (stats->trace) {
+    if (stats->trace_format == STATS_TRACE_CHROME)
+      fputs("\n]\n", stats->trace);
+    fclose(stats->trace);
+    stats->trace = NULL;
+  }
+  pthread_mutex_destroy(&stats->lock);
+}
+
+void stats_begin_record(struct stats_record *record, const char *name)
+{
+  memset(record, 0, sizeof(struct stats_record));
+  record->name = name;
+}
+
+void stats_begin(struct stats_record *record, int phase)
+{
+  record->wall_start[phase] = now();
+  record->cpu_start[phase] = cpu_time();
+  if (!record->first[phase])
+    record->first[phase] = record->wall_start[phase];
+}
+
+void stats_end(struct stats_record *record, int phase)
+{
+  record->wall[phase] += now() - record->wall_start[phase];
+  record->cpu[phase] += cpu_time() - record->cpu_start[phase];
+  ++record->calls[phase];
+}
+
+static void json_string(FILE *file, const char *text)
+{
+  fputc('"', file);
+  for (const unsigned char *p = (const unsigned char*) text; *p; ++p) {
+    if (*p == '"' || *p == '\\')
+      fprintf(file, "\\%c", *p);
+    else if (*p < 0x20)
+      fprintf(file, "\\u%04x", *p);
+    else
+      fputc(*p, file);
+  }
+  fputc('"', file);
+}
+
+static void trace_jsonl(struct stats *stats, const struct stats_record *record,
+  int status)
+{
+  FILE *file = stats->trace;
+  fputs("{\"file\":", file);
+  json_string(file, record->name ? record->name : "");
+  fprintf(file, ",\"status\":%i,\"start_us\":%.3f", status,
+    (record->first[STATS_CONVERT] - stats->origin) * 1e6);
+  for (int phase = 0; phase != STATS_PHASE_COUNT; ++phase)
+    if (record->calls[phase])
+      fprintf(file, ",\"%s\":{\"wall_us\":%.3f,\"cpu_us\":%.3f}",
+        phase_names[phase], record->wall[phase] * 1e6, record->cpu[phase] * 1e6);
+  for (int counter = 0; counter != STATS_COUNTER_COUNT; ++counter)
+    fprintf(file, ",\"%s\":%" PRIu64, counter_names[counter],
+      record->counters[counter]);
+  fputs("}\n", file);
+}
+
+// Complete ("X") events, one per phase:
+static void trace_chrome(struct stats *stats, const struct stats_record *record,
+  int status, int tid)
+{
+  FILE *file = stats->trace;
+  for (int phase = 0; phase != STATS_PHASE_COUNT; ++phase) {
+    if (!record->calls[phase])
+      continue;
+    if (stats->events++)
+      fputs(",\n", file);
+    fputs("{\"name\":", file);
+    json_string(file, phase == STATS_CONVERT && record->name ? record->name : phase_names[phase]);
+    fprintf(file, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+      "\"pid\":1,\"tid\":%i,\"args\":{\"cpu_us\":%.3f",
+      phase_names[phase], (record->first[phase] - stats->origin) * 1e6,
+      record->wall[phase] * 1e6, tid, record->cpu[phase] * 1e6);
+    if (phase == STATS_CONVERT) {
+      fprintf(file, ",\"status\":%i", status);
+      for (int counter = 0; counter != STATS_COUNTER_COUNT; ++counter)
+        fprintf(file, ",\"%s\":%" PRIu64, counter_names[counter],
+          record->counters[counter]);
+    }
+    fputs("}}", file);
+  }
+}
+
+void stats_merge(struct stats *stats, const struct stats_record *record, int status)
+{
+  static __thread int tid = 0;
+  static int next_tid = 0;
+  if (!tid)
+    tid = __sync_add_and_fetch(&next_tid, 1);
+
+  pthread_mutex_lock(&stats->lock);
+  ++stats->files;
+  if (status != 0)
+    ++stats->failures;
+  for (int phase = 0; phase != STATS_PHASE_COUNT; ++phase) {
+    stats->wall[phase] += record->wall[phase];
+    stats->cpu[phase] += record->cpu[phase];
+    stats->calls[phase] += record->calls[phase];
+  }
+  for (int counter = 0; counter != STATS_COUNTER_COUNT; ++counter)
+    stats->counters[counter] += record->counters[counter];
+  if (stats->trace) {
+    if (stats->trace_format == STATS_TRACE_CHROME)
+      trace_chrome(stats, record, status, tid);
+    else
+      trace_jsonl(stats, record, status);
+  }
+  pthread_mutex_unlock(&stats->lock);
+}
+
+void stats_print(struct stats *stats, FILE *file)
+{
+  double elapsed = now() - stats->origin;
+  fprintf(file, "%" PRIu64 " files (%" PRIu64 " failed) in %.3fs\n",
+    stats->files, stats->failures, elapsed);
+  fprintf(file, "%-18s %8s %12s %12s\n", "phase", "calls", "wall (ms)", "cpu (ms)");
+  for (int phase = 0; phase != STATS_PHASE_COUNT; ++phase)
+    if (stats->calls[phase])
+      fprintf(file, "%-18s %8" PRIu64 " %12.3f %12.3f\n", phase_names[phase],
+        stats->calls[phase], stats->wall[phase] * 1e3, stats->cpu[phase] * 1e3);
+  for (int counter = 0; counter != STATS_COUNTER_COUNT; ++counter)
+    fprintf(file, "%-18s %" PRIu64 "\n", counter_names[counter],
+      stats->counters[counter]);
+  if (elapsed > 0)
+    fprintf(file, "%.1f MB/s read, %.1f MB/s written\n",
+      stats->counters[STATS_BYTES_READ] / elapsed / 1e6,
+      stats->counters[STATS_BYTES_WRITTEN] / elapsed / 1e6);
+}
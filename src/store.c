@@ -0,0 +1,469 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "doltool.h"
+
+// Segment store: STORE/objects/xx/KEY holds the bytes of a DOL segment,
+// KEY being the 128-bit hash of its contents (xx its first two digits) so
+// that identical segments are stored once. STORE/manifests/NAME.manifest
+// lists the ranges of a DOL file:
+//
+//   dol2elf-manifest 2
+//   size SIZE
+//   hash HASH
+//   options FLAGS ALIGN LEVEL
+//   object OFFSET SIZE KEY
+//   zero OFFSET SIZE
+//
+// The options are the ones of the conversion when the DOL was added, the
+// ELF file is rebuilt with them.
+#define MANIFEST_VERSION 2
+#define STORE_KEY_SEED 0x646f6c32656c6621ULL
+// Files mapped at the same time, the objects stored by the previous
+// batches are found in the store:
+#define STORE_BATCH_FILES 1024
+
+// A mapped input:
+struct store_file {
+  const char *filename;
+  struct dol_file dol;
+  int failed;
+};
+
+// A range of an input, a segment or the bytes around them:
+struct store_range {
+  struct store_file *file;
+  uint64_t offset;
+  uint64_t size;
+  int zero;
+  uint64_t key[2];
+  // Set when this range created its object:
+  int stored;
+};
+
+struct store_pool {
+  const char *dir;
+  struct store_range **ranges;
+  size_t count;
+  size_t next;
+};
+
+static int make_directory(const char *path)
+{
+  return mkdir(path, 0777) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+  const uint64_t *x = a, *y = b;
+  return *x < *y ? -1 : *x > *y;
+}
+
+// The text and data segments, as init_text_shdr() and init_data_shdr()
+// describe them, and the bytes between them. Overlapping segments are cut
+// at each other's boundaries.
+static size_t split_file(struct store_file *file, struct store_range *ranges)
+{
+  uint64_t bounds[2 * (DOL_TEXT_COUNT + DOL_DATA_COUNT) + 2];
+  size_t bound_count = 0;
+  bounds[bound_count++] = 0;
+  bounds[bound_count++] = file->dol.size;
+  struct dol_segment segments[DOL_TEXT_COUNT + DOL_DATA_COUNT];
+  size_t segment_count = dol_segments(&file->dol.dhdr, segments);
+  for (size_t i = 0; i != segment_count; ++i) {
+    bounds[bound_count++] = segments[i].offset;
+    bounds[bound_count++] = (uint64_t) segments[i].offset + segments[i].size;
+  }
+  qsort(bounds, bound_count, sizeof(uint64_t), compare_offsets);
+
+  size_t count = 0;
+  for (size_t i = 0; i + 1 < bound_count; ++i) {
+    if (bounds[i] == bounds[i + 1])
+      continue;
+    struct store_range *range = ranges + count++;
+    memset(range, 0, sizeof(struct store_range));
+    range->file = file;
+    range->offset = bounds[i];
+    range->size = bounds[i + 1] - bounds[i];
+  }
+  return count;
+}
+
+static int all_zeros(const unsigned char *data, uint64_t size)
+{
+  return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+static void *hash_worker(void *arg)
+{
+  struct store_pool *pool = arg;
+  while (1) {
+    size_t i = __sync_fetch_and_add(&pool->next, 1);
+    if (i >= pool->count)
+      return NULL;
+    struct store_range *range = pool->ranges[i];
+    const unsigned char *data = range->file->dol.data + range->offset;
+    // The padding is mostly zeros, not worth an object:
+    if (range->offset >= sizeof(Dol_Hdr) && all_zeros(data, range->size)) {
+      range->zero = 1;
+      continue;
+    }
+    range->key[0] = hash64(data, range->size, 0);
+    range->key[1] = hash64(data, range->size, STORE_KEY_SEED);
+  }
+}
+
+static void object_path(const char *dir, const uint64_t *key, char *path, size_t size)
+{
+  snprintf(path, size, "%s/objects/%02x/%016" PRIx64 "%016" PRIx64, dir,
+    (unsigned) (key[0] >> 56), key[0], key[1]);
+}
+
+// Objects are written aside and renamed, concurrent stores of the same
+// segment write the same bytes:
+static int write_object(const char *dir, const struct store_range *range)
+{
+  char path[PATH_MAX];
+  object_path(dir, range->key, path, sizeof(path));
+  struct stat st;
+  if (stat(path, &st) == 0 && (uint64_t) st.st_size == range->size)
+    return 0;
+  struct aside_file object;
+  if (make_parents(path) != 0 || aside_open(&object, path) != 0)
+    return -1;
+  if (pwrite_all(object.fd, range->file->dol.data + range->offset, range->size, 0) != 0) {
+    aside_abort(&object);
+    return -1;
+  }
+  return aside_commit(&object, path, 0444) == 0 ? 1 : -1;
+}
+
+static void *write_worker(void *arg)
+{
+  struct store_pool *pool = arg;
+  while (1) {
+    size_t i = __sync_fetch_and_add(&pool->next, 1);
+    if (i >= pool->count)
+      return NULL;
+    struct store_range *range = pool->ranges[i];
+    int res = write_object(pool->dir, range);
+    if (res < 0) {
+      fprintf(stderr, "Could not store a segment of %s\n", range->file->filename);
+      range->file->failed = 1;
+    }
+    range->stored = res > 0;
+  }
+}
+
+static void store_pool_run(struct store_pool *pool, void *(*worker)(void*), int threads)
+{
+  pool->next = 0;
+  if ((size_t) threads > pool->count)
+    threads = pool->count ? pool->count : 1;
+  run_pool(pool, worker, threads);
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+  const struct store_range *x = *(struct store_range *const*) a;
+  const struct store_range *y = *(struct store_range *const*) b;
+  if (x->key[0] != y->key[0])
+    return x->key[0] < y->key[0] ? -1 : 1;
+  if (x->key[1] != y->key[1])
+    return x->key[1] < y->key[1] ? -1 : 1;
+  return x < y ? -1 : x > y;
+}
+
+// foo/bar.dol is stored as foo/bar:
+static char *build_name(const char *filename)
+{
+  while (filename[0] == '/' || (filename[0] == '.' && filename[1] == '/'))
+    filename += filename[0] == '/' ? 1 : 2;
+  const char *slash = strrchr(filename, '/');
+  const char *dot = strrchr(filename, '.');
+  size_t length = dot && (!slash || dot > slash) && dot != filename ? (size_t) (dot - filename)
+    : strlen(filename);
+  return strndup(filename, length);
+}
+
+static int manifest_path(const char *dir, const char *name, char **path)
+{
+  if (!*name || strstr(name, "..")) {
+    fprintf(stderr, "Invalid build name %s\n", name);
+    return -1;
+  }
+  return asprintf(path, "%s/manifests/%s.manifest", dir, name) < 0 ? -1 : 0;
+}
+
+static int write_manifest(const char *dir, const struct store_file *file,
+  const struct store_range *ranges, size_t count, const struct dol2elf_options *options)
+{
+  char *name = build_name(file->filename), *path = NULL;
+  int res = -1;
+  if (!name || manifest_path(dir, name, &path) != 0)
+    goto out;
+  struct aside_file aside;
+  if (make_parents(path) != 0 || aside_open(&aside, path) != 0)
+    goto err;
+  // The descriptor is closed by aside_commit():
+  int fd = dup(aside.fd);
+  FILE *manifest = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (!manifest) {
+    if (fd >= 0)
+      close(fd);
+    aside_abort(&aside);
+    goto err;
+  }
+  fprintf(manifest, "dol2elf-manifest %d\nsize %" PRIu64 "\nhash %016" PRIx64 "\n",
+    MANIFEST_VERSION, file->dol.size, hash64(file->dol.data, file->dol.size, 0));
+  fprintf(manifest, "options %u %u %d\n",
+    options->flags, options->align, options->compress_level);
+  for (size_t i = 0; i != count; ++i)
+    if (ranges[i].zero)
+      fprintf(manifest, "zero %" PRIu64 " %" PRIu64 "\n", ranges[i].offset, ranges[i].size);
+    else
+      fprintf(manifest, "object %" PRIu64 " %" PRIu64 " %016" PRIx64 "%016" PRIx64 "\n",
+        ranges[i].offset, ranges[i].size, ranges[i].key[0], ranges[i].key[1]);
+  if (fclose(manifest) != 0) {
+    aside_abort(&aside);
+    goto err;
+  }
+  if (aside_commit(&aside, path, 0644) != 0)
+    goto err;
+  res = 0;
+  goto out;
+
+err:
+  fprintf(stderr, "Could not write manifest %s\n", path);
+out:
+  free(path);
+  free(name);
+  return res;
+}
+
+struct store_totals {
+  size_t added;
+  size_t ranges;
+  size_t stored;
+  uint64_t input_bytes;
+  uint64_t stored_bytes;
+};
+
+static int add_batch(const char *dir, char **filenames, size_t count, int threads,
+  const struct dol2elf_options *options, struct store_totals *totals)
+{
+  struct store_file *files = calloc(count, sizeof(struct store_file));
+  size_t *first_range = calloc(count + 1, sizeof(size_t));
+  struct store_range *ranges = malloc(count * (2 * (DOL_TEXT_COUNT + DOL_DATA_COUNT) + 1)
+    * sizeof(struct store_range));
+  size_t range_count = 0;
+  int res = 0;
+  for (size_t i = 0; i != count; ++i) {
+    files[i].filename = filenames[i];
+    first_range[i] = range_count;
+    if (dol_load(filenames[i], "store", &files[i].dol) != 0)
+      files[i].failed = 1;
+    else
+      range_count += split_file(files + i, ranges + range_count);
+  }
+  first_range[count] = range_count;
+
+  // Hash all the segments, of all the files, in parallel:
+  struct store_range **order = malloc((range_count ? range_count : 1)
+    * sizeof(struct store_range*));
+  for (size_t i = 0; i != range_count; ++i)
+    order[i] = ranges + i;
+  struct store_pool pool = { dir, order, range_count, 0 };
+  store_pool_run(&pool, hash_worker, threads);
+
+  // Sorting the keys finds the duplicates without a shared table:
+  qsort(order, range_count, sizeof(struct store_range*), compare_keys);
+  size_t unique = 0;
+  for (size_t i = 0; i != range_count; ++i) {
+    totals->input_bytes += order[i]->size;
+    if (order[i]->zero || (unique && order[unique - 1]->key[0] == order[i]->key[0]
+        && order[unique - 1]->key[1] == order[i]->key[1]))
+      continue;
+    order[unique++] = order[i];
+  }
+
+  // Then write the objects missing from the store:
+  pool.count = unique;
+  store_pool_run(&pool, write_worker, threads);
+  for (size_t i = 0; i != unique; ++i)
+    if (order[i]->stored) {
+      ++totals->stored;
+      totals->stored_bytes += order[i]->size;
+    }
+  totals->ranges += range_count;
+
+  for (size_t i = 0; i != count; ++i) {
+    if (!files[i].failed && write_manifest(dir, files + i, ranges + first_range[i],
+        first_range[i + 1] - first_range[i], options) != 0)
+      files[i].failed = 1;
+    if (files[i].failed)
+      res = 1;
+    else
+      ++totals->added;
+    dol_release(&files[i].dol);
+  }
+
+  free(order);
+  free(ranges);
+  free(first_range);
+  free(files);
+  return res;
+}
+
+int store_add(const char *dir, char **filenames, size_t count, int threads,
+  const struct dol2elf_options *options)
+{
+  double start = now();
+  char *manifests, *objects;
+  if (asprintf(&manifests, "%s/manifests", dir) < 0)
+    return 1;
+  if (asprintf(&objects, "%s/objects", dir) < 0) {
+    free(manifests);
+    return 1;
+  }
+  int created = make_directory(dir) == 0 && make_directory(manifests) == 0
+    && make_directory(objects) == 0;
+  free(manifests);
+  free(objects);
+  if (!created) {
+    fprintf(stderr, "Could not create store %s\n", dir);
+    return 1;
+  }
+
+  struct store_totals totals;
+  memset(&totals, 0, sizeof(struct store_totals));
+  int res = 0;
+  for (size_t i = 0; i < count; i += STORE_BATCH_FILES) {
+    size_t batch = count - i < STORE_BATCH_FILES ? count - i : STORE_BATCH_FILES;
+    if (add_batch(dir, filenames + i, batch, threads, options, &totals) != 0)
+      res = 1;
+  }
+  fprintf(stderr,
+    "%zu of %zu files added in %.3fs: %zu ranges, %zu new objects "
+    "(%.1f MB stored of %.1f MB)\n",
+    totals.added, count, now() - start, totals.ranges, totals.stored,
+    totals.stored_bytes / 1e6, totals.input_bytes / 1e6);
+  return res;
+}
+
+static int read_object(const char *dir, const char *key, unsigned char *data,
+  uint64_t size)
+{
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/objects/%.2s/%s", dir, key, key);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  uint64_t done = 0;
+  if (fstat(fd, &st) == 0 && (uint64_t) st.st_size == size)
+    while (done != size) {
+      ssize_t count = pread(fd, data + done, size - done, done);
+      if (count <= 0)
+        break;
+      done += count;
+    }
+  close(fd);
+  return done == size ? 0 : -1;
+}
+
+int store_get(const char *dir, const char *name, const char *output_filename,
+  const struct dol2elf_options *options)
+{
+  char *path;
+  if (manifest_path(dir, name, &path) != 0)
+    return 1;
+  FILE *manifest = fopen(path, "r");
+  if (!manifest) {
+    fprintf(stderr, "Could not open %s\n", path);
+    free(path);
+    return 1;
+  }
+
+  struct dol2elf_options conversion = *options;
+  unsigned char *dol = NULL;
+  uint64_t size = 0, hash = 0, covered = 0;
+  int version = 0, res = 1;
+  char *line = NULL;
+  size_t line_size = 0;
+  if (fscanf(manifest, "dol2elf-manifest %d size %" SCNu64 " hash %" SCNx64
+      " options %u %u %d ", &version, &size, &hash,
+      &conversion.flags, &conversion.align, &conversion.compress_level) != 6
+    || version != MANIFEST_VERSION || size > UINT32_MAX
+    || !(dol = calloc(size ? size : 1, 1)))
+    goto invalid;
+  while (getline(&line, &line_size, manifest) > 0) {
+    uint64_t offset, range_size;
+    char key[33];
+    if (sscanf(line, "object %" SCNu64 " %" SCNu64 " %32[0-9a-f]", &offset, &range_size,
+        key) == 3 && strlen(key) == 32) {
+      if (offset != covered || range_size > size - offset)
+        goto invalid;
+      if (read_object(dir, key, dol + offset, range_size) != 0) {
+        fprintf(stderr, "Could not read object %s of %s\n", key, name);
+        goto out;
+      }
+    } else if (sscanf(line, "zero %" SCNu64 " %" SCNu64, &offset, &range_size) == 2) {
+      if (offset != covered || range_size > size - offset)
+        goto invalid;
+    } else {
+      goto invalid;
+    }
+    covered = offset + range_size;
+  }
+  if (covered != size)
+    goto invalid;
+  if (hash64(dol, size, 0) != hash) {
+    fprintf(stderr, "Corrupted store: %s does not match its manifest\n", name);
+    goto out;
+  }
+
+  res = (has_suffix(output_filename, ".elf")
+    ? write_dol_elf(output_filename, dol, size, &conversion)
+    : write_file(output_filename, dol, size)) != 0;
+  goto out;
+
+invalid:
+  fprintf(stderr, "Invalid manifest %s\n", path);
+out:
+  free(line);
+  free(dol);
+  fclose(manifest);
+  free(path);
+  return res;
+}
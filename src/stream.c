@@ -0,0 +1,300 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "doltool.h"
+
+// The only buffer used for the payload, whatever the input size (gzip
+// inputs add a second one for the compressed bytes):
+#define STREAM_BUFFER_SIZE (64*1024)
+
+struct stream {
+  int in_fd;
+  int out_fd;
+  char *buffer;
+  // Bytes consumed from the (decompressed) input and produced on the output:
+  uint64_t in_offset;
+  uint64_t out_offset;
+#ifdef HAVE_ZLIB
+  // Set while inflating a gzip input:
+  unsigned char *gzip_buffer;
+  z_stream gzip;
+  int gzip_end;
+#endif
+};
+
+// Returns the number of bytes read, short at the end of the input:
+static ssize_t read_full(int fd, void *data, size_t size)
+{
+  size_t done = 0;
+  while (done != size) {
+    ssize_t count = read(fd, (char*) data + done, size - done);
+    STATS_ADD(STATS_SYSCALLS, 1);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count < 0)
+      return -1;
+    if (count == 0)
+      break;
+    done += count;
+  }
+  STATS_ADD(STATS_BYTES_READ, done);
+  return done;
+}
+
+#ifdef HAVE_ZLIB
+// The compressed bytes already read (the would-be DOL header) are inflated
+// first:
+static int gzip_begin(struct stream *stream, const void *data, size_t size)
+{
+  stream->gzip_buffer = malloc(STREAM_BUFFER_SIZE);
+  if (!stream->gzip_buffer)
+    return -1;
+  if (inflateInit2(&stream->gzip, 16 + MAX_WBITS) != Z_OK) {
+    free(stream->gzip_buffer);
+    stream->gzip_buffer = NULL;
+    return -1;
+  }
+  memcpy(stream->gzip_buffer, data, size);
+  stream->gzip.next_in = stream->gzip_buffer;
+  stream->gzip.avail_in = size;
+  return 0;
+}
+
+static void gzip_end(struct stream *stream)
+{
+  if (!stream->gzip_buffer)
+    return;
+  inflateEnd(&stream->gzip);
+  free(stream->gzip_buffer);
+  stream->gzip_buffer = NULL;
+}
+
+// Same as read_full() on the decompressed input:
+static ssize_t gzip_read(struct stream *stream, void *data, size_t size)
+{
+  z_stream *gzip = &stream->gzip;
+  gzip->next_out = data;
+  gzip->avail_out = size;
+  while (gzip->avail_out && !stream->gzip_end) {
+    if (gzip->avail_in == 0) {
+      ssize_t count = read_full(stream->in_fd, stream->gzip_buffer, STREAM_BUFFER_SIZE);
+      // Truncated input:
+      if (count <= 0)
+        return -1;
+      gzip->next_in = stream->gzip_buffer;
+      gzip->avail_in = count;
+    }
+    int status = inflate(gzip, Z_NO_FLUSH);
+    if (status == Z_STREAM_END)
+      stream->gzip_end = 1;
+    else if (status != Z_OK)
+      return -1;
+  }
+  return size - gzip->avail_out;
+}
+#endif
+
+static ssize_t stream_read(struct stream *stream, void *data, size_t size)
+{
+#ifdef HAVE_ZLIB
+  if (stream->gzip_buffer)
+    return gzip_read(stream, data, size);
+#endif
+  return read_full(stream->in_fd, data, size);
+}
+
+static int write_full(int fd, const void *data, size_t size)
+{
+  struct iovec iov = { (void*) data, size };
+  return writev_all(fd, &iov, 1);
+}
+
+// Copy (or discard when out is 0) the next size bytes of the input.
+// With size UINT64_MAX, copy up to the end of the input:
+static int stream_copy(struct stream *stream, uint64_t size, int out)
+{
+  while (size) {
+    size_t chunk = size < STREAM_BUFFER_SIZE ? size : STREAM_BUFFER_SIZE;
+    ssize_t count = stream_read(stream, stream->buffer, chunk);
+    if (count < 0)
+      return -1;
+    if (count == 0)
+      return size == UINT64_MAX ? 0 : -1;
+    if (out) {
+      if (write_full(stream->out_fd, stream->buffer, count) != 0)
+        return -1;
+      stream->out_offset += count;
+    }
+    stream->in_offset += count;
+    if (size != UINT64_MAX)
+      size -= count;
+  }
+  return 0;
+}
+
+static int stream_zeros(struct stream *stream, uint64_t size)
+{
+  memset(stream->buffer, 0, size < STREAM_BUFFER_SIZE ? size : STREAM_BUFFER_SIZE);
+  while (size) {
+    size_t chunk = size < STREAM_BUFFER_SIZE ? size : STREAM_BUFFER_SIZE;
+    if (write_full(stream->out_fd, stream->buffer, chunk) != 0)
+      return -1;
+    stream->out_offset += chunk;
+    size -= chunk;
+  }
+  return 0;
+}
+
+// Convert without seeking in the input or the output (pipes):
+// the layout only depends on the DOL header so the ELF headers are written
+// first and the extents then follow in the order of the input.
+int dol2elf_stream(int dol_fd, int elf_fd, const char *dol_filename,
+  const struct dol2elf_options *options)
+{
+  struct Elf elf;
+  memset(&elf, 0, sizeof(struct Elf));
+  struct stream stream;
+  memset(&stream, 0, sizeof(struct stream));
+  stream.in_fd = dol_fd;
+  stream.out_fd = elf_fd;
+
+  if (options && (options->flags & DOL2ELF_NEEDS_DATA)) {
+    fputs("Could not stream a compressed or analysed conversion\n", error_file());
+    return 1;
+  }
+
+  STATS_BEGIN(STATS_READ_HEADER);
+  Dol_Hdr dhdr;
+  ssize_t count = read_full(dol_fd, &dhdr, sizeof(Dol_Hdr));
+  int format = count < 0 ? DECODE_NONE : decode_detect(&dhdr, count);
+#ifdef HAVE_ZLIB
+  // gzip is inflated on the fly, the DOL header is then the start of the
+  // decompressed input:
+  if (format == DECODE_GZIP) {
+    if (gzip_begin(&stream, &dhdr, count) != 0) {
+      fputs("Could not allocate memory\n", error_file());
+      return 1;
+    }
+    count = gzip_read(&stream, &dhdr, sizeof(Dol_Hdr));
+    format = DECODE_NONE;
+  }
+#endif
+  if (format != DECODE_NONE) {
+    fprintf(error_file(), "Could not stream %s input %s\n", decode_name(format),
+      dol_filename);
+    return 1;
+  }
+  if (count != sizeof(Dol_Hdr)) {
+    fprintf(error_file(), "Could not read DOL header in %s\n", dol_filename);
+    goto err;
+  }
+  stream.in_offset = sizeof(Dol_Hdr);
+  STATS_END(STATS_READ_HEADER);
+  if (options && options->diag)
+    dol_dump(&dhdr, options->diag);
+
+  // The input size is unknown, assume it ends with the last segment:
+  STATS_BEGIN(STATS_PREPARE);
+  if (elf_prepare(&dhdr, NULL, dol_extent(&dhdr), options, &elf) != 0) {
+    fprintf(error_file(), "Invalid DOL file %s\n", dol_filename);
+    goto err;
+  }
+  for (size_t i = 1; i < elf.extent_count; ++i)
+    if (elf.extents[i].src_offset < elf.extents[i - 1].src_offset
+      + elf.extents[i - 1].size) {
+      fprintf(error_file(), "Could not stream %s: segments out of order\n",
+        dol_filename);
+      goto err;
+    }
+  stream.buffer = malloc(STREAM_BUFFER_SIZE);
+  if (!stream.buffer) {
+    fputs("Could not allocate memory\n", error_file());
+    goto err;
+  }
+  STATS_END(STATS_PREPARE);
+
+  STATS_BEGIN(STATS_WRITE_HEADERS);
+  struct iovec iov[ELF_HEADERS_IOV_MAX];
+  if (writev_all(elf_fd, iov, elf_headers_iov(&elf, iov)) != 0) {
+    fputs("Could not write ELF headers\n", error_file());
+    goto err;
+  }
+  stream.out_offset = elf.dol_offset;
+  STATS_END(STATS_WRITE_HEADERS);
+
+  // Every layout starts with the DOL header which has already been read:
+  STATS_BEGIN(STATS_COPY_PAYLOAD);
+  const struct elf_extent *first = elf.extents;
+  if (write_full(elf_fd, &dhdr, sizeof(Dol_Hdr)) != 0)
+    goto write_err;
+  stream.out_offset += sizeof(Dol_Hdr);
+  if (first->size > sizeof(Dol_Hdr)
+    && stream_copy(&stream, first->size - sizeof(Dol_Hdr), 1) != 0)
+    goto copy_err;
+
+  for (size_t i = 1; i != elf.extent_count; ++i) {
+    const struct elf_extent *extent = elf.extents + i;
+    if (stream_copy(&stream, extent->src_offset - stream.in_offset, 0) != 0)
+      goto copy_err;
+    if (stream_zeros(&stream, extent->offset - stream.out_offset) != 0)
+      goto write_err;
+    if (stream_copy(&stream, extent->size, 1) != 0)
+      goto copy_err;
+  }
+
+  // The verbatim layout keeps whatever follows the last segment:
+  if (!(options && (options->flags & DOL2ELF_COMPACT))
+    && stream_copy(&stream, UINT64_MAX, 1) != 0)
+    goto copy_err;
+  STATS_END(STATS_COPY_PAYLOAD);
+
+  free(stream.buffer);
+#ifdef HAVE_ZLIB
+  gzip_end(&stream);
+#endif
+  elf_free(&elf);
+  return 0;
+
+copy_err:
+  fputs("Could not copy DOL file into ELF file\n", error_file());
+  goto err;
+write_err:
+  fputs("Could not write ELF file\n", error_file());
+err:
+  free(stream.buffer);
+#ifdef HAVE_ZLIB
+  gzip_end(&stream);
+#endif
+  elf_free(&elf);
+  return 1;
+}
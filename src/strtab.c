@@ -30,30 +30,91 @@ THE SOFTWARE.
 
 #include "doltool.h"
 
+#define STRTAB_MIN_BUCKETS 32
+
+static uint32_t strtab_hash(const char *name, size_t len)
+{
+  // FNV-1a:
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i != len; ++i) {
+    hash ^= (unsigned char) name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
 void strtab_create(struct strtab_info *strtab)
 {
-  strtab->allocated = 64*1024;
+  strtab->allocated = 1;
   strtab->data = malloc(sizeof(char) * strtab->allocated);
   strtab->data[0] = '\0';
   strtab->used = 1;
+  strtab->buckets = NULL;
+  strtab->bucket_count = 0;
+  strtab->count = 0;
 }
 
 void strtab_destroy(struct strtab_info *strtab)
 {
   free(strtab->data);
+  free(strtab->buckets);
+}
+
+static void strtab_insert(struct strtab_entry *buckets, size_t bucket_count,
+  struct strtab_entry entry)
+{
+  size_t mask = bucket_count - 1;
+  size_t i = entry.hash & mask;
+  while (buckets[i].offset)
+    i = (i + 1) & mask;
+  buckets[i] = entry;
+}
+
+// Keep the load factor of the hash table under 1/2:
+static void strtab_rehash(struct strtab_info *strtab, size_t count)
+{
+  size_t bucket_count = strtab->bucket_count ? strtab->bucket_count : STRTAB_MIN_BUCKETS;
+  while (bucket_count < 2 * count)
+    bucket_count *= 2;
+  if (bucket_count == strtab->bucket_count)
+    return;
+
+  struct strtab_entry *buckets = calloc(bucket_count, sizeof(struct strtab_entry));
+  for (size_t i = 0; i != strtab->bucket_count; ++i)
+    if (strtab->buckets[i].offset)
+      strtab_insert(buckets, bucket_count, strtab->buckets[i]);
+  free(strtab->buckets);
+  strtab->buckets = buckets;
+  strtab->bucket_count = bucket_count;
+}
+
+static void strtab_grow(struct strtab_info *strtab, size_t new_allocated)
+{
+  strtab->data = realloc(strtab->data, new_allocated);
+  strtab->allocated = new_allocated;
+}
+
+void strtab_reserve(struct strtab_info *strtab, size_t count, size_t size)
+{
+  if (strtab->used + size > strtab->allocated)
+    strtab_grow(strtab, strtab->used + size);
+  strtab_rehash(strtab, strtab->count + count);
 }
 
 size_t strtab_index(struct strtab_info *strtab, const char *name)
 {
-  size_t count = strtab->used;
   size_t len = strlen(name);
-
-  size_t i = 0;
-  while (i < strtab->used) {
-    if (strcmp(name, strtab->data + i) == 0)
-      return i;
-    else
-      i += strlen(strtab->data + i) + 1;
+  if (len == 0)
+    return 0;
+
+  uint32_t hash = strtab_hash(name, len);
+  if (strtab->bucket_count) {
+    size_t mask = strtab->bucket_count - 1;
+    for (size_t i = hash & mask; strtab->buckets[i].offset; i = (i + 1) & mask) {
+      struct strtab_entry *entry = strtab->buckets + i;
+      if (entry->hash == hash && strcmp(name, strtab->data + entry->offset) == 0)
+        return entry->offset;
+    }
   }
 
   size_t res = strtab->used;
@@ -62,17 +123,118 @@ size_t strtab_index(struct strtab_info *strtab, const char *name)
     size_t new_allocated = strtab->allocated + strtab->allocated/2;
     if (new_allocated < new_used)
       new_allocated = new_used;
-    strtab->data = realloc(strtab->data, new_allocated);
-    strtab->allocated = new_allocated;
+    strtab_grow(strtab, new_allocated);
   }
 
-  memcpy(strtab->data + i, name, len + 1);
+  memcpy(strtab->data + res, name, len + 1);
   strtab->used = new_used;
+
+  strtab_rehash(strtab, strtab->count + 1);
+  struct strtab_entry entry = { hash, res };
+  strtab_insert(strtab->buckets, strtab->bucket_count, entry);
+  ++strtab->count;
   return res;
 }
 
-void strtab_fill(struct strtab_info *strtab, Dol_Hdr *dhdr)
+// Suffix merging:
+
+// Compare the reversed strings:
+static int strtab_compare_reversed(const void *a, const void *b, void *arg)
 {
+  const char *const *names = arg;
+  const char *x = names[*(const size_t*) a];
+  const char *y = names[*(const size_t*) b];
+  size_t i = strlen(x), j = strlen(y);
+  while (i && j) {
+    unsigned char c = x[--i], d = y[--j];
+    if (c != d)
+      return c < d ? -1 : 1;
+  }
+  return i ? 1 : j ? -1 : 0;
+}
+
+static int strtab_is_suffix(const char *suffix, size_t suffix_len,
+  const char *name, size_t len)
+{
+  return suffix_len <= len
+    && memcmp(name + len - suffix_len, suffix, suffix_len) == 0;
+}
+
+void strtab_merge(struct strtab_info *strtab,
+  const char *const *names, size_t count, uint32_t *offsets)
+{
+  // Sorting the reversed strings puts each string right before the strings
+  // it is a suffix of: walking backwards, a string is either stored or is a
+  // suffix of the last stored one.
+  size_t *order = malloc(count * sizeof(size_t));
+  for (size_t i = 0; i != count; ++i)
+    order[i] = i;
+  qsort_r(order, count, sizeof(size_t), strtab_compare_reversed, (void*) names);
+
+  // First pass: exact size of the table.
+  size_t size = 0;
+  const char *last = NULL;
+  size_t last_len = 0;
+  for (size_t i = count; i-- != 0;) {
+    const char *name = names[order[i]];
+    size_t len = strlen(name);
+    if (len == 0 || (last && strtab_is_suffix(name, len, last, last_len)))
+      continue;
+    size += len + 1;
+    last = name;
+    last_len = len;
+  }
+  strtab_reserve(strtab, 0, size);
+
+  // Second pass: store the strings.
+  last = NULL;
+  size_t last_offset = 0;
+  for (size_t i = count; i-- != 0;) {
+    const char *name = names[order[i]];
+    size_t len = strlen(name);
+    if (len == 0) {
+      offsets[order[i]] = 0;
+      continue;
+    }
+    if (last && strtab_is_suffix(name, len, last, last_len)) {
+      offsets[order[i]] = last_offset + last_len - len;
+      continue;
+    }
+    last = name;
+    last_len = len;
+    last_offset = strtab->used;
+    memcpy(strtab->data + strtab->used, name, len + 1);
+    strtab->used += len + 1;
+    offsets[order[i]] = last_offset;
+  }
+
+  free(order);
+}
+
+void strtab_fill(struct strtab_info *strtab, const Dol_Hdr *dhdr, int symtab)
+{
+  // Reserve the exact size of the table:
+  size_t count = 2, size = sizeof(".shstrtab") + sizeof(".dolhdr");
+  if (symtab) {
+    count += 2;
+    size += sizeof(".symtab") + sizeof(".strtab");
+  }
+  for (int i=0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i]) {
+      ++count;
+      size += strlen(text_sections[i]) + 1;
+    }
+  for (int i=0; i != DOL_DATA_COUNT; ++i)
+    if (dhdr->data_size[i]) {
+      ++count;
+      size += strlen(data_sections[i]) + 1;
+    }
+  if (dhdr->bss_size) {
+    ++count;
+    size += sizeof(".bss");
+  }
+  strtab_reserve(strtab, count, size);
+
   for (int i=0; i != DOL_TEXT_COUNT; ++i)
     if (dhdr->text_size[i])
       strtab_index(strtab, text_sections[i]);
@@ -86,4 +248,8 @@ void strtab_fill(struct strtab_info *strtab, Dol_Hdr *dhdr)
 
   strtab_index(strtab, ".shstrtab");
   strtab_index(strtab, ".dolhdr");
+  if (symtab) {
+    strtab_index(strtab, ".symtab");
+    strtab_index(strtab, ".strtab");
+  }
 }
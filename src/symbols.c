@@ -0,0 +1,323 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <arpa/inet.h>
+
+#include <elf.h>
+
+#include "doltool.h"
+
+#define SYMBOLS_MAX_TOKENS 8
+
+static int parse_hex(const char *token, uint32_t *value)
+{
+  if (token[0] == '0' && (token[1] == 'x' || token[1] == 'X'))
+    token += 2;
+  size_t len = strspn(token, "0123456789abcdefABCDEF");
+  if (len == 0 || len > 8 || token[len] != '\0')
+    return -1;
+  *value = strtoul(token, NULL, 16);
+  return 0;
+}
+
+static int is_decimal(const char *token)
+{
+  return token[0] != '\0' && token[strspn(token, "0123456789")] == '\0';
+}
+
+static void symbols_add(struct dol2elf_symbols *symbols, size_t *allocated,
+  uint32_t address, uint32_t size, const char *name)
+{
+  if (name[0] == '\0')
+    return;
+  if (symbols->count == *allocated) {
+    *allocated = *allocated ? 2 * *allocated : 1024;
+    symbols->symbols = realloc(symbols->symbols, *allocated * sizeof(struct symbol));
+  }
+  struct symbol *symbol = symbols->symbols + symbols->count++;
+  symbol->address = address;
+  symbol->size = size;
+  symbol->name = strtab_index(&symbols->names, name);
+}
+
+// Supported lines:
+//  * "address name";
+//  * "address size name";
+//  * CodeWarrior map symbols, "start size vaddr [offset] align name object".
+// Anything else (headers, section summaries, unused symbols) is ignored.
+static void symbols_parse_line(struct dol2elf_symbols *symbols, size_t *allocated,
+  char *line)
+{
+  char *tokens[SYMBOLS_MAX_TOKENS];
+  char *rest[SYMBOLS_MAX_TOKENS];
+  size_t count = 0;
+  char *p = line;
+  while (count != SYMBOLS_MAX_TOKENS) {
+    p += strspn(p, " \t\r");
+    if (*p == '\0')
+      break;
+    rest[count] = p;
+    tokens[count++] = p;
+    p += strcspn(p, " \t\r");
+    if (*p != '\0')
+      *p++ = '\0';
+  }
+
+  uint32_t values[4];
+  if (count < 2 || parse_hex(tokens[0], &values[0]) != 0)
+    return;
+
+  if (count >= 5 && parse_hex(tokens[1], &values[1]) == 0
+    && parse_hex(tokens[2], &values[2]) == 0) {
+    size_t i = 3;
+    if (count >= 6 && parse_hex(tokens[3], &values[3]) == 0 && is_decimal(tokens[4]))
+      ++i;
+    if (!is_decimal(tokens[i]))
+      return;
+    if (++i == count)
+      return;
+    // Skip the section entries:
+    if (tokens[i][0] == '.')
+      return;
+    symbols_add(symbols, allocated, values[2], values[1], tokens[i]);
+  } else if (count == 3 && parse_hex(tokens[1], &values[1]) == 0) {
+    symbols_add(symbols, allocated, values[0], values[1], tokens[2]);
+  } else {
+    // The name is the rest of the line (demangled names have spaces):
+    char *name = rest[1];
+    for (size_t i = 2; i != count; ++i)
+      tokens[i][-1] = ' ';
+    symbols_add(symbols, allocated, values[0], 0, name);
+  }
+}
+
+static int symbols_compare(const void *a, const void *b)
+{
+  const struct symbol *x = a;
+  const struct symbol *y = b;
+  if (x->address != y->address)
+    return x->address < y->address ? -1 : 1;
+  if (x->name != y->name)
+    return x->name < y->name ? -1 : 1;
+  return 0;
+}
+
+struct dol2elf_symbols *dol2elf_symbols_parse(const char *text, size_t size)
+{
+  struct dol2elf_symbols *symbols = calloc(1, sizeof(struct dol2elf_symbols));
+  if (!symbols)
+    return NULL;
+  strtab_create(&symbols->names);
+
+  size_t allocated = 0;
+  size_t line_allocated = 0;
+  char *line = NULL;
+  const char *end = text + size;
+  while (text != end) {
+    const char *eol = memchr(text, '\n', end - text);
+    size_t len = (eol ? eol : end) - text;
+    if (len + 1 > line_allocated) {
+      line_allocated = len + 1;
+      line = realloc(line, line_allocated);
+    }
+    memcpy(line, text, len);
+    line[len] = '\0';
+    symbols_parse_line(symbols, &allocated, line);
+    text = eol ? eol + 1 : end;
+  }
+  free(line);
+
+  qsort(symbols->symbols, symbols->count, sizeof(struct symbol), symbols_compare);
+  symbols->hash = hash64(symbols->names.data, symbols->names.used,
+    hash64(symbols->symbols, symbols->count * sizeof(struct symbol), 0));
+  return symbols;
+}
+
+struct dol2elf_symbols *dol2elf_symbols_load(const char *filename, FILE *diag)
+{
+  FILE *file = fopen(filename, "rb");
+  if (!file) {
+    if (diag)
+      fprintf(diag, "Could not open %s\n", filename);
+    return NULL;
+  }
+  char *text = NULL;
+  size_t size = 0, allocated = 0;
+  while (1) {
+    if (size == allocated) {
+      allocated = allocated ? 2 * allocated : 64 * 1024;
+      text = realloc(text, allocated);
+    }
+    size_t count = fread(text + size, 1, allocated - size, file);
+    size += count;
+    if (count == 0)
+      break;
+  }
+  int error = ferror(file);
+  fclose(file);
+  if (error) {
+    if (diag)
+      fprintf(diag, "Could not read %s\n", filename);
+    free(text);
+    return NULL;
+  }
+  struct dol2elf_symbols *symbols = dol2elf_symbols_parse(text, size);
+  free(text);
+  return symbols;
+}
+
+void dol2elf_symbols_free(struct dol2elf_symbols *symbols)
+{
+  if (!symbols)
+    return;
+  free(symbols->symbols);
+  strtab_destroy(&symbols->names);
+  free(symbols);
+}
+
+size_t dol2elf_symbols_count(const struct dol2elf_symbols *symbols)
+{
+  return symbols->count;
+}
+
+// ***** .symtab
+
+struct interval {
+  uint32_t start;
+  uint32_t end;
+  uint16_t shndx;
+  unsigned char type;
+};
+
+static int interval_compare(const void *a, const void *b)
+{
+  const struct interval *x = a;
+  const struct interval *y = b;
+  return x->start < y->start ? -1 : x->start > y->start ? 1 : 0;
+}
+
+static size_t collect_intervals(const Dol_Hdr *dhdr, const struct Elf *elf,
+  struct interval *intervals)
+{
+  size_t count = 0;
+  for (int i=0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i]) {
+      struct interval interval = {
+        ntohl(dhdr->text_address[i]),
+        ntohl(dhdr->text_address[i]) + ntohl(dhdr->text_size[i]),
+        elf->text_shndx[i], STT_FUNC };
+      intervals[count++] = interval;
+    }
+  for (int i=0; i != DOL_DATA_COUNT; ++i)
+    if (dhdr->data_size[i]) {
+      struct interval interval = {
+        ntohl(dhdr->data_address[i]),
+        ntohl(dhdr->data_address[i]) + ntohl(dhdr->data_size[i]),
+        elf->data_shndx[i], STT_OBJECT };
+      intervals[count++] = interval;
+    }
+  if (dhdr->bss_size) {
+    struct interval interval = {
+      ntohl(dhdr->bss_address),
+      ntohl(dhdr->bss_address) + ntohl(dhdr->bss_size),
+      elf->bss_shndx, STT_OBJECT };
+    intervals[count++] = interval;
+  }
+  qsort(intervals, count, sizeof(struct interval), interval_compare);
+  return count;
+}
+
+// Last interval starting at or before the address, if it contains it:
+static const struct interval *find_interval(const struct interval *intervals,
+  size_t count, uint32_t address)
+{
+  size_t low = 0, high = count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (intervals[middle].start <= address)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (low == 0 || address >= intervals[low - 1].end)
+    return NULL;
+  return intervals + low - 1;
+}
+
+void create_symtab(const Dol_Hdr *dhdr, const struct dol2elf_symbols *symbols,
+  unsigned flags, struct Elf *elf)
+{
+  struct interval intervals[DOL_TEXT_COUNT + DOL_DATA_COUNT + 1];
+  size_t interval_count = collect_intervals(dhdr, elf, intervals);
+
+  // Symbol names:
+  uint32_t *names = NULL;
+  if (flags & DOL2ELF_MERGE_STRINGS) {
+    const char **strings = malloc(symbols->count * sizeof(const char*));
+    names = malloc(symbols->count * sizeof(uint32_t));
+    for (size_t i = 0; i != symbols->count; ++i)
+      strings[i] = symbols->names.data + symbols->symbols[i].name;
+    strtab_create(&elf->merged_symstrtab);
+    strtab_merge(&elf->merged_symstrtab, strings, symbols->count, names);
+    free(strings);
+    elf->symstrtab = &elf->merged_symstrtab;
+  } else {
+    elf->symstrtab = &symbols->names;
+  }
+
+  // The first symbol is the null symbol:
+  elf->symnum = symbols->count + 1;
+  elf->syms = calloc(elf->symnum, sizeof(Elf32_Sym));
+
+  for (size_t i = 0; i != symbols->count; ++i) {
+    const struct symbol *symbol = symbols->symbols + i;
+    Elf32_Sym *sym = elf->syms + i + 1;
+    const struct interval *interval =
+      find_interval(intervals, interval_count, symbol->address);
+
+    uint32_t size = symbol->size;
+    if (size == 0 && interval) {
+      // Unknown size: extend up to the next symbol or the end of the section.
+      uint32_t end = interval->end;
+      for (size_t j = i + 1; j != symbols->count; ++j)
+        if (symbols->symbols[j].address != symbol->address) {
+          if (symbols->symbols[j].address < end)
+            end = symbols->symbols[j].address;
+          break;
+        }
+      size = end - symbol->address;
+    }
+
+    sym->st_name  = htonl(names ? names[i] : symbol->name);
+    sym->st_value = htonl(symbol->address);
+    sym->st_size  = htonl(size);
+    sym->st_info  = ELF32_ST_INFO(STB_GLOBAL, interval ? interval->type : STT_NOTYPE);
+    sym->st_other = STV_DEFAULT;
+    sym->st_shndx = htons(interval ? interval->shndx : SHN_ABS);
+  }
+
+  free(names);
+}
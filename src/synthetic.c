@@ -0,0 +1,59 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Synthetic DOL files for the benchmark and the tests.
+
+#include <arpa/inet.h>
+
+#include "doltool.h"
+
+// Each segment starts where the previous one ended, in the file and in
+// memory:
+void synthetic_add_text(Dol_Hdr *dhdr, int i, uint32_t size,
+  uint32_t *file_offset, uint32_t *vaddr)
+{
+  dhdr->text_offset[i] = htonl(*file_offset);
+  dhdr->text_address[i] = htonl(*vaddr);
+  dhdr->text_size[i] = htonl(size);
+  *file_offset += size;
+  *vaddr += size;
+}
+
+void synthetic_add_data(Dol_Hdr *dhdr, int i, uint32_t size,
+  uint32_t *file_offset, uint32_t *vaddr)
+{
+  dhdr->data_offset[i] = htonl(*file_offset);
+  dhdr->data_address[i] = htonl(*vaddr);
+  dhdr->data_size[i] = htonl(size);
+  *file_offset += size;
+  *vaddr += size;
+}
+
+// xorshift32, state must not be 0:
+uint32_t synthetic_random(uint32_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
@@ -0,0 +1,297 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "doltool.h"
+
+struct range {
+  uint64_t start;
+  uint64_t end;
+};
+
+static int compare_ranges(const void *a, const void *b)
+{
+  const struct range *x = a, *y = b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// The header and the padding between the segments:
+static uint64_t hash_rest(const Dol_Hdr *dhdr, const unsigned char *dol,
+  uint64_t dol_size)
+{
+  struct range ranges[DOL_TEXT_COUNT + DOL_DATA_COUNT];
+  size_t count = 0;
+  for (int i = 0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i]) {
+      uint64_t start = ntohl(dhdr->text_offset[i]);
+      struct range range = { start, start + ntohl(dhdr->text_size[i]) };
+      ranges[count++] = range;
+    }
+  for (int i = 0; i != DOL_DATA_COUNT; ++i)
+    if (dhdr->data_size[i]) {
+      uint64_t start = ntohl(dhdr->data_offset[i]);
+      struct range range = { start, start + ntohl(dhdr->data_size[i]) };
+      ranges[count++] = range;
+    }
+  qsort(ranges, count, sizeof(struct range), compare_ranges);
+
+  uint64_t hash = 0, position = 0;
+  for (size_t i = 0; i != count; ++i) {
+    if (ranges[i].start > position)
+      hash = hash64(dol + position, ranges[i].start - position, hash);
+    if (ranges[i].end > position)
+      position = ranges[i].end;
+  }
+  if (position < dol_size)
+    hash = hash64(dol + position, dol_size - position, hash);
+  return hash;
+}
+
+int note_fill(const Dol_Hdr *dhdr, const void *dol, uint64_t dol_size,
+  const struct dol2elf_options *options, struct elf_note *note)
+{
+  const unsigned char *data = dol;
+  if (dol_extent(dhdr) > dol_size)
+    return -1;
+
+  memset(note, 0, sizeof(struct elf_note));
+  note->nhdr.n_namesz = htonl(sizeof(ELF_NOTE_NAME));
+  note->nhdr.n_descsz = htonl(sizeof(struct elf_note) - offsetof(struct elf_note, options));
+  note->nhdr.n_type = htonl(NT_DOL2ELF_HASHES);
+  memcpy(note->name, ELF_NOTE_NAME, sizeof(ELF_NOTE_NAME));
+
+  // Options changing the payload without changing the headers:
+  uint64_t fields[3] = { options->flags, options->align, options->compress_level };
+  note->options = htobe64(hash64(fields, sizeof(fields), 0));
+  note->rest = htobe64(hash_rest(dhdr, data, dol_size));
+  for (int i = 0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i])
+      note->text[i] = htobe64(hash64(data + ntohl(dhdr->text_offset[i]),
+        ntohl(dhdr->text_size[i]), 0));
+  for (int i = 0; i != DOL_DATA_COUNT; ++i)
+    if (dhdr->data_size[i])
+      note->data[i] = htobe64(hash64(data + ntohl(dhdr->data_offset[i]),
+        ntohl(dhdr->data_size[i]), 0));
+  return 0;
+}
+
+static int pread_all(int fd, void *data, size_t size, off_t offset)
+{
+  char *buffer = data;
+  while (size) {
+    ssize_t count = pread(fd, buffer, size, offset);
+    STATS_ADD(STATS_SYSCALLS, 1);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return -1;
+    STATS_ADD(STATS_BYTES_READ, count);
+    buffer += count;
+    size -= count;
+    offset += count;
+  }
+  return 0;
+}
+
+static int write_segment(int elf_fd, const struct Elf *elf, const unsigned char *dol,
+  const struct compressed *blob, uint32_t src_offset, uint32_t size, uint32_t offset)
+{
+  if (elf->compressed)
+    return pwrite_all(elf_fd, blob->data, blob->size, offset);
+  return pwrite_all(elf_fd, dol + src_offset, size, offset);
+}
+
+// Patch the segments whose hash changed when the headers are the same.
+// Returns 1 when the file has to be rewritten.
+static int update_in_place(int elf_fd, struct Elf *elf, const Dol_Hdr *dhdr,
+  const unsigned char *dol, FILE *diag)
+{
+  struct stat st;
+  if (fstat(elf_fd, &st) != 0 || (uint64_t) st.st_size != elf->size)
+    return 1;
+
+  // Headers and tables up to the hashes of the note:
+  size_t compared = elf->note_offset + offsetof(struct elf_note, rest);
+  unsigned char *headers = malloc(2 * (size_t) elf->dol_offset);
+  unsigned char *old = headers + elf->dol_offset;
+  struct iovec iov[ELF_HEADERS_IOV_MAX];
+  int count = elf_headers_iov(elf, iov);
+  size_t size = 0;
+  for (int i = 0; i != count; ++i) {
+    memcpy(headers + size, iov[i].iov_base, iov[i].iov_len);
+    size += iov[i].iov_len;
+  }
+  if (pread_all(elf_fd, old, elf->dol_offset, 0) != 0
+    || memcmp(headers, old, compared) != 0) {
+    free(headers);
+    return 1;
+  }
+  struct elf_note old_note;
+  memcpy(&old_note, old + elf->note_offset, sizeof(struct elf_note));
+  free(headers);
+
+  size_t changed = 0, total = 0;
+  int res = 0;
+  // The whole DOL with the default layout, its header otherwise:
+  int rest_changed = old_note.rest != elf->note.rest;
+  int whole = rest_changed && elf->extent_count == 1;
+  if (rest_changed) {
+    const struct elf_extent *extent = elf->extents;
+    res |= pwrite_all(elf_fd, dol + extent->src_offset, extent->size, extent->offset);
+  }
+  for (int i = 0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i]) {
+      ++total;
+      if (old_note.text[i] == elf->note.text[i])
+        continue;
+      ++changed;
+      if (!whole)
+        res |= write_segment(elf_fd, elf, dol, elf->text_compressed + i,
+          ntohl(dhdr->text_offset[i]), ntohl(dhdr->text_size[i]), elf->text_offset[i]);
+    }
+  for (int i = 0; i != DOL_DATA_COUNT; ++i)
+    if (dhdr->data_size[i]) {
+      ++total;
+      if (old_note.data[i] == elf->note.data[i])
+        continue;
+      ++changed;
+      if (!whole)
+        res |= write_segment(elf_fd, elf, dol, elf->data_compressed + i,
+          ntohl(dhdr->data_offset[i]), ntohl(dhdr->data_size[i]), elf->data_offset[i]);
+    }
+  // The note last: an interrupted update is redone next time.
+  if (res != 0 || pwrite_all(elf_fd, &elf->note, sizeof(struct elf_note), elf->note_offset) != 0)
+    return -1;
+  if (diag)
+    fprintf(diag, "Updated %zu of %zu segments in place%s\n", changed, total,
+      rest_changed ? " and the DOL header" : "");
+  return 0;
+}
+
+// Convert into a temporary file next to the ELF file and rename it:
+static int rewrite(int dol_fd, const char *dol_filename, const char *elf_filename,
+  const struct dol2elf_options *options, const struct rel_options *rel)
+{
+  struct stat st;
+  mode_t mode = stat(elf_filename, &st) == 0 ? st.st_mode & 07777 : creation_mode();
+  struct aside_file elf;
+  if (aside_open(&elf, elf_filename) != 0) {
+    fprintf(error_file(), "Could not create a temporary file for %s\n", elf_filename);
+    return 1;
+  }
+  if (dol2elf_fd(dol_fd, elf.fd, dol_filename, options, rel) != 0) {
+    aside_abort(&elf);
+    return 1;
+  }
+  if (aside_commit(&elf, elf_filename, mode) != 0) {
+    fprintf(error_file(), "Could not write %s\n", elf_filename);
+    return 1;
+  }
+  return 0;
+}
+
+int dol2elf_update(const char *dol_filename, const char *elf_filename,
+  const struct dol2elf_options *options, const struct rel_options *rel)
+{
+  struct dol2elf_options incremental;
+  memset(&incremental, 0, sizeof(incremental));
+  if (options)
+    incremental = *options;
+  incremental.flags |= DOL2ELF_INCREMENTAL;
+  struct Elf elf;
+  memset(&elf, 0, sizeof(struct Elf));
+  struct dol_mapping mapping;
+  memset(&mapping, 0, sizeof(struct dol_mapping));
+
+  int dol_fd = open(dol_filename, O_RDONLY | O_CLOEXEC);
+  if (dol_fd < 0) {
+    fprintf(error_file(), "Could not open %s\n", dol_filename);
+    return 1;
+  }
+  int res = 1;
+  struct dol_source source;
+  Dol_Hdr dhdr;
+  if (dol_locate(dol_fd, dol_filename, &source, &dhdr) != 0)
+    goto out;
+
+  // Compressed inputs and REL modules are always rewritten:
+  int elf_fd = -1;
+  if (source.format == DECODE_NONE && !source.rel) {
+    STATS_BEGIN(STATS_PREPARE);
+    if (dol_map(dol_fd, &source, &mapping) != 0) {
+      fprintf(error_file(), "Could not map %s\n", dol_filename);
+      goto out;
+    }
+    if (elf_prepare(&dhdr, mapping.data, source.size, &incremental, &elf) != 0) {
+      fprintf(error_file(), "Invalid DOL file %s\n", dol_filename);
+      goto out;
+    }
+    STATS_END(STATS_PREPARE);
+    elf_fd = open(elf_filename, O_RDWR | O_CLOEXEC);
+  }
+  if (elf_fd >= 0) {
+    if (options && options->diag)
+      dol_dump(&dhdr, options->diag);
+    STATS_BEGIN(STATS_COPY_PAYLOAD);
+    res = update_in_place(elf_fd, &elf, &dhdr, mapping.data,
+      options ? options->diag : NULL);
+    STATS_END(STATS_COPY_PAYLOAD);
+    if (close(elf_fd) != 0 && res == 0)
+      res = -1;
+    if (res == 0)
+      goto out;
+    incremental.diag = NULL;
+  }
+  // The layout changed, or there is no previous ELF file:
+  res = rewrite(dol_fd, dol_filename, elf_filename, &incremental, rel);
+
+out:
+  elf_free(&elf);
+  dol_unmap(&mapping);
+  close(dol_fd);
+  return res;
+}
+
+int dol2elf_replace(const char *dol_filename, const char *elf_filename,
+  const struct dol2elf_options *options, const struct rel_options *rel)
+{
+  int dol_fd = open(dol_filename, O_RDONLY | O_CLOEXEC);
+  if (dol_fd < 0) {
+    fprintf(error_file(), "Could not open %s\n", dol_filename);
+    return 1;
+  }
+  int res = rewrite(dol_fd, dol_filename, elf_filename, options, rel);
+  close(dol_fd);
+  return res;
+}
@@ -0,0 +1,360 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "doltool.h"
+
+// Size of each registered buffer:
+#define URING_BUFFER_SIZE (1024*1024)
+// Buffers used by one copy: a chunk is read while the previous one is
+// written:
+#define URING_COPY_BUFFERS 2
+
+struct uring *io_ring;
+
+// Completion of a submitted operation:
+struct uring_op {
+  int res;
+  int done;
+};
+
+// A read linked to the write of the same registered buffer:
+struct uring_chunk {
+  struct uring_op read;
+  struct uring_op write;
+  unsigned buffer;
+  uint32_t size;
+  int busy;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+  unsigned flags)
+{
+  STATS_ADD(STATS_SYSCALLS, 1);
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned count)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+int uring_open(struct uring *ring, unsigned depth)
+{
+  memset(ring, 0, sizeof(struct uring));
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->cond, NULL);
+  if (depth < URING_COPY_BUFFERS)
+    depth = URING_COPY_BUFFERS;
+
+  // Every buffer may have a read and a write in flight:
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = uring_setup(2 * depth, &params);
+  if (ring->fd < 0)
+    goto err;
+
+  ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size > ring->sq_size)
+      ring->sq_size = ring->cq_size;
+    ring->cq_size = ring->sq_size;
+  }
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ptr = ring->sq_ptr;
+  if (ring->sq_ptr != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED)
+    goto err;
+
+  char *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+  ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+  ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+  // Registered buffers are pinned once instead of at each operation:
+  ring->buffer_count = depth;
+  ring->buffers = mmap(NULL, (size_t) depth * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->buffers == MAP_FAILED)
+    goto err;
+  struct iovec *iov = calloc(depth, sizeof(struct iovec));
+  ring->free_buffers = calloc(depth, sizeof(unsigned));
+  for (unsigned i = 0; i != depth; ++i) {
+    iov[i].iov_base = ring->buffers + (size_t) i * URING_BUFFER_SIZE;
+    iov[i].iov_len = URING_BUFFER_SIZE;
+    ring->free_buffers[i] = i;
+  }
+  ring->free_count = depth;
+  int res = uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, depth);
+  free(iov);
+  if (res != 0)
+    goto err;
+  return 0;
+
+err:
+  uring_close(ring);
+  return -1;
+}
+
+void uring_close(struct uring *ring)
+{
+  if (ring->buffers && ring->buffers != MAP_FAILED)
+    munmap(ring->buffers, (size_t) ring->buffer_count * URING_BUFFER_SIZE);
+  free(ring->free_buffers);
+  if (ring->sqes && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+    munmap(ring->cq_ptr, ring->cq_size);
+  if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+    munmap(ring->sq_ptr, ring->sq_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  pthread_mutex_destroy(&ring->lock);
+  pthread_cond_destroy(&ring->cond);
+  memset(ring, 0, sizeof(struct uring));
+}
+
+// With the lock held:
+static struct io_uring_sqe *get_sqe(struct uring *ring, struct uring_op *op)
+{
+  unsigned tail = *ring->sq_tail + ring->pending;
+  unsigned index = tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = ring->sqes + index;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->user_data = (uintptr_t) op;
+  ring->sq_array[index] = index;
+  ++ring->pending;
+  op->done = 0;
+  return sqe;
+}
+
+// With the lock held:
+static void reap(struct uring *ring)
+{
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    const struct io_uring_cqe *cqe = ring->cqes + (head & ring->cq_mask);
+    struct uring_op *op = (struct uring_op*) (uintptr_t) cqe->user_data;
+    op->res = cqe->res;
+    op->done = 1;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Entries the kernel did not consume are taken back out of the ring and
+// their operations completed with -ECANCELED: the next submission would
+// otherwise send them with user_data pointing to released operations.
+// Only the threads holding the lock submit, the reaping thread enters the
+// kernel without entries to submit. With the lock held:
+static int submit(struct uring *ring)
+{
+  unsigned count = ring->pending;
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+  ring->pending = 0;
+  while (count) {
+    int res = uring_enter(ring->fd, count, 0, 0);
+    if (res < 0 && errno == EINTR)
+      continue;
+    // The completion queue is full: make room for the new entries.
+    if (res < 0 && (errno == EAGAIN || errno == EBUSY)) {
+      reap(ring);
+      pthread_cond_broadcast(&ring->cond);
+      continue;
+    }
+    if (res <= 0)
+      break;
+    count -= res;
+  }
+  if (!count)
+    return 0;
+
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  for (unsigned tail = *ring->sq_tail; head != tail; ++head) {
+    const struct io_uring_sqe *sqe = ring->sqes + ring->sq_array[head & ring->sq_mask];
+    struct uring_op *op = (struct uring_op*) (uintptr_t) sqe->user_data;
+    op->res = -ECANCELED;
+    op->done = 1;
+  }
+  __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+  return -1;
+}
+
+// The ring is shared by the threads of a batch: one of the waiting threads
+// collects the completions for all of them.
+static void wait_op(struct uring *ring, struct uring_op *op)
+{
+  pthread_mutex_lock(&ring->lock);
+  while (!op->done) {
+    if (ring->reaping) {
+      pthread_cond_wait(&ring->cond, &ring->lock);
+      continue;
+    }
+    ring->reaping = 1;
+    pthread_mutex_unlock(&ring->lock);
+    uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+    pthread_mutex_lock(&ring->lock);
+    reap(ring);
+    ring->reaping = 0;
+    pthread_cond_broadcast(&ring->cond);
+  }
+  pthread_mutex_unlock(&ring->lock);
+}
+
+int uring_pwritev(struct uring *ring, int fd, const struct iovec *iov, int iovcnt,
+  off_t offset)
+{
+  size_t size = 0;
+  for (int i = 0; i != iovcnt; ++i)
+    size += iov[i].iov_len;
+
+  struct uring_op op;
+  pthread_mutex_lock(&ring->lock);
+  struct io_uring_sqe *sqe = get_sqe(ring, &op);
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) iov;
+  sqe->len = iovcnt;
+  sqe->off = offset;
+  submit(ring);
+  pthread_mutex_unlock(&ring->lock);
+
+  // Returns at once when the write was not submitted:
+  wait_op(ring, &op);
+  if (op.res < 0 || (size_t) op.res != size)
+    return -1;
+  STATS_ADD(STATS_BYTES_WRITTEN, size);
+  return 0;
+}
+
+static void submit_chunk(struct uring *ring, struct uring_chunk *chunk,
+  int in_fd, off_t in_offset, int out_fd, off_t out_offset)
+{
+  char *buffer = ring->buffers + (size_t) chunk->buffer * URING_BUFFER_SIZE;
+
+  struct io_uring_sqe *sqe = get_sqe(ring, &chunk->read);
+  sqe->opcode = IORING_OP_READ_FIXED;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->fd = in_fd;
+  sqe->addr = (uintptr_t) buffer;
+  sqe->len = chunk->size;
+  sqe->off = in_offset;
+  sqe->buf_index = chunk->buffer;
+
+  // Only runs once the read is complete, cancelled if it is short:
+  sqe = get_sqe(ring, &chunk->write);
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = out_fd;
+  sqe->addr = (uintptr_t) buffer;
+  sqe->len = chunk->size;
+  sqe->off = out_offset;
+  sqe->buf_index = chunk->buffer;
+  chunk->busy = 1;
+}
+
+// Double-buffered copy: the next chunk is read while the previous one is
+// written.
+int uring_copy(struct uring *ring, int in_fd, off_t in_offset, int out_fd,
+  off_t out_offset, uint64_t count)
+{
+  struct uring_chunk chunks[URING_COPY_BUFFERS];
+  memset(chunks, 0, sizeof(chunks));
+
+  pthread_mutex_lock(&ring->lock);
+  while (ring->free_count < URING_COPY_BUFFERS)
+    pthread_cond_wait(&ring->cond, &ring->lock);
+  for (int i = 0; i != URING_COPY_BUFFERS; ++i)
+    chunks[i].buffer = ring->free_buffers[--ring->free_count];
+  pthread_mutex_unlock(&ring->lock);
+
+  int res = 0;
+  uint64_t submitted = 0;
+  size_t next = 0;
+  while (1) {
+    // Keep all the buffers busy:
+    pthread_mutex_lock(&ring->lock);
+    for (int i = 0; i != URING_COPY_BUFFERS && res == 0 && submitted != count; ++i) {
+      struct uring_chunk *chunk = chunks + (next + i) % URING_COPY_BUFFERS;
+      if (chunk->busy)
+        continue;
+      uint64_t left = count - submitted;
+      chunk->size = left < URING_BUFFER_SIZE ? left : URING_BUFFER_SIZE;
+      submit_chunk(ring, chunk, in_fd, in_offset + submitted, out_fd,
+        out_offset + submitted);
+      submitted += chunk->size;
+    }
+    // The chunks which were not submitted are completed as cancelled, the
+    // others are still waited for before their buffers are released:
+    if (ring->pending && submit(ring) != 0)
+      res = -1;
+    pthread_mutex_unlock(&ring->lock);
+
+    // Oldest chunk first:
+    struct uring_chunk *chunk = chunks + next;
+    if (!chunk->busy)
+      break;
+    wait_op(ring, &chunk->read);
+    wait_op(ring, &chunk->write);
+    chunk->busy = 0;
+    if (chunk->read.res != (int) chunk->size || chunk->write.res != (int) chunk->size)
+      res = -1;
+    else {
+      STATS_ADD(STATS_BYTES_READ, chunk->size);
+      STATS_ADD(STATS_BYTES_WRITTEN, chunk->size);
+    }
+    next = (next + 1) % URING_COPY_BUFFERS;
+  }
+
+  pthread_mutex_lock(&ring->lock);
+  for (int i = 0; i != URING_COPY_BUFFERS; ++i)
+    ring->free_buffers[ring->free_count++] = chunks[i].buffer;
+  pthread_cond_broadcast(&ring->cond);
+  pthread_mutex_unlock(&ring->lock);
+  return res;
+}
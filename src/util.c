@@ -22,11 +22,105 @@ THE SOFTWARE.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <arpa/inet.h> // byteorder
 
 #include "doltool.h"
 
+__thread FILE *error_stream = NULL;
+
+FILE *error_file(void)
+{
+  return error_stream ? error_stream : stderr;
+}
+
+// Case-insensitive, so that foo.ELF is an ELF file:
+int has_suffix(const char *filename, const char *suffix)
+{
+  size_t length = strlen(filename), suffix_length = strlen(suffix);
+  return length >= suffix_length
+    && strcasecmp(filename + length - suffix_length, suffix) == 0;
+}
+
+// The umask is read from /proc: setting it to read it back would race with
+// the files created by the other threads.
+mode_t creation_mode(void)
+{
+  unsigned mask = 022;
+  FILE *status = fopen("/proc/self/status", "re");
+  if (status) {
+    char line[256];
+    while (fgets(line, sizeof(line), status))
+      if (sscanf(line, "Umask: %o", &mask) == 1)
+        break;
+    fclose(status);
+  }
+  return 0666 & ~mask;
+}
+
+int make_parents(char *path)
+{
+  for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    int res = mkdir(path, 0777);
+    *slash = '/';
+    if (res != 0 && errno != EEXIST)
+      return -1;
+  }
+  return 0;
+}
+
+double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The calling thread is the last worker:
+int run_pool(void *pool, void *(*worker)(void *pool), int threads)
+{
+  if (threads < 1)
+    threads = 1;
+  pthread_t *workers = calloc(threads, sizeof(pthread_t));
+  int started = 0;
+  for (int i = 0; workers && i < threads - 1; ++i) {
+    if (pthread_create(&workers[i], NULL, worker, pool) != 0)
+      break;
+    ++started;
+  }
+  worker(pool);
+  for (int i = 0; i != started; ++i)
+    pthread_join(workers[i], NULL);
+  free(workers);
+  return started + 1;
+}
+
+size_t dol_segments(const Dol_Hdr *dhdr, struct dol_segment *segments)
+{
+  size_t count = 0;
+  for (int i = 0; i != DOL_TEXT_COUNT; ++i)
+    if (dhdr->text_size[i]) {
+      struct dol_segment segment = { text_sections[i], ntohl(dhdr->text_offset[i]),
+        ntohl(dhdr->text_address[i]), ntohl(dhdr->text_size[i]) };
+      segments[count++] = segment;
+    }
+  for (int i = 0; i != DOL_DATA_COUNT; ++i)
+    if (dhdr->data_size[i]) {
+      struct dol_segment segment = { data_sections[i], ntohl(dhdr->data_offset[i]),
+        ntohl(dhdr->data_address[i]), ntohl(dhdr->data_size[i]) };
+      segments[count++] = segment;
+    }
+  return count;
+}
+
 int dol_dump(const Dol_Hdr *header, FILE *file)
 {
   // Dump text
@@ -56,6 +150,7 @@ int dol_dump(const Dol_Hdr *header, FILE *file)
   fprintf(file,
     "Entry point: 0x%" PRIx32 "\n",
     ntohl(header->entry_point));
+  return 0;
 }
 
 const char* text_sections[DOL_TEXT_COUNT] = {
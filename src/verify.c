@@ -0,0 +1,413 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include <elf.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "doltool.h"
+
+#ifndef ELFCOMPRESS_ZSTD
+#define ELFCOMPRESS_ZSTD 2
+#endif
+
+// Larger regions are split between the threads of a file:
+#define VERIFY_CHUNK_SIZE (1 << 20)
+
+// Bytes of the ELF file compared with bytes of the DOL:
+struct verify_chunk {
+  const char *kind;
+  const char *name;
+  const unsigned char *elf;
+  const unsigned char *dol;
+  size_t size;
+  uint64_t elf_offset;
+  // Size of the section with its Elf32_Chdr, 0 when not compressed:
+  size_t compressed_size;
+  // 1 when the bytes differ, -1 when they could not be decompressed:
+  int res;
+};
+
+struct verify {
+  const char *elf_filename;
+  struct dol_file dol;
+  const unsigned char *elf;
+  uint64_t elf_size;
+  const Elf32_Shdr *shdrs;
+  size_t shnum;
+  const char *shstrtab;
+  uint32_t shstrtab_size;
+  struct verify_chunk *chunks;
+  size_t chunk_count;
+  size_t allocated;
+  size_t next;
+  unsigned problems;
+};
+
+// One line per problem, in a single write so that the files verified in
+// parallel do not mix their messages:
+static void report(struct verify *verify, const char *format, ...)
+{
+  char message[256];
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(message, sizeof(message), format, ap);
+  va_end(ap);
+  fprintf(error_file(), "%s: %s\n", verify->elf_filename, message);
+  ++verify->problems;
+}
+
+static int in_elf(const struct verify *verify, uint64_t offset, uint64_t size)
+{
+  return offset <= verify->elf_size && size <= verify->elf_size - offset;
+}
+
+static struct verify_chunk *add_chunk(struct verify *verify, const char *kind,
+  const char *name, uint64_t elf_offset, const unsigned char *dol, size_t size)
+{
+  if (verify->chunk_count == verify->allocated) {
+    verify->allocated = verify->allocated ? verify->allocated * 2 : 32;
+    verify->chunks = realloc(verify->chunks,
+      verify->allocated * sizeof(struct verify_chunk));
+  }
+  struct verify_chunk *chunk = verify->chunks + verify->chunk_count++;
+  memset(chunk, 0, sizeof(struct verify_chunk));
+  chunk->kind = kind;
+  chunk->name = name;
+  chunk->elf = verify->elf + elf_offset;
+  chunk->dol = dol;
+  chunk->size = size;
+  chunk->elf_offset = elf_offset;
+  return chunk;
+}
+
+static void add_range(struct verify *verify, const char *kind, const char *name,
+  uint64_t elf_offset, const unsigned char *dol, size_t size)
+{
+  for (size_t done = 0; done < size; done += VERIFY_CHUNK_SIZE)
+    add_chunk(verify, kind, name, elf_offset + done, dol + done,
+      size - done < VERIFY_CHUNK_SIZE ? size - done : VERIFY_CHUNK_SIZE);
+}
+
+// Decompressed and compared as a whole:
+static void add_compressed(struct verify *verify, const char *name,
+  uint64_t elf_offset, size_t compressed_size, const unsigned char *dol, size_t size)
+{
+  struct verify_chunk *chunk = add_chunk(verify, "section", name, elf_offset, dol, size);
+  chunk->compressed_size = compressed_size;
+}
+
+static int compare_compressed(const struct verify_chunk *chunk)
+{
+  Elf32_Chdr chdr;
+  if (chunk->compressed_size < sizeof(Elf32_Chdr))
+    return -1;
+  memcpy(&chdr, chunk->elf, sizeof(Elf32_Chdr));
+  if (ntohl(chdr.ch_size) != chunk->size)
+    return 1;
+  const unsigned char *data = chunk->elf + sizeof(Elf32_Chdr);
+  size_t size = chunk->compressed_size - sizeof(Elf32_Chdr);
+  unsigned char *buffer = malloc(chunk->size);
+  if (!buffer)
+    return -1;
+
+  int res = -1;
+#ifdef HAVE_ZLIB
+  if (ntohl(chdr.ch_type) == ELFCOMPRESS_ZLIB) {
+    uLongf length = chunk->size;
+    if (uncompress(buffer, &length, data, size) == Z_OK && length == chunk->size)
+      res = 0;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (ntohl(chdr.ch_type) == ELFCOMPRESS_ZSTD) {
+    size_t length = ZSTD_decompress(buffer, chunk->size, data, size);
+    if (!ZSTD_isError(length) && length == chunk->size)
+      res = 0;
+  }
+#endif
+  (void) data;
+  (void) size;
+  if (res == 0)
+    res = memcmp(buffer, chunk->dol, chunk->size) != 0;
+  free(buffer);
+  return res;
+}
+
+// memcmp is vectorised by the C library, the chunks only spread the
+// regions over the threads:
+static void *chunk_worker(void *arg)
+{
+  struct verify *verify = arg;
+  while (1) {
+    size_t i = __sync_fetch_and_add(&verify->next, 1);
+    if (i >= verify->chunk_count)
+      return NULL;
+    struct verify_chunk *chunk = verify->chunks + i;
+    chunk->res = chunk->compressed_size ? compare_compressed(chunk)
+      : memcmp(chunk->elf, chunk->dol, chunk->size) != 0;
+  }
+}
+
+// The PT_LOAD segments of create_phdrs(): the text and data segments in
+// the order of the DOL header, then the bss. The offsets of the PT_LOAD of
+// the segments, already compared, are stored in load_offsets.
+static void check_loads(struct verify *verify, const struct dol_segment *segments,
+  uint64_t *load_offsets, size_t count)
+{
+  const Elf32_Ehdr *ehdr = (const Elf32_Ehdr*) verify->elf;
+  const Elf32_Phdr *phdrs = (const Elf32_Phdr*) (verify->elf + ntohl(ehdr->e_phoff));
+  size_t phnum = ntohs(ehdr->e_phnum);
+  uint32_t bss_size = ntohl(verify->dol.dhdr.bss_size);
+  size_t expected = count + (bss_size != 0);
+
+  size_t loads = 0;
+  for (size_t i = 0; i != phnum; ++i) {
+    const Elf32_Phdr *phdr = phdrs + i;
+    if (ntohl(phdr->p_type) != PT_LOAD)
+      continue;
+    size_t load = loads++;
+    if (load >= expected)
+      continue;
+    uint32_t offset = ntohl(phdr->p_offset);
+    uint32_t address = ntohl(phdr->p_vaddr);
+    uint32_t filesz = ntohl(phdr->p_filesz), memsz = ntohl(phdr->p_memsz);
+    if (load == count) {
+      if (address != ntohl(verify->dol.dhdr.bss_address) || filesz != 0 || memsz != bss_size)
+        report(verify, "PT_LOAD %zu does not match .bss", load);
+      continue;
+    }
+    const struct dol_segment *segment = segments + load;
+    if (address != segment->address || filesz != segment->size
+      || memsz != segment->size || !in_elf(verify, offset, filesz)) {
+      report(verify, "PT_LOAD %zu does not match %s", load, segment->name);
+      continue;
+    }
+    load_offsets[load] = offset;
+    add_range(verify, "PT_LOAD of", segment->name, offset,
+      verify->dol.data + segment->offset, segment->size);
+  }
+  // Compressed ELF files have no program headers:
+  if (loads != expected && phnum)
+    report(verify, "%zu PT_LOAD segments instead of %zu", loads, expected);
+}
+
+static const Elf32_Shdr *find_section(const struct verify *verify, const char *name)
+{
+  size_t length = strlen(name);
+  for (size_t i = 0; i != verify->shnum; ++i) {
+    uint32_t offset = ntohl(verify->shdrs[i].sh_name);
+    if (offset < verify->shstrtab_size
+      && verify->shstrtab_size - offset > length
+      && memcmp(verify->shstrtab + offset, name, length + 1) == 0)
+      return verify->shdrs + i;
+  }
+  return NULL;
+}
+
+// The sections of create_shdrs(): one per DOL segment, .bss and .dolhdr.
+static void check_sections(struct verify *verify, const struct dol_segment *segments,
+  const uint64_t *load_offsets, size_t count)
+{
+  const Elf32_Ehdr *ehdr = (const Elf32_Ehdr*) verify->elf;
+  size_t compressed = 0;
+  for (size_t i = 0; i != count; ++i) {
+    const struct dol_segment *segment = segments + i;
+    const Elf32_Shdr *shdr = find_section(verify, segment->name);
+    if (!shdr) {
+      report(verify, "missing section %s", segment->name);
+      continue;
+    }
+    uint32_t offset = ntohl(shdr->sh_offset), size = ntohl(shdr->sh_size);
+    if (ntohl(shdr->sh_type) != SHT_PROGBITS || ntohl(shdr->sh_addr) != segment->address
+      || !in_elf(verify, offset, size)) {
+      report(verify, "section %s does not match the DOL segment", segment->name);
+      continue;
+    }
+    if (ntohl(shdr->sh_flags) & SHF_COMPRESSED) {
+      ++compressed;
+      add_compressed(verify, segment->name, offset, size,
+        verify->dol.data + segment->offset, segment->size);
+      continue;
+    }
+    if (size != segment->size) {
+      report(verify, "section %s does not match the DOL segment", segment->name);
+      continue;
+    }
+    // Already compared through its PT_LOAD:
+    if (offset != load_offsets[i])
+      add_range(verify, "section", segment->name, offset,
+        verify->dol.data + segment->offset, segment->size);
+  }
+  if (count && !ehdr->e_phnum && compressed != count)
+    report(verify, "no PT_LOAD segments");
+
+  uint32_t bss_size = ntohl(verify->dol.dhdr.bss_size);
+  if (bss_size) {
+    const Elf32_Shdr *shdr = find_section(verify, ".bss");
+    if (!shdr || ntohl(shdr->sh_type) != SHT_NOBITS
+      || shdr->sh_addr != verify->dol.dhdr.bss_address || ntohl(shdr->sh_size) != bss_size)
+      report(verify, "section .bss does not match the DOL bss");
+  }
+
+  const Elf32_Shdr *shdr = find_section(verify, ".dolhdr");
+  if (!shdr || ntohl(shdr->sh_size) != sizeof(Dol_Hdr)
+    || !in_elf(verify, ntohl(shdr->sh_offset), sizeof(Dol_Hdr)))
+    report(verify, "section .dolhdr does not match the DOL header");
+  else
+    add_range(verify, "section", ".dolhdr", ntohl(shdr->sh_offset),
+      verify->dol.data, sizeof(Dol_Hdr));
+}
+
+static int check_headers(struct verify *verify)
+{
+  const Elf32_Ehdr *ehdr = (const Elf32_Ehdr*) verify->elf;
+  if (verify->elf_size < sizeof(Elf32_Ehdr)
+    || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+    || ehdr->e_ident[EI_CLASS] != ELFCLASS32 || ehdr->e_ident[EI_DATA] != ELFDATA2MSB
+    || ntohs(ehdr->e_machine) != EM_PPC) {
+    report(verify, "not a 32-bit big-endian PowerPC ELF file");
+    return -1;
+  }
+  size_t phnum = ntohs(ehdr->e_phnum), shnum = ntohs(ehdr->e_shnum);
+  uint32_t shstrndx = ntohs(ehdr->e_shstrndx);
+  if ((phnum && ntohs(ehdr->e_phentsize) != sizeof(Elf32_Phdr))
+    || ntohs(ehdr->e_shentsize) != sizeof(Elf32_Shdr)
+    || !in_elf(verify, ntohl(ehdr->e_phoff), phnum * sizeof(Elf32_Phdr))
+    || !in_elf(verify, ntohl(ehdr->e_shoff), shnum * sizeof(Elf32_Shdr))
+    || shstrndx >= shnum) {
+    report(verify, "invalid ELF headers");
+    return -1;
+  }
+  verify->shdrs = (const Elf32_Shdr*) (verify->elf + ntohl(ehdr->e_shoff));
+  verify->shnum = shnum;
+  const Elf32_Shdr *shstrtab = verify->shdrs + shstrndx;
+  if (!in_elf(verify, ntohl(shstrtab->sh_offset), ntohl(shstrtab->sh_size))) {
+    report(verify, "invalid ELF headers");
+    return -1;
+  }
+  verify->shstrtab = (const char*) verify->elf + ntohl(shstrtab->sh_offset);
+  verify->shstrtab_size = ntohl(shstrtab->sh_size);
+
+  if (ehdr->e_entry != verify->dol.dhdr.entry_point)
+    report(verify, "entry point 0x%08" PRIx32 " instead of 0x%08" PRIx32,
+      ntohl(ehdr->e_entry), ntohl(verify->dol.dhdr.entry_point));
+  return 0;
+}
+
+static void compare_chunks(struct verify *verify, int threads)
+{
+  if (threads <= 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if ((size_t) threads > verify->chunk_count)
+    threads = verify->chunk_count;
+
+  run_pool(verify, chunk_worker, threads);
+
+  // Only the first difference of each region:
+  const struct verify_chunk *last = NULL;
+  for (size_t i = 0; i != verify->chunk_count; ++i) {
+    const struct verify_chunk *chunk = verify->chunks + i;
+    if (!chunk->res || (last && last->kind == chunk->kind && last->name == chunk->name))
+      continue;
+    last = chunk;
+    if (chunk->res < 0) {
+      report(verify, "could not decompress section %s", chunk->name);
+    } else if (chunk->compressed_size) {
+      report(verify, "section %s differs from the DOL", chunk->name);
+    } else {
+      size_t j = 0;
+      while (j != chunk->size && chunk->elf[j] == chunk->dol[j])
+        ++j;
+      report(verify, "%s %s differs from the DOL at offset 0x%" PRIx64,
+        chunk->kind, chunk->name, chunk->elf_offset + j);
+    }
+  }
+}
+
+int dol2elf_verify(const char *dol_filename, const char *elf_filename, int threads)
+{
+  struct verify verify;
+  memset(&verify, 0, sizeof(struct verify));
+  verify.elf_filename = elf_filename;
+  void *elf = MAP_FAILED;
+  int elf_fd = -1;
+  int res = 1;
+
+  if (dol_load(dol_filename, "verify", &verify.dol) != 0)
+    return 1;
+
+  struct stat st;
+  elf_fd = open(elf_filename, O_RDONLY | O_CLOEXEC);
+  if (elf_fd < 0 || fstat(elf_fd, &st) != 0) {
+    fprintf(error_file(), "Could not open %s\n", elf_filename);
+    goto out;
+  }
+  verify.elf_size = st.st_size;
+  if (verify.elf_size) {
+    elf = mmap(NULL, verify.elf_size, PROT_READ, MAP_PRIVATE, elf_fd, 0);
+    if (elf == MAP_FAILED) {
+      fprintf(error_file(), "Could not map %s\n", elf_filename);
+      goto out;
+    }
+    madvise(elf, verify.elf_size, MADV_SEQUENTIAL);
+    verify.elf = elf;
+  }
+
+  if (check_headers(&verify) == 0) {
+    struct dol_segment segments[DOL_TEXT_COUNT + DOL_DATA_COUNT];
+    uint64_t load_offsets[DOL_TEXT_COUNT + DOL_DATA_COUNT];
+    size_t count = dol_segments(&verify.dol.dhdr, segments);
+    for (size_t i = 0; i != count; ++i)
+      load_offsets[i] = UINT64_MAX;
+    check_loads(&verify, segments, load_offsets, count);
+    check_sections(&verify, segments, load_offsets, count);
+    compare_chunks(&verify, threads);
+  }
+  res = verify.problems != 0;
+
+out:
+  free(verify.chunks);
+  if (elf != MAP_FAILED)
+    munmap(elf, verify.elf_size);
+  if (elf_fd >= 0)
+    close(elf_fd);
+  dol_release(&verify.dol);
+  return res;
+}
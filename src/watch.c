@@ -0,0 +1,316 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include "doltool.h"
+
+// Writes complete files, or files renamed into place:
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+enum {
+  WATCH_IDLE,
+  // Waiting for the end of a burst of events:
+  WATCH_PENDING,
+  WATCH_QUEUED,
+  WATCH_RUNNING,
+  // Changed again while being converted:
+  WATCH_DIRTY
+};
+
+struct watch_job {
+  struct batch_job job;
+  // Directory watch and name of the input in it:
+  int wd;
+  const char *name;
+  int state;
+  double deadline;
+};
+
+// Watched directories whose new inputs are converted as well:
+struct watch_dir {
+  int wd;
+  const char *path;
+  const char *output;
+};
+
+struct watch {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct watch_job **jobs;
+  size_t count;
+  // Jobs to convert:
+  struct watch_job **queue;
+  size_t queued;
+  struct watch_dir *dirs;
+  size_t dir_count;
+  int inotify_fd;
+  // Wakes the event loop up when a job has to be debounced again:
+  int wakeup_fd;
+  double debounce;
+  const struct converter *converter;
+};
+
+static int add_watch(struct watch *watch, const char *path)
+{
+  int wd = inotify_add_watch(watch->inotify_fd, path, WATCH_EVENTS | IN_ONLYDIR);
+  if (wd < 0)
+    fprintf(stderr, "Could not watch %s\n", path);
+  return wd;
+}
+
+// With the lock held:
+static int add_job(struct watch *watch, const struct batch_job *batch_job)
+{
+  // The parent directory is watched so that files replaced by a rename are
+  // still seen:
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", batch_job->dol_filename);
+  char *slash = strrchr(dir, '/');
+  const char *name = batch_job->dol_filename;
+  if (slash) {
+    name += slash - dir + 1;
+    *slash = '\0';
+    if (slash == dir)
+      strcpy(dir, "/");
+  } else {
+    strcpy(dir, ".");
+  }
+  int wd = add_watch(watch, dir);
+  if (wd < 0)
+    return -1;
+
+  struct watch_job *job = calloc(1, sizeof(struct watch_job));
+  struct watch_job **jobs = job
+    ? realloc(watch->jobs, (watch->count + 1) * sizeof(struct watch_job*)) : NULL;
+  if (jobs)
+    watch->jobs = jobs;
+  struct watch_job **queue = jobs
+    ? realloc(watch->queue, (watch->count + 1) * sizeof(struct watch_job*)) : NULL;
+  if (!queue) {
+    fputs("Could not allocate memory\n", stderr);
+    free(job);
+    return -1;
+  }
+  watch->queue = queue;
+  job->job = *batch_job;
+  job->wd = wd;
+  job->name = name;
+  job->state = WATCH_IDLE;
+  watch->jobs[watch->count++] = job;
+  return 0;
+}
+
+// With the lock held:
+static void enqueue(struct watch *watch, struct watch_job *job)
+{
+  job->state = WATCH_QUEUED;
+  watch->queue[watch->queued++] = job;
+  pthread_cond_signal(&watch->cond);
+}
+
+static void *watch_worker(void *arg)
+{
+  struct watch *watch = arg;
+  pthread_mutex_lock(&watch->lock);
+  while (1) {
+    while (!watch->queued)
+      pthread_cond_wait(&watch->cond, &watch->lock);
+    struct watch_job *job = watch->queue[0];
+    memmove(watch->queue, watch->queue + 1, --watch->queued * sizeof(struct watch_job*));
+    job->state = WATCH_RUNNING;
+    pthread_mutex_unlock(&watch->lock);
+
+    // Outputs are only replaced once complete:
+    double start = now();
+    int res = dol2elf_replace(job->job.dol_filename, job->job.elf_filename,
+      watch->converter->options, watch->converter->rel);
+    if (res == 0)
+      fprintf(stderr, "%s -> %s (%.1f ms)\n", job->job.dol_filename,
+        job->job.elf_filename, (now() - start) * 1e3);
+    else
+      fprintf(stderr, "Could not convert %s\n", job->job.dol_filename);
+
+    pthread_mutex_lock(&watch->lock);
+    if (job->state == WATCH_DIRTY) {
+      job->state = WATCH_PENDING;
+      job->deadline = now() + watch->debounce;
+      uint64_t one = 1;
+      if (write(watch->wakeup_fd, &one, sizeof(one)) != sizeof(one))
+        enqueue(watch, job);
+    } else {
+      job->state = WATCH_IDLE;
+    }
+  }
+  return NULL;
+}
+
+// With the lock held:
+static void handle_event(struct watch *watch, const struct inotify_event *event,
+  double deadline)
+{
+  struct watch_job *job = NULL;
+  for (size_t i = 0; i != watch->count && !job; ++i)
+    if (watch->jobs[i]->wd == event->wd && strcmp(watch->jobs[i]->name, event->name) == 0)
+      job = watch->jobs[i];
+
+  // New inputs of the watched directories:
+  if (!job && batch_is_input(event->name))
+    for (size_t i = 0; i != watch->dir_count && !job; ++i) {
+      if (watch->dirs[i].wd != event->wd)
+        continue;
+      struct batch_job batch_job;
+      if (batch_job_init(&batch_job, watch->dirs[i].path, event->name,
+          watch->dirs[i].output) != 0)
+        continue;
+      if (add_job(watch, &batch_job) == 0) {
+        job = watch->jobs[watch->count - 1];
+      } else {
+        free((char*) batch_job.dol_filename);
+        free((char*) batch_job.elf_filename);
+      }
+    }
+  if (!job)
+    return;
+
+  switch (job->state) {
+  case WATCH_IDLE:
+  case WATCH_PENDING:
+    job->state = WATCH_PENDING;
+    job->deadline = deadline;
+    break;
+  case WATCH_RUNNING:
+    job->state = WATCH_DIRTY;
+    break;
+  }
+}
+
+// Milliseconds until the first pending job, -1 when there is none. With
+// the lock held:
+static int dispatch(struct watch *watch)
+{
+  double current = now(), first = -1;
+  for (size_t i = 0; i != watch->count; ++i) {
+    struct watch_job *job = watch->jobs[i];
+    if (job->state != WATCH_PENDING)
+      continue;
+    if (job->deadline <= current)
+      enqueue(watch, job);
+    else if (first < 0 || job->deadline < first)
+      first = job->deadline;
+  }
+  return first < 0 ? -1 : (int) ((first - current) * 1e3) + 1;
+}
+
+int watch_run(struct batch_job *jobs, size_t count, const char **dirs,
+  const char **outputs, size_t dir_count, int threads, unsigned debounce_ms,
+  const struct converter *converter)
+{
+  struct watch watch;
+  memset(&watch, 0, sizeof(watch));
+  pthread_mutex_init(&watch.lock, NULL);
+  pthread_cond_init(&watch.cond, NULL);
+  watch.debounce = debounce_ms / 1e3;
+  watch.converter = converter;
+  watch.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  watch.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (watch.inotify_fd < 0 || watch.wakeup_fd < 0) {
+    fputs("Could not initialize inotify\n", stderr);
+    return 1;
+  }
+
+  watch.dirs = calloc(dir_count, sizeof(struct watch_dir));
+  if (dir_count && !watch.dirs) {
+    fputs("Could not allocate memory\n", stderr);
+    return 1;
+  }
+  for (size_t i = 0; i != dir_count; ++i) {
+    watch.dirs[i].wd = add_watch(&watch, dirs[i]);
+    watch.dirs[i].path = dirs[i];
+    watch.dirs[i].output = outputs[i];
+    if (watch.dirs[i].wd < 0)
+      return 1;
+  }
+  watch.dir_count = dir_count;
+  for (size_t i = 0; i != count; ++i)
+    if (add_job(&watch, jobs + i) != 0)
+      return 1;
+
+  // Everything is converted once, then only what changes:
+  pthread_mutex_lock(&watch.lock);
+  for (size_t i = 0; i != watch.count; ++i)
+    enqueue(&watch, watch.jobs[i]);
+  pthread_mutex_unlock(&watch.lock);
+  if (threads < 1)
+    threads = 1;
+  for (int i = 0; i != threads; ++i) {
+    pthread_t worker;
+    if (pthread_create(&worker, NULL, watch_worker, &watch) != 0) {
+      fputs("Could not start the watch threads\n", stderr);
+      return 1;
+    }
+    pthread_detach(worker);
+  }
+
+  int timeout = -1;
+  while (1) {
+    struct pollfd fds[2] = {
+      { watch.inotify_fd, POLLIN, 0 },
+      { watch.wakeup_fd, POLLIN, 0 },
+    };
+    if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+      fputs("Could not wait for inotify events\n", stderr);
+      return 1;
+    }
+    if (fds[1].revents) {
+      uint64_t value;
+      if (read(watch.wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        return 1;
+    }
+
+    pthread_mutex_lock(&watch.lock);
+    // Events are aligned on inotify_event:
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t size;
+    double deadline = now() + watch.debounce;
+    while ((size = read(watch.inotify_fd, buffer, sizeof(buffer))) > 0)
+      for (char *p = buffer; p < buffer + size; ) {
+        const struct inotify_event *event = (const struct inotify_event*) p;
+        if (event->len)
+          handle_event(&watch, event, deadline);
+        p += sizeof(struct inotify_event) + event->len;
+      }
+    timeout = dispatch(&watch);
+    pthread_mutex_unlock(&watch.lock);
+  }
+  return 0;
+}
@@ -0,0 +1,198 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Uses libdol2elf through its public header only: sizes, errors, the
+// whole image against its chunks, the program headers, the compact layout
+// and a symbol map.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "libdol2elf.h"
+
+#define DOL_HEADER_SIZE 0x100
+#define TEXT_ADDRESS 0x80003100
+#define TEXT_SIZE 0x200
+#define DATA_ADDRESS 0x80004000
+#define DATA_SIZE 0x120
+#define DOL_SIZE (DOL_HEADER_SIZE + TEXT_SIZE + DATA_SIZE)
+
+static void put32(unsigned char *p, uint32_t value)
+{
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+  return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint16_t get16(const unsigned char *p)
+{
+  return p[0] << 8 | p[1];
+}
+
+// text0 and data0, then a bss:
+static void make_dol(unsigned char *dol)
+{
+  memset(dol, 0, DOL_SIZE);
+  put32(dol + 0x00, DOL_HEADER_SIZE);
+  put32(dol + 0x1c, DOL_HEADER_SIZE + TEXT_SIZE);
+  put32(dol + 0x48, TEXT_ADDRESS);
+  put32(dol + 0x64, DATA_ADDRESS);
+  put32(dol + 0x90, TEXT_SIZE);
+  put32(dol + 0xac, DATA_SIZE);
+  put32(dol + 0xd8, DATA_ADDRESS + DATA_SIZE);
+  put32(dol + 0xdc, 0x1000);
+  put32(dol + 0xe0, TEXT_ADDRESS);
+  for (size_t i = DOL_HEADER_SIZE; i != DOL_SIZE; ++i)
+    dol[i] = i * 13 + 1;
+}
+
+static int check(int ok, const char *what)
+{
+  if (!ok)
+    fprintf(stderr, "%s\n", what);
+  return !ok;
+}
+
+static unsigned char *convert(const unsigned char *dol,
+  const struct dol2elf_options *options, size_t *size)
+{
+  unsigned char *elf;
+  if (dol2elf_size(dol, DOL_SIZE, options, size) != DOL2ELF_OK
+    || !(elf = malloc(*size)))
+    return NULL;
+  if (dol2elf_convert(dol, DOL_SIZE, elf, *size, options) != DOL2ELF_OK) {
+    free(elf);
+    return NULL;
+  }
+  return elf;
+}
+
+// The PT_LOAD segments hold the DOL segments at their addresses:
+static int check_loads(const unsigned char *elf, size_t size, const unsigned char *dol,
+  uint32_t align)
+{
+  uint32_t phoff = get32(elf + 28);
+  uint16_t phnum = get16(elf + 44);
+  int found = 0, failed = 0;
+  for (uint16_t i = 0; i != phnum; ++i) {
+    const unsigned char *phdr = elf + phoff + 32 * i;
+    uint32_t offset = get32(phdr + 4), address = get32(phdr + 8);
+    uint32_t filesz = get32(phdr + 16);
+    if (get32(phdr) != 1 || !filesz)
+      continue;
+    const unsigned char *expected = address == TEXT_ADDRESS ? dol + DOL_HEADER_SIZE
+      : address == DATA_ADDRESS ? dol + DOL_HEADER_SIZE + TEXT_SIZE : NULL;
+    failed |= check(expected && offset <= size && filesz <= size - offset
+      && memcmp(elf + offset, expected, filesz) == 0, "PT_LOAD does not match the DOL");
+    if (align)
+      failed |= check(offset % align == address % align, "PT_LOAD not aligned");
+    ++found;
+  }
+  return failed | check(found == 2, "PT_LOAD segments missing");
+}
+
+int main(void)
+{
+  static unsigned char dol[DOL_SIZE];
+  make_dol(dol);
+  int failed = 0;
+
+  size_t size;
+  unsigned char *elf = convert(dol, NULL, &size);
+  if (!elf)
+    return check(0, "could not convert the DOL");
+  failed |= check(memcmp(elf, "\177ELF", 4) == 0 && get16(elf + 16) == 2,
+    "not an ELF executable");
+  failed |= check(get32(elf + 24) == TEXT_ADDRESS, "wrong entry point");
+  failed |= check_loads(elf, size, dol, 0);
+
+  // Errors:
+  unsigned char *small = malloc(size);
+  size_t truncated_size;
+  failed |= check(dol2elf_convert(dol, DOL_SIZE, small, size - 1, NULL) == DOL2ELF_ENOSPC,
+    "conversion into a short buffer");
+  failed |= check(dol2elf_size(dol, DOL_SIZE - 1, NULL, &truncated_size) == DOL2ELF_EINVAL,
+    "size of a truncated DOL");
+  failed |= check(dol2elf_convert(dol, DOL_HEADER_SIZE - 1, small, size, NULL)
+    == DOL2ELF_EINVAL, "conversion of a truncated header");
+  failed |= check(dol2elf_strerror(DOL2ELF_EINVAL) != NULL, "no error message");
+  free(small);
+
+  // The chunks make up the same image:
+  size_t headers_size, chunk_count = DOL2ELF_MAX_CHUNKS;
+  struct dol2elf_chunk chunks[DOL2ELF_MAX_CHUNKS];
+  unsigned char *headers = NULL;
+  if (dol2elf_headers_size(dol, DOL_SIZE, NULL, &headers_size) != DOL2ELF_OK
+    || !(headers = malloc(headers_size))
+    || dol2elf_convert_chunks(dol, DOL_SIZE, headers, headers_size, chunks,
+      &chunk_count, NULL) != DOL2ELF_OK) {
+    failed |= check(0, "could not convert to chunks");
+  } else {
+    size_t offset = 0;
+    int same = 1;
+    for (size_t i = 0; i != chunk_count && same; ++i) {
+      const unsigned char *data = chunks[i].data;
+      same = chunks[i].size <= size - offset;
+      for (size_t j = 0; j != chunks[i].size && same; ++j)
+        same = elf[offset + j] == (data ? data[j] : 0);
+      offset += chunks[i].size;
+    }
+    failed |= check(same && offset == size, "chunks differ from the image");
+    size_t too_few = 1;
+    failed |= check(dol2elf_convert_chunks(dol, DOL_SIZE, headers, headers_size,
+      chunks, &too_few, NULL) == DOL2ELF_ENOSPC, "conversion into too few chunks");
+  }
+  free(headers);
+  free(elf);
+
+  // Compact layout:
+  struct dol2elf_options options;
+  memset(&options, 0, sizeof(options));
+  options.flags = DOL2ELF_COMPACT;
+  options.align = 0x1000;
+  elf = convert(dol, &options, &size);
+  failed |= check(elf && check_loads(elf, size, dol, options.align) == 0,
+    "compact conversion");
+  free(elf);
+
+  // Symbols end up in .symtab:
+  static const char map[] = "80003100 entry_function\n80004010 20 some_data\n";
+  struct dol2elf_symbols *symbols = dol2elf_symbols_parse(map, sizeof(map) - 1);
+  failed |= check(symbols && dol2elf_symbols_count(symbols) == 2, "symbol map");
+  memset(&options, 0, sizeof(options));
+  options.symbols = symbols;
+  elf = convert(dol, &options, &size);
+  failed |= check(elf && memmem(elf, size, "entry_function", 15)
+    && memmem(elf, size, "some_data", 10), "symbols missing from the ELF file");
+  free(elf);
+  dol2elf_symbols_free(symbols);
+  return failed;
+}
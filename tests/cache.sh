@@ -0,0 +1,17 @@
+#!/bin/sh
+# A cache hit gives the same ELF file as a fresh conversion, even after the
+# output of a previous hit was overwritten by another conversion.
+. "$(dirname "$0")/common.sh"
+
+"$MAKE_DOL" a.dol 1
+"$MAKE_DOL" b.dol 2
+"$DOL2ELF" a.dol fresh.elf 2>/dev/null
+
+"$DOL2ELF" --cache cc a.dol o1.elf 2>/dev/null
+"$DOL2ELF" b.dol o1.elf 2>/dev/null
+"$DOL2ELF" --cache cc a.dol o2.elf 2>/dev/null
+cmp o2.elf fresh.elf
+
+# A hit once more, over an existing output:
+"$DOL2ELF" --cache cc a.dol o1.elf 2>/dev/null
+cmp o1.elf fresh.elf
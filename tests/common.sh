@@ -0,0 +1,17 @@
+# Sourced by the tests, run as: sh test.sh DOL2ELF MAKE_DOL BUILD_DIR.
+# Each test works in its own empty directory, BUILD_DIR/<test name>.
+set -e
+DOL2ELF=$1
+MAKE_DOL=$2
+WORK=$3/$(basename "$0" .sh)
+rm -rf "$WORK"
+mkdir -p "$WORK"
+cd "$WORK"
+
+# Runs a command that must fail:
+fails() {
+  if "$@" 2>/dev/null; then
+    echo "unexpected success: $*" >&2
+    exit 1
+  fi
+}
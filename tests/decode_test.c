@@ -0,0 +1,154 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Decodes Yaz0, gzip and zstd streams made here, whole and truncated at
+// every length: truncated streams must fail instead of hanging or
+// returning garbage.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "doltool.h"
+
+#define DATA_SIZE 0x3000
+
+// Literals, and runs of the previous byte as distance 1 matches:
+static size_t yaz0_encode(const unsigned char *data, size_t size,
+  unsigned char *output)
+{
+  memcpy(output, "Yaz0", 4);
+  output[4] = size >> 24;
+  output[5] = size >> 16;
+  output[6] = size >> 8;
+  output[7] = size;
+  memset(output + 8, 0, 8);
+  size_t out = 16, in = 0;
+  while (in != size) {
+    size_t group = out++;
+    output[group] = 0;
+    for (int bit = 0; bit != 8 && in != size; ++bit) {
+      size_t run = 0;
+      while (in && in + run != size && run != 0x111 && data[in + run] == data[in - 1])
+        ++run;
+      if (run >= 3) {
+        if (run >= 0x12) {
+          output[out++] = 0;
+          output[out++] = 0;
+          output[out++] = run - 0x12;
+        } else {
+          output[out++] = (run - 2) << 4;
+          output[out++] = 0;
+        }
+        in += run;
+      } else {
+        output[group] |= 0x80 >> bit;
+        output[out++] = data[in++];
+      }
+    }
+  }
+  return out;
+}
+
+static int check(int format, const unsigned char *encoded, size_t encoded_size,
+  const unsigned char *data, size_t size)
+{
+  int failed = 0;
+  unsigned char *output = malloc(size);
+  uint64_t decoded_size;
+  if (decode_detect(encoded, encoded_size) != format
+    || decode_size(format, encoded, encoded_size, &decoded_size) != 0
+    || decoded_size != size
+    || decode(format, encoded, encoded_size, output, size) != 0
+    || memcmp(output, data, size) != 0) {
+    fprintf(stderr, "%s: could not decode\n", decode_name(format));
+    failed = 1;
+  }
+  // Only the trailer of a stream (gzip CRC and size) can be missing from a
+  // successful decode, which stops at the requested size:
+  for (size_t length = 0; length != encoded_size; ++length) {
+    memset(output, 0xa5, size);
+    if (decode(format, encoded, length, output, size) == 0
+      && (length < encoded_size / 2 || memcmp(output, data, size) != 0)) {
+      fprintf(stderr, "%s: decoded %zu of %zu bytes\n", decode_name(format),
+        length, encoded_size);
+      failed = 1;
+      break;
+    }
+  }
+  free(output);
+  return failed;
+}
+
+int main(void)
+{
+  static unsigned char data[DATA_SIZE];
+  uint32_t state = 1;
+  for (size_t i = 0; i != DATA_SIZE; ++i) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    // Runs of zeros between the random parts:
+    data[i] = (i / 0x100) % 2 ? 0 : state;
+  }
+  size_t allocated = 2 * DATA_SIZE + 1024;
+  unsigned char *encoded = malloc(allocated);
+  int failed = 0;
+
+  size_t size = yaz0_encode(data, DATA_SIZE, encoded);
+  failed |= check(DECODE_YAZ0, encoded, size, data, DATA_SIZE);
+
+#ifdef HAVE_ZLIB
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, 9, Z_DEFLATED, 16 + MAX_WBITS, 8,
+      Z_DEFAULT_STRATEGY) != Z_OK)
+    return 1;
+  stream.next_in = data;
+  stream.avail_in = DATA_SIZE;
+  stream.next_out = encoded;
+  stream.avail_out = allocated;
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+    return 1;
+  size = stream.total_out;
+  deflateEnd(&stream);
+  failed |= check(DECODE_GZIP, encoded, size, data, DATA_SIZE);
+#endif
+
+#ifdef HAVE_ZSTD
+  size = ZSTD_compress(encoded, allocated, data, DATA_SIZE, 3);
+  if (ZSTD_isError(size))
+    return 1;
+  failed |= check(DECODE_ZSTD, encoded, size, data, DATA_SIZE);
+#endif
+
+  free(encoded);
+  return failed;
+}
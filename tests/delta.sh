@@ -0,0 +1,17 @@
+#!/bin/sh
+# A delta applied to the old DOL rebuilds the new one, or its ELF file, and
+# is refused by another DOL.
+. "$(dirname "$0")/common.sh"
+
+"$MAKE_DOL" old.dol 1
+"$MAKE_DOL" new.dol 1 40
+"$MAKE_DOL" other.dol 2
+"$DOL2ELF" new.dol fresh.elf 2>/dev/null
+
+"$DOL2ELF" --delta-create new.delta old.dol new.dol 2>/dev/null
+"$DOL2ELF" --delta-apply new.delta old.dol rebuilt.dol 2>/dev/null
+cmp rebuilt.dol new.dol
+"$DOL2ELF" --delta-apply new.delta old.dol rebuilt.ELF 2>/dev/null
+cmp rebuilt.ELF fresh.elf
+
+fails "$DOL2ELF" --delta-apply new.delta other.dol wrong.dol
@@ -0,0 +1,81 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Writes a small DOL file for the tests: two text segments, three data
+// segments separated by padding and a bss. The contents depend on SEED,
+// EDITS bytes of the second text segment are then changed.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <arpa/inet.h>
+
+#include "doltool.h"
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fputs("Usage: make_dol foo.dol SEED [EDITS]\n", stderr);
+    return 1;
+  }
+  uint32_t state = strtoul(argv[2], NULL, 0) * 2654435761u + 1;
+  unsigned edits = argc > 3 ? strtoul(argv[3], NULL, 0) : 0;
+
+  Dol_Hdr dhdr;
+  memset(&dhdr, 0, sizeof(Dol_Hdr));
+  uint32_t file_offset = sizeof(Dol_Hdr);
+  uint32_t vaddr = 0x80003100;
+  static const uint32_t text_sizes[] = { 0x1200, 0x800 };
+  static const uint32_t data_sizes[] = { 0x900, 0x400, 0x2000 };
+  for (int i = 0; i != 2; ++i)
+    synthetic_add_text(&dhdr, i, text_sizes[i], &file_offset, &vaddr);
+  for (int i = 0; i != 3; ++i) {
+    // Zero padding between the data segments:
+    file_offset += 0x20;
+    vaddr += 0x40;
+    synthetic_add_data(&dhdr, i, data_sizes[i], &file_offset, &vaddr);
+  }
+  dhdr.bss_address = htonl(vaddr);
+  dhdr.bss_size = htonl(0x1000);
+  dhdr.entry_point = dhdr.text_address[0];
+
+  unsigned char *dol = calloc(1, file_offset);
+  memcpy(dol, &dhdr, sizeof(Dol_Hdr));
+  for (int i = 0; i != 2; ++i)
+    for (uint32_t j = 0; j != text_sizes[i]; ++j)
+      dol[ntohl(dhdr.text_offset[i]) + j] = synthetic_random(&state);
+  // The last data segment is mostly zeros:
+  for (int i = 0; i != 3; ++i)
+    for (uint32_t j = 0; j != data_sizes[i] && j != 0x400; ++j)
+      dol[ntohl(dhdr.data_offset[i]) + j] = (j * 7 + i) & 0xff;
+  for (unsigned i = 0; i != edits; ++i)
+    dol[ntohl(dhdr.text_offset[1]) + (i * 97) % text_sizes[1]] ^= 0x5a;
+
+  FILE *file = fopen(argv[1], "wb");
+  if (!file || fwrite(dol, 1, file_offset, file) != file_offset || fclose(file) != 0) {
+    fprintf(stderr, "Could not write %s\n", argv[1]);
+    return 1;
+  }
+  free(dol);
+  return 0;
+}
@@ -0,0 +1,245 @@
+/* The MIT License (MIT)
+
+Copyright (c) 2015 Gabriel Corona
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// Converts a REL module made here, whose relocations point into its own
+// text, data and bss and into the main DOL: relocated at a base address
+// the code is patched, otherwise the relocations are left to a linker.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include <elf.h>
+
+#include "doltool.h"
+
+#define MODULE_ID 5
+#define HEADER_SIZE 0x4c
+#define SECTION_TABLE HEADER_SIZE
+#define TEXT_OFFSET 0x80
+#define TEXT_SIZE 0x40
+#define DATA_OFFSET 0xc0
+#define DATA_SIZE 0x20
+#define BSS_SIZE 0x40
+#define IMP_OFFSET (DATA_OFFSET + DATA_SIZE)
+#define RELOC_OFFSET (IMP_OFFSET + 2 * 8)
+#define SELF_RELOCS 6
+#define MAIN_RELOCS 3
+#define REL_SIZE (RELOC_OFFSET + (SELF_RELOCS + MAIN_RELOCS) * 8)
+
+#define R_DOLPHIN_SECTION 202
+#define R_DOLPHIN_END 203
+
+#define BASE 0x80500000
+#define MAIN_ADDRESS 0x80001234
+
+static unsigned char *put32(unsigned char *p, uint32_t value)
+{
+  uint32_t be = htonl(value);
+  memcpy(p, &be, 4);
+  return p + 4;
+}
+
+static unsigned char *put_reloc(unsigned char *p, uint16_t offset, uint8_t type,
+  uint8_t section, uint32_t addend)
+{
+  p[0] = offset >> 8;
+  p[1] = offset;
+  p[2] = type;
+  p[3] = section;
+  return put32(p + 4, addend);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+  uint32_t be;
+  memcpy(&be, p, 4);
+  return ntohl(be);
+}
+
+static uint16_t get16(const unsigned char *p)
+{
+  return p[0] << 8 | p[1];
+}
+
+// Version 3 module: section 1 is the text, 2 the data and 3 the bss.
+static void make_rel(unsigned char *rel)
+{
+  memset(rel, 0, REL_SIZE);
+  uint32_t header[] = { MODULE_ID, 0, 0, 4, SECTION_TABLE, 0, 0, 3, BSS_SIZE,
+    RELOC_OFFSET, IMP_OFFSET, 2 * 8 };
+  unsigned char *p = rel;
+  for (size_t i = 0; i != sizeof(header) / sizeof(header[0]); ++i)
+    p = put32(p, header[i]);
+  // Prolog, epilog and unresolved in the text, then the bss section:
+  p[0] = 1;
+  p[1] = 1;
+  p[2] = 1;
+  p[3] = 3;
+  p = put32(p + 4, 0);
+  p = put32(p, 4);
+  p = put32(p, 8);
+  p = put32(p, 32);
+  p = put32(p, 32);
+  put32(p, IMP_OFFSET);
+
+  p = rel + SECTION_TABLE + 8;
+  p = put32(p, TEXT_OFFSET | 1);
+  p = put32(p, TEXT_SIZE);
+  p = put32(p, DATA_OFFSET);
+  p = put32(p, DATA_SIZE);
+  p = put32(p, 0);
+  put32(p, BSS_SIZE);
+
+  // nop everywhere, bl at 0xc:
+  for (uint32_t i = 0; i != TEXT_SIZE; i += 4)
+    put32(rel + TEXT_OFFSET + i, i == 0xc ? 0x48000001 : 0x60000000);
+  for (uint32_t i = 0; i != DATA_SIZE; ++i)
+    rel[DATA_OFFSET + i] = i;
+
+  p = put32(rel + IMP_OFFSET, MODULE_ID);
+  p = put32(p, RELOC_OFFSET);
+  p = put32(p, 0);
+  put32(p, RELOC_OFFSET + SELF_RELOCS * 8);
+
+  p = rel + RELOC_OFFSET;
+  p = put_reloc(p, 0, R_DOLPHIN_SECTION, 1, 0);
+  p = put_reloc(p, 0, R_PPC_ADDR32, 2, 4);
+  p = put_reloc(p, 6, R_PPC_ADDR16_HA, 3, 0x8010);
+  p = put_reloc(p, 4, R_PPC_ADDR16_LO, 3, 0x8010);
+  p = put_reloc(p, 2, R_PPC_REL24, 1, 0x20);
+  p = put_reloc(p, 0, R_DOLPHIN_END, 0, 0);
+  p = put_reloc(p, 0, R_DOLPHIN_SECTION, 1, 0);
+  p = put_reloc(p, 0x10, R_PPC_ADDR32, 0, MAIN_ADDRESS);
+  put_reloc(p, 0, R_DOLPHIN_END, 0, 0);
+}
+
+static const Elf32_Shdr *find_text(const unsigned char *elf, size_t size)
+{
+  const Elf32_Ehdr *ehdr = (const Elf32_Ehdr*) elf;
+  uint32_t shoff = ntohl(ehdr->e_shoff);
+  uint16_t shnum = ntohs(ehdr->e_shnum);
+  if (shoff > size || (size - shoff) / sizeof(Elf32_Shdr) < shnum)
+    return NULL;
+  const Elf32_Shdr *shdrs = (const Elf32_Shdr*) (elf + shoff);
+  for (uint16_t i = 0; i != shnum; ++i)
+    if (ntohl(shdrs[i].sh_type) == SHT_PROGBITS
+      && (ntohl(shdrs[i].sh_flags) & SHF_EXECINSTR)
+      && ntohl(shdrs[i].sh_size) == TEXT_SIZE
+      && ntohl(shdrs[i].sh_offset) <= size - TEXT_SIZE)
+      return shdrs + i;
+  return NULL;
+}
+
+static size_t count_relas(const unsigned char *elf)
+{
+  const Elf32_Ehdr *ehdr = (const Elf32_Ehdr*) elf;
+  const Elf32_Shdr *shdrs = (const Elf32_Shdr*) (elf + ntohl(ehdr->e_shoff));
+  size_t count = 0;
+  for (uint16_t i = 0; i != ntohs(ehdr->e_shnum); ++i)
+    if (ntohl(shdrs[i].sh_type) == SHT_RELA)
+      count += ntohl(shdrs[i].sh_size) / sizeof(Elf32_Rela);
+  return count;
+}
+
+// Returns the ELF file, NULL when the conversion failed:
+static unsigned char *convert(const unsigned char *rel, const struct rel_options *options,
+  size_t *size)
+{
+  int rel_fd = memfd_create("rel", MFD_CLOEXEC);
+  int elf_fd = memfd_create("elf", MFD_CLOEXEC);
+  unsigned char *elf = NULL;
+  struct stat st;
+  if (rel_fd >= 0 && elf_fd >= 0 && pwrite_all(rel_fd, rel, REL_SIZE, 0) == 0
+    && dol2elf_fd(rel_fd, elf_fd, "test.rel", NULL, options) == 0
+    && fstat(elf_fd, &st) == 0 && st.st_size >= (off_t) sizeof(Elf32_Ehdr)
+    && (elf = malloc(st.st_size))
+    && pread(elf_fd, elf, st.st_size, 0) == st.st_size)
+    *size = st.st_size;
+  else {
+    free(elf);
+    elf = NULL;
+  }
+  if (rel_fd >= 0)
+    close(rel_fd);
+  if (elf_fd >= 0)
+    close(elf_fd);
+  return elf;
+}
+
+static int check(int ok, const char *what)
+{
+  if (!ok)
+    fprintf(stderr, "%s\n", what);
+  return !ok;
+}
+
+int main(void)
+{
+  static unsigned char rel[REL_SIZE];
+  make_rel(rel);
+  int failed = 0;
+
+  // Relocated: the code holds the final addresses.
+  struct rel_options relocation = { BASE };
+  size_t size;
+  unsigned char *elf = convert(rel, &relocation, &size);
+  if (!elf)
+    return check(0, "could not convert the module at a base address");
+  const Elf32_Ehdr *ehdr = (const Elf32_Ehdr*) elf;
+  const Elf32_Shdr *shdr = find_text(elf, size);
+  failed |= check(ntohs(ehdr->e_type) == ET_EXEC, "relocated module not ET_EXEC");
+  failed |= check(shdr && ntohl(shdr->sh_addr) == BASE + TEXT_OFFSET,
+    "text not at its relocated address");
+  if (shdr) {
+    const unsigned char *text = elf + ntohl(shdr->sh_offset);
+    uint32_t bss = (BASE + REL_SIZE + 31) & ~31u;
+    failed |= check(get32(text) == BASE + DATA_OFFSET + 4, "R_PPC_ADDR32 to the data");
+    failed |= check(get16(text + 6) == (uint16_t) ((bss + 0x8010 + 0x8000) >> 16),
+      "R_PPC_ADDR16_HA to the bss");
+    failed |= check(get16(text + 10) == (uint16_t) (bss + 0x8010),
+      "R_PPC_ADDR16_LO to the bss");
+    failed |= check(get32(text + 0xc) == 0x48000015, "R_PPC_REL24 in the text");
+    failed |= check(get32(text + 0x10) == MAIN_ADDRESS, "R_PPC_ADDR32 to the DOL");
+  }
+  failed |= check(count_relas(elf) == 0, "relocations left after relocating");
+  free(elf);
+
+  // Relocatable: the code is untouched and every relocation is kept.
+  elf = convert(rel, NULL, &size);
+  if (!elf)
+    return check(0, "could not convert the module");
+  ehdr = (const Elf32_Ehdr*) elf;
+  shdr = find_text(elf, size);
+  failed |= check(ntohs(ehdr->e_type) == ET_REL, "module not ET_REL");
+  failed |= check(shdr && memcmp(elf + ntohl(shdr->sh_offset), rel + TEXT_OFFSET,
+    TEXT_SIZE) == 0, "text of the relocatable module changed");
+  failed |= check(count_relas(elf) == SELF_RELOCS - 2 + MAIN_RELOCS - 2,
+    "relocations missing from the relocatable module");
+  free(elf);
+  return failed;
+}
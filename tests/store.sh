@@ -0,0 +1,25 @@
+#!/bin/sh
+# The DOL files added to a store come back unchanged, as well as their ELF
+# files, and the segments shared by the files are only stored once.
+. "$(dirname "$0")/common.sh"
+
+"$MAKE_DOL" a.dol 1
+"$MAKE_DOL" b.dol 1 3
+"$DOL2ELF" a.dol a.elf 2>/dev/null
+"$DOL2ELF" b.dol b.elf 2>/dev/null
+
+# b.dol only differs from a.dol in its second text segment, the one object
+# it adds:
+"$DOL2ELF" --store-add st a.dol 2>/dev/null
+a_objects=$(find st/objects -type f | wc -l)
+"$DOL2ELF" --store-add st b.dol 2>/dev/null
+test "$(find st/objects -type f | wc -l)" -eq $((a_objects + 1))
+
+"$DOL2ELF" --store-get st a a2.dol 2>/dev/null
+"$DOL2ELF" --store-get st b b2.dol 2>/dev/null
+cmp a2.dol a.dol
+cmp b2.dol b.dol
+"$DOL2ELF" --store-get st a a2.ELF 2>/dev/null
+"$DOL2ELF" --store-get st b b2.elf 2>/dev/null
+cmp a2.ELF a.elf
+cmp b2.elf b.elf
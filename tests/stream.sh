@@ -0,0 +1,25 @@
+#!/bin/sh
+# Converting from a pipe, to a pipe or both gives the same ELF file as
+# converting the files, compact layout and gzip input included.
+. "$(dirname "$0")/common.sh"
+
+"$MAKE_DOL" a.dol 1
+"$DOL2ELF" a.dol fresh.elf 2>/dev/null
+"$DOL2ELF" -c a.dol compact.elf 2>/dev/null
+
+cat a.dol | "$DOL2ELF" - from_pipe.elf 2>/dev/null
+cmp from_pipe.elf fresh.elf
+"$DOL2ELF" a.dol - 2>/dev/null | cat > to_pipe.elf
+cmp to_pipe.elf fresh.elf
+cat a.dol | "$DOL2ELF" - - 2>/dev/null | cat > both.elf
+cmp both.elf fresh.elf
+cat a.dol | "$DOL2ELF" -c - - 2>/dev/null | cat > both_compact.elf
+cmp both_compact.elf compact.elf
+
+# Only when built with zlib:
+if command -v gzip >/dev/null && gzip -c a.dol > a.dol.gz \
+  && "$DOL2ELF" a.dol.gz gz.elf 2>/dev/null; then
+  cmp gz.elf fresh.elf
+  cat a.dol.gz | "$DOL2ELF" - - 2>/dev/null | cat > gz_pipe.elf
+  cmp gz_pipe.elf fresh.elf
+fi
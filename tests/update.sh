@@ -0,0 +1,19 @@
+#!/bin/sh
+# An incremental update gives the same ELF file as a fresh incremental
+# conversion, in place when only segment contents changed, and rewrites an
+# ELF file converted without --incremental.
+. "$(dirname "$0")/common.sh"
+
+"$MAKE_DOL" a.dol 1
+"$DOL2ELF" --incremental a.dol out.elf 2>/dev/null
+"$DOL2ELF" a.dol plain.elf 2>/dev/null
+inode=$(stat -c %i out.elf)
+
+"$MAKE_DOL" a.dol 1 40
+"$DOL2ELF" --incremental a.dol fresh.elf 2>/dev/null
+"$DOL2ELF" --incremental a.dol out.elf 2>/dev/null
+cmp out.elf fresh.elf
+test "$(stat -c %i out.elf)" -eq "$inode"
+
+"$DOL2ELF" --incremental a.dol plain.elf 2>/dev/null
+cmp plain.elf fresh.elf
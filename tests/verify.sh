@@ -0,0 +1,15 @@
+#!/bin/sh
+# An ELF file converted from a DOL passes verification against it and fails
+# against another DOL; verifying a directory does not create the output one.
+. "$(dirname "$0")/common.sh"
+mkdir dols
+
+"$MAKE_DOL" dols/a.dol 1
+"$MAKE_DOL" dols/b.dol 1 5
+"$DOL2ELF" dols/ elfs/ 2>/dev/null
+"$DOL2ELF" --verify dols/a.dol elfs/a.elf dols/b.dol elfs/b.elf 2>/dev/null
+"$DOL2ELF" -j 2 --verify dols/ elfs/ 2>/dev/null
+
+fails "$DOL2ELF" --verify dols/a.dol elfs/b.elf
+fails "$DOL2ELF" --verify dols/ missing/
+test ! -e missing